@@ -0,0 +1,199 @@
+#include "CapacityModel.h"
+#include "QSVTranscode.h"
+#include "Metrics.h"
+extern "C"
+{
+    #include <libavutil/time.h>
+}
+
+//relative weight of each stage in pixels per second
+#define COST_DECODE     1.0
+#define COST_FILTER     0.3
+#define COST_ENCODE     2.0
+
+#define GPU_SAMPLE_US   1000000
+
+static const char* backend_name(int backend)
+{
+    return (backend == BACKEND_CPU) ? "cpu" : "qsv";
+}
+
+static int64_t gpu_idle_ms()
+{
+    //time the gt spent in rc6 (idle), newer kernels list it per gt
+    static const char* paths[] = {"/sys/class/drm/card0/gt/gt0/rc6_residency_ms", "/sys/class/drm/card0/power/rc6_residency_ms"};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    {
+        long long ms = 0;
+        FILE* file = fopen(paths[i], "r");
+        if (!file)
+            continue;
+        int n = fscanf(file, "%lld", &ms);
+        fclose(file);
+        if (n == 1)
+            return ms;
+    }
+    return -1;
+}
+
+CapacityModel& CapacityModel::Instance()
+{
+    static CapacityModel model;
+    return model;
+}
+
+CapacityModel::CapacityModel()
+    : Reserve(0.1)
+    , QueueWhenFull(true)
+    , Cores(FFMAX(1, (int)boost::thread::hardware_concurrency()))
+    , GpuSampleTime(0)
+    , GpuIdleMs(0)
+    , GpuBusyShare(-1)
+{
+    PixelRate[BACKEND_QSV] = 2.0e9;
+    PixelRate[BACKEND_CPU] = 90.0e6 * Cores;
+    Calibration[BACKEND_QSV] = 1.0;
+    Calibration[BACKEND_CPU] = 1.0;
+}
+
+void CapacityModel::Configure(double qsvpixelrate, double cpupixelrate, double reserve, bool queuewhenfull)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    if (qsvpixelrate > 0)
+        PixelRate[BACKEND_QSV] = qsvpixelrate;
+    if (cpupixelrate > 0)
+        PixelRate[BACKEND_CPU] = cpupixelrate;
+    Reserve = reserve;
+    QueueWhenFull = queuewhenfull;
+    Publish();
+}
+
+double CapacityModel::EstimateCost(int backend, int width, int height, double fps, OutputInfo* out)
+{
+    double inpixels  = (double)width * height * fps;
+    double outpixels = (double)out->VideoWidth * out->VideoHeight * fps;
+    return (inpixels * COST_DECODE + (inpixels + outpixels) * COST_FILTER + outpixels * COST_ENCODE) / PixelRate[backend];
+}
+
+double CapacityModel::Load(int backend)
+{
+    double load = 0;
+    for (std::map<void*, CapacitySession>::iterator it = Sessions.begin(); it != Sessions.end(); ++it)
+    {
+        if (it->second.Backend == backend)
+            load += it->second.Cost;
+    }
+    return load * Calibration[backend];
+}
+
+int CapacityModel::Admit(void* session, int width, int height, double fps, OutputInfo* out)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    int result = ADMISSION_ACCEPT;
+    int backend = out->Backend;
+    double cost = EstimateCost(backend, width, height, fps, out);
+
+    if (Load(backend) + cost * Calibration[backend] > 1.0 - Reserve)
+    {
+        result = QueueWhenFull ? ADMISSION_QUEUE : ADMISSION_REJECT;
+        //without a cpu encoder the hardware encoder name would be opened on the cpu route
+        if ((backend == BACKEND_QSV) && out->CpuEncoderName && avcodec_find_encoder_by_name(out->CpuEncoderName))
+        {
+            double cpucost = EstimateCost(BACKEND_CPU, width, height, fps, out);
+            if (Load(BACKEND_CPU) + cpucost * Calibration[BACKEND_CPU] <= 1.0 - Reserve)
+            {
+                result = ADMISSION_CPU;
+                backend = BACKEND_CPU;
+                cost = cpucost;
+            }
+        }
+    }
+    if ((result == ADMISSION_ACCEPT) || (result == ADMISSION_CPU))
+    {
+        CapacitySession& entry = Sessions[session];
+        entry.Backend = backend;
+        entry.Cost = cost;
+        entry.Busy = -1;
+    }
+    Publish();
+    return result;
+}
+
+void CapacityModel::Release(void* session)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    Sessions.erase(session);
+    Publish();
+}
+
+void CapacityModel::Report(void* session, int64_t busytime, int64_t walltime)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    std::map<void*, CapacitySession>::iterator it = Sessions.find(session);
+    if ((it == Sessions.end()) || (walltime <= 0))
+        return;
+    //busy is thread time, so one session can use several cores
+    it->second.Busy = (double)busytime / walltime / Cores;
+    Calibrate(it->second.Backend);
+    Publish();
+}
+
+void CapacityModel::Calibrate(int backend)
+{
+    double cost = 0;
+    double busy = 0;
+    if (backend == BACKEND_QSV)
+    {
+        //qsv session threads mostly wait for the gpu, so the gpu's own busy share is compared with all qsv sessions
+        if ((busy = GpuBusy()) < 0)
+            return;
+        for (std::map<void*, CapacitySession>::iterator it = Sessions.begin(); it != Sessions.end(); ++it)
+            cost += (it->second.Backend == backend) ? it->second.Cost : 0;
+    }
+    else
+    {
+        for (std::map<void*, CapacitySession>::iterator it = Sessions.begin(); it != Sessions.end(); ++it)
+        {
+            if ((it->second.Backend == backend) && (it->second.Busy >= 0))
+            {
+                cost += it->second.Cost;
+                busy += it->second.Busy;
+            }
+        }
+    }
+    if (cost <= 0)
+        return;
+    //measured share of the whole backend over the summed prediction, smoothed, so the model follows what the box really does
+    double& calibration = Calibration[backend];
+    calibration = calibration * 0.9 + FFMIN(FFMAX(busy / cost, 0.25), 4.0) * 0.1;
+}
+
+double CapacityModel::GpuBusy()
+{
+    int64_t now = av_gettime_relative();
+    if (now - GpuSampleTime < GPU_SAMPLE_US)
+        return GpuBusyShare;
+    int64_t idle = gpu_idle_ms();
+    if (idle < 0)
+        return -1;
+    if (GpuSampleTime)
+        GpuBusyShare = FFMIN(FFMAX(1.0 - (idle - GpuIdleMs) * 1000.0 / (now - GpuSampleTime), 0.0), 1.0);
+    GpuSampleTime = now;
+    GpuIdleMs = idle;
+    return GpuBusyShare;
+}
+
+void CapacityModel::Publish()
+{
+    for (int backend = BACKEND_QSV; backend <= BACKEND_CPU; backend++)
+    {
+        std::string label = Metrics::Label("backend", backend_name(backend));
+        int sessions = 0;
+        for (std::map<void*, CapacitySession>::iterator it = Sessions.begin(); it != Sessions.end(); ++it)
+            sessions += (it->second.Backend == backend);
+        Metrics::Set("capacity_load", label, Load(backend));
+        Metrics::Set("capacity_headroom", label, 1.0 - Reserve - Load(backend));
+        Metrics::Set("capacity_calibration", label, Calibration[backend]);
+        Metrics::Set("capacity_sessions", label, sessions);
+    }
+}
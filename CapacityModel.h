@@ -0,0 +1,54 @@
+#ifndef CAPACITYMODEL_H
+#define CAPACITYMODEL_H
+
+#include <map>
+#include <boost/thread.hpp>
+
+struct OutputInfo;
+
+enum AdmissionResult
+{
+    ADMISSION_ACCEPT = 0,
+    ADMISSION_CPU,      //accepted, but routed to the CPU backend
+    ADMISSION_QUEUE,    //no room now, retry later
+    ADMISSION_REJECT
+};
+
+struct CapacitySession
+{
+    int     Backend;
+    double  Cost;       //estimated share of one backend, before calibration
+    double  Busy;       //measured share of all cores from the last report, <0 before it
+};
+
+//estimates each session's load from its input and output, calibrated against measured pipeline time
+class CapacityModel
+{
+    public:
+        static CapacityModel& Instance();
+
+        void Configure(double qsvpixelrate, double cpupixelrate, double reserve, bool queuewhenfull);
+        double EstimateCost(int backend, int width, int height, double fps, OutputInfo* out);
+        int Admit(void* session, int width, int height, double fps, OutputInfo* out);
+        void Release(void* session);
+        void Report(void* session, int64_t busytime, int64_t walltime);
+    private:
+        CapacityModel();
+        double Load(int backend);
+        void Calibrate(int backend);
+        double GpuBusy();
+        void Publish();
+    private:
+        boost::mutex        Lock;
+        double              PixelRate[2];
+        double              Calibration[2];
+        double              Reserve;
+        bool                QueueWhenFull;
+        int                 Cores;
+        int64_t             GpuSampleTime;
+        int64_t             GpuIdleMs;
+        double              GpuBusyShare;   //<0 until two samples were taken or without rc6 counters
+        std::map<void*, CapacitySession> Sessions;
+};
+
+#endif // CAPACITYMODEL_H
@@ -0,0 +1,55 @@
+#include "Checkpoint.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+bool Checkpoint::Load(const char* path, CheckpointInfo* info)
+{
+    char line[4096];
+    int fields = 0;
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return false;
+    info->Done = false;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        char* value = strchr(line, '=');
+        if (!value)
+            continue;
+        *value++ = 0;
+        if (!strcmp(line, "input"))
+            info->InputUrl = value, fields++;
+        else if (!strcmp(line, "output"))
+            info->OutputUrl = value, fields++;
+        else if (!strcmp(line, "video_pts"))
+            fields += sscanf(value, "%" SCNd64, &info->VideoPts);
+        else if (!strcmp(line, "audio_pts"))
+            fields += sscanf(value, "%" SCNd64, &info->AudioPts);
+        else if (!strcmp(line, "output_offset"))
+            fields += sscanf(value, "%" SCNd64, &info->OutputOffset);
+        else if (!strcmp(line, "frames"))
+            fields += sscanf(value, "%" SCNd64, &info->Frames);
+        else if (!strcmp(line, "done"))
+            info->Done = (atoi(value) != 0);
+    }
+    fclose(file);
+    return fields == 6;
+}
+
+bool Checkpoint::Save(const char* path, const CheckpointInfo& info)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "w");
+    if (!file)
+        return false;
+    bool ok = fprintf(file, "input=%s\noutput=%s\nvideo_pts=%" PRId64 "\naudio_pts=%" PRId64 "\noutput_offset=%" PRId64 "\nframes=%" PRId64 "\ndone=%d\n"
+                      , info.InputUrl.c_str(), info.OutputUrl.c_str(), info.VideoPts, info.AudioPts
+                      , info.OutputOffset, info.Frames, info.Done ? 1 : 0) > 0;
+    ok = (fflush(file) == 0) && ok;
+    ok = (fsync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+    return ok && (rename(tmp.c_str(), path) == 0);
+}
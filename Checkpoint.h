@@ -0,0 +1,26 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <string>
+
+struct CheckpointInfo
+{
+    std::string InputUrl;
+    std::string OutputUrl;
+    int64_t     VideoPts;       //input pts of the IDR frame that starts the next GOP
+    int64_t     AudioPts;       //input pts of the last audio packet already in the output
+    int64_t     OutputOffset;   //output bytes that are complete up to VideoPts
+    int64_t     Frames;
+    bool        Done;
+};
+
+//resume point of a file transcode, written atomically so a crash leaves the previous one intact
+class Checkpoint
+{
+    public:
+        static bool Load(const char* path, CheckpointInfo* info);
+        static bool Save(const char* path, const CheckpointInfo& info);
+};
+
+#endif // CHECKPOINT_H
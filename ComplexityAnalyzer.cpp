@@ -0,0 +1,414 @@
+#include "ComplexityAnalyzer.h"
+#include "SessionMemory.h"
+#include "Metrics.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+extern "C"
+{
+    #include <libavfilter/buffersink.h>
+    #include <libavfilter/buffersrc.h>
+    #include <libavutil/hwcontext.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/time.h>
+}
+
+#define COMPLEXITY_ROW_STEP     2       //every other luma row is analysed
+#define COMPLEXITY_REFERENCE    8.0     //activity plus motion per pixel the nominal bitrate is meant for
+#define COMPLEXITY_EXPONENT     0.5     //bits needed grow slower than the measured complexity
+#define COMPLEXITY_SMOOTHING    0.25    //weight of a new sample in the running complexity
+#define COMPLEXITY_SCENE_CUT    3.0     //motion this many times the running motion restarts the average
+#define COMPLEXITY_SCENE_MIN    12.0
+#define COMPLEXITY_HYSTERESIS   0.1     //smaller bitrate moves are not worth an encoder reconfiguration
+#define COMPLEXITY_HOLD_SECONDS 1       //between two reconfigurations outside of scene cuts
+#define COMPLEXITY_REOPEN_HOLD  10      //between two reopens, scene cuts included, every reopen starts with an IDR
+#define COMPLEXITY_GPU_SCALE    4       //hardware frames are analysed at a quarter of their width and height
+
+#ifdef __SSE2__
+static inline uint64_t hsum_epi64(__m128i v)
+{
+    return (uint64_t)_mm_cvtsi128_si32(v) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+#endif
+
+ComplexityAnalyzer::ComplexityAnalyzer(const std::string& label, int interval)
+    : Label(label)
+    , Interval(interval)
+    , FrameCount(0)
+    , Nominal(0)
+    , Floor(0)
+    , Ceiling(0)
+    , MaxRateRatio(0)
+    , BufferRatio(0)
+    , Live(true)
+    , ReopenPending(false)
+    , ScaleGraph(nullptr)
+    , ScaleSrc(nullptr)
+    , ScaleSink(nullptr)
+    , ScaleFramesData(nullptr)
+    , ScaleWidth(0)
+    , ScaleHeight(0)
+    , SampleBytes(0)
+    , PrevWidth(0)
+    , PrevHeight(0)
+    , Spatial(0)
+    , Temporal(0)
+    , Complexity(-1)
+    , Target(0)
+    , LastChange(0)
+    , NominalBits(0)
+    , OutputBytes(0)
+    , Changes(0)
+    , SceneCuts(0)
+    , WorkTime(0)
+    , Samples(0)
+{
+}
+
+ComplexityAnalyzer::~ComplexityAnalyzer()
+{
+    CloseScaler();
+}
+
+bool ComplexityAnalyzer::Supported(const AVCodecContext* encoder)
+{
+    return !strcmp(encoder->codec->name, "libx264") || !strcmp(encoder->codec->name, "h264_qsv") || !strcmp(encoder->codec->name, "hevc_qsv");
+}
+
+bool ComplexityAnalyzer::LiveRetarget(const AVCodecContext* encoder)
+{
+    //libx264 reconfigures on a changed bit_rate at the next frame, qsvenc only resets its rate control since lavc 59.37
+    if (!strcmp(encoder->codec->name, "libx264"))
+        return true;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 37, 100)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void ComplexityAnalyzer::Prepare(AVCodecContext* encoder)
+{
+    //called before avcodec_open2, a reopen for a new target keeps the configured rate control ratios
+    if (!ReopenPending)
+        return;
+    encoder->bit_rate = Target;
+    if (MaxRateRatio > 0)
+        encoder->rc_max_rate = (int64_t)(Target * MaxRateRatio);
+    if (BufferRatio > 0)
+        encoder->rc_buffer_size = (int)(Target * BufferRatio);
+}
+
+bool ComplexityAnalyzer::Configure(AVCodecContext* encoder, int64_t nominal, int64_t floor, int64_t ceiling)
+{
+    if ((Interval <= 0) || (nominal <= 0))
+        return false;
+    if (ReopenPending)
+    {
+        //the encoder was reopened for the last target, the analysis goes on
+        ReopenPending = false;
+        return true;
+    }
+    if (!Supported(encoder))
+    {
+        printf("Encoder '%s' cannot change its bitrate while running, adaptive bitrate is off\n", encoder->codec->name);
+        return false;
+    }
+    if (!LiveRetarget(encoder) && (encoder->max_b_frames != 0))
+    {
+        //a reopened encoder restarts its dts behind the pts of the frames it still had to reorder
+        printf("Encoder '%s' uses B-frames and has to be reopened for a new bitrate, adaptive bitrate is off\n", encoder->codec->name);
+        return false;
+    }
+    Nominal = nominal;
+    Floor = floor > 0 ? floor : nominal;
+    Ceiling = ceiling > 0 ? ceiling : nominal;
+    if (Floor > Ceiling)
+    {
+        printf("Adaptive bitrate floor %lld is above the ceiling %lld\n", (long long)Floor, (long long)Ceiling);
+        return false;
+    }
+    MaxRateRatio = encoder->rc_max_rate > 0 ? (double)encoder->rc_max_rate / encoder->bit_rate : 0;
+    BufferRatio = encoder->rc_buffer_size > 0 ? (double)encoder->rc_buffer_size / encoder->bit_rate : 0;
+    Live = LiveRetarget(encoder);
+    Target = encoder->bit_rate;
+    Complexity = -1;
+    PrevWidth = PrevHeight = 0;
+    return true;
+}
+
+uint64_t ComplexityAnalyzer::Activity(const uint8_t* src, int stride, int width, int height)
+{
+    //sum of absolute deviations from the mean of each run of 16 pixels
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++, src += stride)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+            __m128i total = _mm_sad_epu8(v, zero);
+            int mean = (_mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8)) + 8) >> 4;
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_set1_epi8((char)mean)));
+        }
+        sum += hsum_epi64(acc);
+#else
+        for (; x + 16 <= width; x += 16)
+        {
+            int total = 0;
+            for (int i = 0; i < 16; i++)
+                total += src[x + i];
+            int mean = (total + 8) >> 4;
+            for (int i = 0; i < 16; i++)
+                sum += abs(src[x + i] - mean);
+        }
+#endif
+        if (x < width)
+        {
+            int total = 0;
+            for (int i = x; i < width; i++)
+                total += src[i];
+            int mean = (total + (width - x) / 2) / (width - x);
+            for (int i = x; i < width; i++)
+                sum += abs(src[i] - mean);
+        }
+    }
+    return sum;
+}
+
+uint64_t ComplexityAnalyzer::Difference(const uint8_t* a, int astride, const uint8_t* b, int bstride, int width, int height)
+{
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++, a += astride, b += bstride)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        __m128i acc = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16)
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x))));
+        sum += hsum_epi64(acc);
+#endif
+        for (; x < width; x++)
+            sum += abs(a[x] - b[x]);
+    }
+    return sum;
+}
+
+bool ComplexityAnalyzer::Measure(const AVFrame* frame, double* spatial, double* temporal)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL)) || (desc->comp[0].plane != 0) || (desc->comp[0].depth != 8))
+        return false;
+    int width = frame->width;
+    int rows = (frame->height + COMPLEXITY_ROW_STEP - 1) / COMPLEXITY_ROW_STEP;
+    int stride = frame->linesize[0] * COMPLEXITY_ROW_STEP;
+    const uint8_t* luma = frame->data[0];
+    double pixels = (double)width * rows;
+
+    *spatial = Activity(luma, stride, width, rows) / pixels;
+    *temporal = -1;
+    if ((PrevWidth == width) && (PrevHeight == rows))
+        *temporal = Difference(luma, stride, &Previous[0], width, width, rows) / pixels;
+    Previous.resize((size_t)width * rows);
+    for (int y = 0; y < rows; y++)
+        memcpy(&Previous[(size_t)y * width], luma + (size_t)y * stride, width);
+    PrevWidth = width;
+    PrevHeight = rows;
+    return true;
+}
+
+void ComplexityAnalyzer::Retarget(AVCodecContext* encoder, int64_t target)
+{
+    Target = target;
+    if (Live)
+    {
+        encoder->bit_rate = target;
+        if (MaxRateRatio > 0)
+            encoder->rc_max_rate = (int64_t)(target * MaxRateRatio);
+        if (BufferRatio > 0)
+            encoder->rc_buffer_size = (int)(target * BufferRatio);
+    }
+    else
+        ReopenPending = true;
+    LastChange = FrameCount;
+    Changes++;
+}
+
+bool ComplexityAnalyzer::InitScaler(AVFrame* frame)
+{
+    char args[512];
+    char descr[128];
+    AVHWFramesContext* frames = (AVHWFramesContext*)frame->hw_frames_ctx->data;
+    AVFilterInOut* outputs = avfilter_inout_alloc();
+    AVFilterInOut* inputs = avfilter_inout_alloc();
+    AVBufferSrcParameters* par = av_buffersrc_parameters_alloc();
+    int ret = AVERROR(ENOMEM);
+
+    ScaleGraph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !par || !ScaleGraph)
+        goto end;
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/%d:pixel_aspect=1/1",
+             frame->width, frame->height, frame->format, AV_TIME_BASE);
+    if ((ret = avfilter_graph_create_filter(&ScaleSrc, avfilter_get_by_name("buffer"), "in", args, NULL, ScaleGraph)) < 0)
+        goto end;
+    par->hw_frames_ctx = frame->hw_frames_ctx;
+    if ((ret = av_buffersrc_parameters_set(ScaleSrc, par)) < 0)
+        goto end;
+    if ((ret = avfilter_graph_create_filter(&ScaleSink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, ScaleGraph)) < 0)
+        goto end;
+
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = ScaleSrc;
+    outputs->pad_idx    = 0;
+    outputs->next       = NULL;
+
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = ScaleSink;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+
+    snprintf(descr, sizeof(descr), "scale_qsv=w=%d:h=%d,hwdownload,format=nv12",
+             FFMAX(16, frame->width / COMPLEXITY_GPU_SCALE) & ~1, FFMAX(16, frame->height / COMPLEXITY_GPU_SCALE) & ~1);
+    if ((ret = avfilter_graph_parse_ptr(ScaleGraph, descr, &inputs, &outputs, NULL)) < 0)
+        goto end;
+    for (unsigned int i = 0; i < ScaleGraph->nb_filters; i++)
+    {
+        if (!(ScaleGraph->filters[i]->hw_device_ctx = av_buffer_ref(frames->device_ref)))
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    ret = avfilter_graph_config(ScaleGraph, NULL);
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    av_freep(&par);
+    if (ret < 0)
+        CloseScaler();
+    return ret >= 0;
+}
+
+void ComplexityAnalyzer::CloseScaler()
+{
+    avfilter_graph_free(&ScaleGraph);
+    ScaleSrc = nullptr;
+    ScaleSink = nullptr;
+}
+
+AVFrame* ComplexityAnalyzer::Download(AVFrame* frame)
+{
+    //only a scaled copy leaves the GPU, whole frames are downloaded where scale_qsv cannot take them
+    if ((frame->hw_frames_ctx->data != ScaleFramesData) || (frame->width != ScaleWidth) || (frame->height != ScaleHeight))
+    {
+        AVHWFramesContext* frames = (AVHWFramesContext*)frame->hw_frames_ctx->data;
+        CloseScaler();
+        ScaleFramesData = frame->hw_frames_ctx->data;
+        ScaleWidth = frame->width;
+        ScaleHeight = frame->height;
+        if ((frames->format != AV_PIX_FMT_QSV) || (frames->sw_format != AV_PIX_FMT_NV12) || !InitScaler(frame))
+            printf("Complexity samples of %dx%d %s frames are downloaded unscaled\n", frame->width, frame->height, av_get_pix_fmt_name(frames->sw_format));
+    }
+    AVFrame* sample = av_frame_alloc();
+    if (!sample)
+        return nullptr;
+    int ret;
+    if (ScaleGraph)
+    {
+        ret = av_buffersrc_add_frame_flags(ScaleSrc, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+        if (ret >= 0)
+            ret = av_buffersink_get_frame(ScaleSink, sample);
+    }
+    else
+        ret = av_hwframe_transfer_data(sample, frame, 0);
+    if (ret < 0)
+        av_frame_free(&sample);
+    return sample;
+}
+
+bool ComplexityAnalyzer::Update(AVFrame* frame, AVCodecContext* encoder)
+{
+    if (Nominal <= 0)
+        return false;
+    double duration = av_q2d(encoder->time_base);
+    NominalBits += Nominal * duration;
+    if (FrameCount++ % Interval)
+        return false;
+
+    int64_t start = av_gettime_relative();
+    AVFrame* sample = frame->hw_frames_ctx ? Download(frame) : frame;
+    double spatial, temporal;
+    bool measured = sample && Measure(sample, &spatial, &temporal);
+    if (sample != frame)
+    {
+        SampleBytes = SessionMemory::FrameBytes(sample);
+        av_frame_free(&sample);
+    }
+    WorkTime += av_gettime_relative() - start;
+    if (!measured)
+        return false;
+    Samples++;
+
+    bool cut = false;
+    if (temporal < 0)
+    {
+        //no previous sample of this size to compare with yet
+        Spatial = spatial;
+        return false;
+    }
+    if (Complexity < 0)
+    {
+        Spatial = spatial;
+        Temporal = temporal;
+        cut = true;
+    }
+    else if ((temporal > COMPLEXITY_SCENE_MIN) && (temporal > COMPLEXITY_SCENE_CUT * Temporal))
+    {
+        Spatial = spatial;
+        Temporal = temporal;
+        cut = true;
+        SceneCuts++;
+    }
+    else
+    {
+        Spatial += (spatial - Spatial) * COMPLEXITY_SMOOTHING;
+        Temporal += (temporal - Temporal) * COMPLEXITY_SMOOTHING;
+    }
+    Complexity = Spatial + Temporal;
+
+    int64_t target = (int64_t)(Nominal * pow(FFMAX(Complexity, 0.1) / COMPLEXITY_REFERENCE, COMPLEXITY_EXPONENT));
+    target = FFMIN(FFMAX(target, Floor), Ceiling);
+    int64_t hold = duration > 0 ? (int64_t)((Live ? COMPLEXITY_HOLD_SECONDS : COMPLEXITY_REOPEN_HOLD) / duration) : 0;
+    if (llabs(target - Target) < Target * COMPLEXITY_HYSTERESIS)
+        return false;
+    if ((cut && Live) || (FrameCount - LastChange >= hold))
+        Retarget(encoder, target);
+    //true asks the session to drain the encoder and open a new one, Prepare applies the target
+    return ReopenPending;
+}
+
+int64_t ComplexityAnalyzer::MemoryBytes(int* objects)
+{
+    *objects = (SampleBytes > 0) + !Previous.empty();
+    return SampleBytes + Previous.capacity();
+}
+
+void ComplexityAnalyzer::Publish()
+{
+    if (Nominal <= 0)
+        return;
+    Metrics::Set("session_bitrate_target", Label, Target);
+    Metrics::Set("session_scene_complexity", Label, Complexity < 0 ? 0 : Complexity);
+    Metrics::Set("session_scene_motion", Label, Temporal);
+    //what the encoder produced against what the nominal bitrate would have spent on the same frames
+    Metrics::Set("session_bitrate_saved_bytes_total", Label, NominalBits / 8 - OutputBytes);
+    Metrics::Set("session_bitrate_savings_ratio", Label, NominalBits > 0 ? 1 - OutputBytes * 8 / NominalBits : 0);
+    Metrics::Set("session_bitrate_changes_total", Label, Changes);
+    Metrics::Set("session_scene_cuts_total", Label, SceneCuts);
+    Metrics::Set("session_complexity_us_per_sample", Label, Samples ? (double)WorkTime / Samples : 0);
+}
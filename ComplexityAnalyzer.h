@@ -0,0 +1,77 @@
+#ifndef COMPLEXITYANALYZER_H
+#define COMPLEXITYANALYZER_H
+
+#include <string>
+#include <vector>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavfilter/avfilter.h>
+}
+
+//measures spatial activity and motion on every Nth frame going into the encoder
+//and moves the encoder bitrate between a floor and a ceiling to follow the content.
+//encoders that cannot change the bitrate while running are reopened at the new target by the session
+class ComplexityAnalyzer
+{
+    public:
+        ComplexityAnalyzer(const std::string& label, int interval);
+        virtual ~ComplexityAnalyzer();
+
+        static bool Supported(const AVCodecContext* encoder);
+        static bool LiveRetarget(const AVCodecContext* encoder);
+        void Prepare(AVCodecContext* encoder);
+        bool Configure(AVCodecContext* encoder, int64_t nominal, int64_t floor, int64_t ceiling);
+        bool Update(AVFrame* frame, AVCodecContext* encoder);
+        void AddOutput(int64_t bytes) { OutputBytes += bytes; }
+        void Publish();
+        int64_t MemoryBytes(int* objects);
+
+        static uint64_t Activity(const uint8_t* src, int stride, int width, int height);
+        static uint64_t Difference(const uint8_t* a, int astride, const uint8_t* b, int bstride, int width, int height);
+    protected:
+        bool Measure(const AVFrame* frame, double* spatial, double* temporal);
+        void Retarget(AVCodecContext* encoder, int64_t target);
+        AVFrame* Download(AVFrame* frame);
+        bool InitScaler(AVFrame* frame);
+        void CloseScaler();
+    private:
+        std::string         Label;
+        int                 Interval;
+        int64_t             FrameCount;
+
+        int64_t             Nominal;
+        int64_t             Floor;
+        int64_t             Ceiling;
+        double              MaxRateRatio;   //rc_max_rate and rc_buffer_size follow bit_rate
+        double              BufferRatio;
+        bool                Live;           //bit_rate changes apply at the next frame
+        bool                ReopenPending;  //Target waits for the session to reopen the encoder
+
+        AVFilterGraph*      ScaleGraph;     //scale_qsv ahead of the download of hardware frames
+        AVFilterContext*    ScaleSrc;
+        AVFilterContext*    ScaleSink;
+        void*               ScaleFramesData;
+        int                 ScaleWidth;
+        int                 ScaleHeight;
+
+        std::vector<uint8_t> Previous;      //sampled luma rows of the last analysed frame
+        int64_t             SampleBytes;    //the last downloaded sample, allocated again for every one
+        int                 PrevWidth;
+        int                 PrevHeight;
+        double              Spatial;
+        double              Temporal;
+        double              Complexity;
+        int64_t             Target;
+        int64_t             LastChange;     //frame count of the last reconfiguration
+
+        double              NominalBits;
+        int64_t             OutputBytes;    //video bytes the encoder produced
+        uint64_t            Changes;
+        uint64_t            SceneCuts;
+        int64_t             WorkTime;
+        uint64_t            Samples;
+};
+
+#endif // COMPLEXITYANALYZER_H
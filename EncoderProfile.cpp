@@ -0,0 +1,100 @@
+#include "EncoderProfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+extern "C"
+{
+    #include <libavutil/opt.h>
+}
+
+bool EncoderProfile::Load(const char* path, EncoderProfileInfo* info)
+{
+    char line[1024];
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return false;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '#')
+            continue;
+        char* value = strchr(line, '=');
+        if (!value)
+            continue;
+        *value++ = 0;
+        if (!strcmp(line, "preset"))
+            info->Preset = value;
+        else if (!strcmp(line, "async_depth"))
+            info->AsyncDepth = atoi(value);
+        else if (!strcmp(line, "bf"))
+            info->BFrames = atoi(value);
+        else if (!strcmp(line, "look_ahead"))
+            info->LookAhead = atoi(value);
+        else if (!strcmp(line, "rc"))
+            info->Cbr = !strcmp(value, "cbr");
+        else if (!strcmp(line, "fps"))
+            info->Fps = atof(value);
+        else if (!strcmp(line, "latency_ms"))
+            info->LatencyMs = atof(value);
+        else if (!strcmp(line, "psnr"))
+            info->Psnr = atof(value);
+        else if (!strcmp(line, "ssim"))
+            info->Ssim = atof(value);
+    }
+    fclose(file);
+    return true;
+}
+
+bool EncoderProfile::Save(const char* path, const EncoderProfileInfo& info)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "w");
+    if (!file)
+        return false;
+    bool ok = fprintf(file, "preset=%s\nasync_depth=%d\nbf=%d\nlook_ahead=%d\nrc=%s\nfps=%.1f\nlatency_ms=%.1f\npsnr=%.2f\nssim=%.4f\n"
+                      , info.Preset.c_str(), info.AsyncDepth, info.BFrames, info.LookAhead, info.Cbr ? "cbr" : "vbr"
+                      , info.Fps, info.LatencyMs, info.Psnr, info.Ssim) > 0;
+    ok = (fflush(file) == 0) && ok;
+    ok = (fsync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+    return ok && (rename(tmp.c_str(), path) == 0);
+}
+
+bool EncoderProfile::HasOption(const AVCodec* codec, const char* name)
+{
+    return codec->priv_class && av_opt_find((void*)&codec->priv_class, name, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ);
+}
+
+bool EncoderProfile::Supported(const AVCodec* codec, const EncoderProfileInfo& info)
+{
+    //settings the encoder has no option for would only repeat another candidate
+    if ((info.AsyncDepth > 0) && !HasOption(codec, "async_depth"))
+        return false;
+    if ((info.LookAhead > 0) && !HasOption(codec, "look_ahead"))
+        return false;
+    return HasOption(codec, "preset") || (info.Preset == EncoderProfileInfo().Preset);
+}
+
+void EncoderProfile::Apply(const EncoderProfileInfo& info, AVCodecContext* ctx, AVDictionary** opt)
+{
+    av_dict_set(opt, "preset", info.Preset.c_str(), 0);
+    av_dict_set_int(opt, "look_ahead", info.LookAhead, 0);
+    if (info.AsyncDepth > 0)
+        av_dict_set_int(opt, "async_depth", info.AsyncDepth, 0);
+    if (info.BFrames >= 0)
+        ctx->max_b_frames = info.BFrames;
+    if (info.Cbr)
+    {
+        ctx->rc_max_rate = ctx->bit_rate;
+        ctx->rc_buffer_size = ctx->bit_rate;
+    }
+}
+
+std::string EncoderProfile::Describe(const EncoderProfileInfo& info)
+{
+    char text[256];
+    snprintf(text, sizeof(text), "preset=%s async_depth=%d bf=%d look_ahead=%d rc=%s"
+             , info.Preset.c_str(), info.AsyncDepth, info.BFrames, info.LookAhead, info.Cbr ? "cbr" : "vbr");
+    return text;
+}
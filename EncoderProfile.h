@@ -0,0 +1,37 @@
+#ifndef ENCODERPROFILE_H
+#define ENCODERPROFILE_H
+
+#include <string>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+//encoder settings for a channel class, the defaults are what openencoder always used
+struct EncoderProfileInfo
+{
+    std::string Preset      = "veryfast";
+    int         AsyncDepth  = 0;        //0 keeps the encoder default
+    int         BFrames     = -1;       //-1 keeps the encoder default
+    int         LookAhead   = 0;
+    bool        Cbr         = false;    //max rate pinned to the bitrate instead of the encoder's VBR
+
+    double      Fps         = 0;        //what the tuner measured, informational
+    double      LatencyMs   = 0;
+    double      Psnr        = 0;
+    double      Ssim        = 0;
+};
+
+class EncoderProfile
+{
+    public:
+        static bool Load(const char* path, EncoderProfileInfo* info);
+        static bool Save(const char* path, const EncoderProfileInfo& info);
+        static bool Supported(const AVCodec* codec, const EncoderProfileInfo& info);
+        static void Apply(const EncoderProfileInfo& info, AVCodecContext* ctx, AVDictionary** opt);
+        static std::string Describe(const EncoderProfileInfo& info);
+        static bool HasOption(const AVCodec* codec, const char* name);
+};
+
+#endif // ENCODERPROFILE_H
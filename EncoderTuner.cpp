@@ -0,0 +1,361 @@
+#include "EncoderTuner.h"
+#include <map>
+#include <math.h>
+extern "C"
+{
+    #include <libavutil/hwcontext_qsv.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/time.h>
+    #include <libswscale/swscale.h>
+}
+
+EncoderTuner::EncoderTuner(const char* inputurl, OutputInfo* outset)
+    : InputUrl(inputurl)
+    , OutputSet(outset)
+    , VideoEncCodec(nullptr)
+    , PixFmt(AV_PIX_FMT_NONE)
+    , FrameRate(av_make_q(25, 1))
+    , QSV_hw_device_ctx(nullptr)
+    , HwFramesCtx(nullptr)
+{
+}
+
+EncoderTuner::~EncoderTuner()
+{
+    for (size_t i = 0; i < Frames.size(); i++)
+        av_frame_free(&Frames[i]);
+    for (size_t i = 0; i < HwFrames.size(); i++)
+        av_frame_free(&HwFrames[i]);
+    av_buffer_unref(&HwFramesCtx);
+    av_buffer_unref(&QSV_hw_device_ctx);
+}
+
+std::vector<EncoderProfileInfo> EncoderTuner::Candidates()
+{
+    static const char* presets[] = {"veryfast", "faster", "medium"};
+    std::vector<EncoderProfileInfo> candidates;
+    for (int p = 0; p < 3; p++)
+        for (int async = 1; async <= 4; async += 3)
+            for (int bf = 0; bf <= 2; bf += 2)
+                for (int la = 0; la <= 1; la++)
+                    for (int cbr = 0; cbr <= 1; cbr++)
+                    {
+                        EncoderProfileInfo info;
+                        info.Preset = presets[p];
+                        info.AsyncDepth = async;
+                        info.BFrames = bf;
+                        info.LookAhead = la;
+                        info.Cbr = (cbr != 0);
+                        candidates.push_back(info);
+                    }
+    return candidates;
+}
+
+bool EncoderTuner::LoadSegment(int frames)
+{
+    //decoded and scaled once up front, so every candidate only pays for its own encode
+    AVFormatContext* fmt = NULL;
+    AVCodecContext* dec = NULL;
+    AVCodec* codec = NULL;
+    SwsContext* sws = NULL;
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    int index, ret = 0;
+
+    if ((avformat_open_input(&fmt, InputUrl, NULL, NULL) < 0) || (avformat_find_stream_info(fmt, NULL) < 0))
+    {
+        printf("Cannot open input '%s'\n", InputUrl);
+        goto end;
+    }
+    if ((index = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+    {
+        printf("Input '%s' has no video stream\n", InputUrl);
+        goto end;
+    }
+    if (!(dec = avcodec_alloc_context3(codec)) || (avcodec_parameters_to_context(dec, fmt->streams[index]->codecpar) < 0)
+        || (avcodec_open2(dec, codec, NULL) < 0))
+    {
+        printf("Cannot open the video decoder\n");
+        goto end;
+    }
+    if (fmt->streams[index]->avg_frame_rate.num > 0)
+        FrameRate = fmt->streams[index]->avg_frame_rate;
+
+    while ((int)Frames.size() < frames)
+    {
+        bool flushing = (av_read_frame(fmt, pkt) < 0);
+        if (!flushing && (pkt->stream_index != index))
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        ret = avcodec_send_packet(dec, flushing ? NULL : pkt);
+        av_packet_unref(pkt);
+        while ((ret >= 0) && ((int)Frames.size() < frames))
+        {
+            if ((ret = avcodec_receive_frame(dec, frame)) < 0)
+                break;
+            int width = OutputSet->VideoWidth > 0 ? OutputSet->VideoWidth : frame->width;
+            int height = OutputSet->VideoHeight > 0 ? OutputSet->VideoHeight : frame->height;
+            sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format
+                                       , width, height, PixFmt, SWS_BICUBIC, NULL, NULL, NULL);
+            AVFrame* scaled = av_frame_alloc();
+            scaled->format = PixFmt;
+            scaled->width = width;
+            scaled->height = height;
+            if (!sws || (av_frame_get_buffer(scaled, 32) < 0))
+            {
+                av_frame_free(&scaled);
+                av_frame_unref(frame);
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            sws_scale(sws, frame->data, frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
+            Frames.push_back(scaled);
+            av_frame_unref(frame);
+        }
+        if (flushing || ((ret < 0) && (ret != AVERROR(EAGAIN))))
+            break;
+    }
+end:
+    sws_freeContext(sws);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    return !Frames.empty();
+}
+
+bool EncoderTuner::UploadSegment()
+{
+    //uploaded once, so a candidate is timed on surfaces like a session's encoder and not on the copy into them
+    AVHWFramesContext  *frames_ctx;
+    AVQSVFramesContext *frames_hwctx;
+    int ret;
+
+    if ((ret = av_hwdevice_ctx_create(&QSV_hw_device_ctx, AV_HWDEVICE_TYPE_QSV, "auto", NULL, 0)) < 0)
+    {
+        printf("Failed to create a qsv device. Error code: %d\n", ret);
+        return false;
+    }
+    if (!(HwFramesCtx = av_hwframe_ctx_alloc(QSV_hw_device_ctx)))
+        return false;
+    frames_ctx   = (AVHWFramesContext*)HwFramesCtx->data;
+    frames_hwctx = (AVQSVFramesContext*)frames_ctx->hwctx;
+    frames_ctx->format            = AV_PIX_FMT_QSV;
+    frames_ctx->sw_format         = PixFmt;
+    frames_ctx->width             = FFALIGN(Frames[0]->width,  32);
+    frames_ctx->height            = FFALIGN(Frames[0]->height, 32);
+    frames_ctx->initial_pool_size = Frames.size();
+    frames_hwctx->frame_type = MFX_MEMTYPE_VIDEO_MEMORY_PROCESSOR_TARGET;
+    if ((ret = av_hwframe_ctx_init(HwFramesCtx)) < 0)
+    {
+        printf("Cannot allocate %d qsv surfaces for the segment. Error code: %d\n", (int)Frames.size(), ret);
+        return false;
+    }
+    for (size_t i = 0; i < Frames.size(); i++)
+    {
+        AVFrame* hwframe = av_frame_alloc();
+        if (!hwframe || (av_hwframe_get_buffer(HwFramesCtx, hwframe, 0) < 0)
+            || (av_hwframe_transfer_data(hwframe, Frames[i], 0) < 0))
+        {
+            printf("Cannot upload the segment to qsv surfaces\n");
+            av_frame_free(&hwframe);
+            return false;
+        }
+        hwframe->width  = Frames[i]->width;
+        hwframe->height = Frames[i]->height;
+        HwFrames.push_back(hwframe);
+    }
+    return true;
+}
+
+bool EncoderTuner::Measure(EncoderProfileInfo* info)
+{
+    AVCodecContext* enc = avcodec_alloc_context3(VideoEncCodec);
+    AVCodecContext* dec = NULL;
+    AVCodec* decoder = avcodec_find_decoder(VideoEncCodec->id);
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    AVDictionary* opt = NULL;
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    std::vector<AVPacket*> packets;
+    std::map<int64_t, int64_t> sendtime;
+    int64_t start, elapsed, latency = 0;
+    int latencies = 0, scored = 0;
+    double sse = 0, ssim = 0;
+    bool ok = false;
+    int fps = FFMAX(1, FrameRate.num / FFMAX(1, FrameRate.den));
+
+    //the same setup openencoder does, the profile decides the rest
+    enc->time_base = av_make_q(1, fps);
+    enc->framerate = FrameRate;
+    enc->pix_fmt = PixFmt;
+    if (HwFramesCtx)
+    {
+        enc->pix_fmt = AV_PIX_FMT_QSV;
+        enc->hw_frames_ctx = av_buffer_ref(HwFramesCtx);
+    }
+    enc->width = Frames[0]->width;
+    enc->height = Frames[0]->height;
+    enc->profile = OutputSet->VideoProfile;
+    enc->level = 4;
+    enc->gop_size = fps * OutputSet->GopSeconds;
+    enc->keyint_min = fps * OutputSet->GopSeconds;
+    enc->bit_rate = OutputSet->VideoBitrate;
+    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER | AV_CODEC_FLAG_LOW_DELAY | AV_CODEC_FLAG_CLOSED_GOP;
+    av_dict_set(&opt, "tune", "zerolatency", 0);
+    if (VideoEncCodec->id == AV_CODEC_ID_H264)
+        av_dict_set_int(&opt, "idr_interval", 0, 0);
+    if (VideoEncCodec->id == AV_CODEC_ID_HEVC)
+        av_dict_set_int(&opt, "idr_interval", 1, 0);
+    EncoderProfile::Apply(*info, enc, &opt);
+    if (avcodec_open2(enc, VideoEncCodec, &opt) < 0)
+    {
+        printf("%s: encoder refused the settings\n", EncoderProfile::Describe(*info).c_str());
+        goto end;
+    }
+
+    start = av_gettime_relative();
+    for (size_t i = 0; i <= Frames.size(); i++)
+    {
+        AVFrame* in = (i < Frames.size()) ? (HwFrames.empty() ? Frames[i] : HwFrames[i]) : NULL;
+        if (in)
+        {
+            in->pts = i;
+            in->pict_type = AV_PICTURE_TYPE_NONE;
+            sendtime[i] = av_gettime_relative();
+        }
+        if (avcodec_send_frame(enc, in) < 0)
+            break;
+        while (avcodec_receive_packet(enc, pkt) == 0)
+        {
+            std::map<int64_t, int64_t>::iterator it = sendtime.find(pkt->pts);
+            if (it != sendtime.end())
+            {
+                latency += av_gettime_relative() - it->second;
+                latencies++;
+                sendtime.erase(it);
+            }
+            packets.push_back(av_packet_clone(pkt));
+            av_packet_unref(pkt);
+        }
+    }
+    elapsed = av_gettime_relative() - start;
+    info->Fps = Frames.size() * 1000000.0 / FFMAX(elapsed, 1);
+    info->LatencyMs = latencies ? latency / 1000.0 / latencies : 0;
+
+    //quality is scored after the clock stopped, from a software decode of what was produced
+    if (!decoder || !par || (avcodec_parameters_from_context(par, enc) < 0) || !(dec = avcodec_alloc_context3(decoder))
+        || (avcodec_parameters_to_context(dec, par) < 0) || (avcodec_open2(dec, decoder, NULL) < 0))
+    {
+        printf("%s: no software decoder to score the output\n", EncoderProfile::Describe(*info).c_str());
+        goto end;
+    }
+    for (size_t i = 0; i <= packets.size(); i++)
+    {
+        if (avcodec_send_packet(dec, (i < packets.size()) ? packets[i] : NULL) < 0)
+            continue;
+        while (avcodec_receive_frame(dec, frame) == 0)
+        {
+            int64_t pts = frame->best_effort_timestamp;
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+            if ((pts >= 0) && (pts < (int64_t)Frames.size()) && desc && (desc->comp[0].depth == 8))
+            {
+                AVFrame* ref = Frames[pts];
+                int width = FFMIN(ref->width, frame->width);
+                int height = FFMIN(ref->height, frame->height);
+                sse += QualitySampler::SquaredError(ref->data[0], ref->linesize[0], frame->data[0], frame->linesize[0], width, height)
+                       / (double)(width * height);
+                ssim += QualitySampler::Ssim(ref->data[0], ref->linesize[0], frame->data[0], frame->linesize[0], width, height);
+                scored++;
+            }
+            av_frame_unref(frame);
+        }
+    }
+    if (scored)
+    {
+        info->Psnr = sse > 0 ? 10 * log10(255.0 * 255.0 * scored / sse) : 100;
+        info->Ssim = ssim / scored;
+        ok = true;
+    }
+    printf("%s: %.1f fps, %.1f ms, PSNR %.2f dB, SSIM %.4f\n", EncoderProfile::Describe(*info).c_str()
+           , info->Fps, info->LatencyMs, info->Psnr, info->Ssim);
+end:
+    for (size_t i = 0; i < packets.size(); i++)
+        av_packet_free(&packets[i]);
+    av_dict_free(&opt);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_parameters_free(&par);
+    avcodec_free_context(&dec);
+    avcodec_free_context(&enc);
+    return ok;
+}
+
+bool EncoderTuner::Dominates(const EncoderProfileInfo& a, const EncoderProfileInfo& b)
+{
+    bool noworse = (a.Fps >= b.Fps) && (a.LatencyMs <= b.LatencyMs) && (a.Ssim >= b.Ssim);
+    bool better = (a.Fps > b.Fps) || (a.LatencyMs < b.LatencyMs) || (a.Ssim > b.Ssim);
+    return noworse && better;
+}
+
+bool EncoderTuner::Run(const TuneBudget& budget, EncoderProfileInfo* best)
+{
+    const char* encodername = OutputSet->VideoEncoderName;
+    if ((OutputSet->Backend == BACKEND_CPU) && OutputSet->CpuEncoderName)
+        encodername = OutputSet->CpuEncoderName;
+    if (!(VideoEncCodec = avcodec_find_encoder_by_name(encodername)))
+    {
+        printf("Could not find encoder '%s'\n", encodername);
+        return false;
+    }
+    //the first software format the encoder takes, qsv encoders get it uploaded into surfaces
+    bool surfaces = false;
+    for (const AVPixelFormat* fmt = VideoEncCodec->pix_fmts; fmt && (*fmt != AV_PIX_FMT_NONE); fmt++)
+    {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(*fmt);
+        surfaces = surfaces || (*fmt == AV_PIX_FMT_QSV);
+        if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL) && (PixFmt == AV_PIX_FMT_NONE))
+            PixFmt = *fmt;
+    }
+    if (PixFmt == AV_PIX_FMT_NONE)
+        PixFmt = AV_PIX_FMT_YUV420P;
+    if (!LoadSegment(budget.Frames))
+        return false;
+    if (surfaces && !UploadSegment())
+        return false;
+    printf("Tuning %s on %d frames of %dx%d\n", encodername, (int)Frames.size(), Frames[0]->width, Frames[0]->height);
+
+    std::vector<EncoderProfileInfo> results;
+    std::vector<EncoderProfileInfo> candidates = Candidates();
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        if (EncoderProfile::Supported(VideoEncCodec, candidates[i]) && Measure(&candidates[i]))
+            results.push_back(candidates[i]);
+    }
+
+    int chosen = -1;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const EncoderProfileInfo& info = results[i];
+        if (((budget.MinFps > 0) && (info.Fps < budget.MinFps)) || ((budget.MaxLatencyMs > 0) && (info.LatencyMs > budget.MaxLatencyMs)))
+            continue;
+        bool front = true;
+        for (size_t j = 0; front && (j < results.size()); j++)
+            front = !Dominates(results[j], info);
+        if (!front)
+            continue;
+        printf("Pareto front: %s\n", EncoderProfile::Describe(info).c_str());
+        if ((chosen < 0) || (info.Ssim > results[chosen].Ssim)
+            || ((info.Ssim == results[chosen].Ssim) && (info.Fps > results[chosen].Fps)))
+            chosen = i;
+    }
+    if (chosen < 0)
+    {
+        printf("No candidate fits %.1f fps / %.1f ms\n", budget.MinFps, budget.MaxLatencyMs);
+        return false;
+    }
+    *best = results[chosen];
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef ENCODERTUNER_H
+#define ENCODERTUNER_H
+
+#include <vector>
+#include "QSVTranscode.h"
+#include "EncoderProfile.h"
+
+struct TuneBudget
+{
+    double MinFps       = 0;    //0 means no throughput floor
+    double MaxLatencyMs = 0;    //0 means no latency ceiling
+    int    Frames       = 120;  //length of the segment every candidate encodes
+};
+
+//encodes one segment of an input with each candidate profile and picks the best quality
+//on the speed/latency/quality Pareto front that fits the budget
+class EncoderTuner
+{
+    public:
+        EncoderTuner(const char* inputurl, OutputInfo* outset);
+        virtual ~EncoderTuner();
+
+        bool Run(const TuneBudget& budget, EncoderProfileInfo* best);
+    protected:
+        bool LoadSegment(int frames);
+        bool UploadSegment();
+        bool Measure(EncoderProfileInfo* info);
+        static std::vector<EncoderProfileInfo> Candidates();
+        static bool Dominates(const EncoderProfileInfo& a, const EncoderProfileInfo& b);
+    private:
+        const char*         InputUrl;
+        OutputInfo*         OutputSet;
+        AVCodec*            VideoEncCodec;
+        AVPixelFormat       PixFmt;
+        AVRational          FrameRate;
+        std::vector<AVFrame*> Frames;
+        AVBufferRef*        QSV_hw_device_ctx;
+        AVBufferRef*        HwFramesCtx;
+        std::vector<AVFrame*> HwFrames;     //the segment as qsv surfaces, for encoders that take them
+};
+
+#endif // ENCODERTUNER_H
@@ -0,0 +1,452 @@
+#include "LiveEdge.h"
+#include "Metrics.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+extern "C"
+{
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+}
+
+#define EDGE_CLIENT_MAX_QUEUE   512
+#define EDGE_SEGMENT_DURATION   1.0
+
+static bool send_all(int sock, const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t ret = send(sock, data, size, MSG_NOSIGNAL);
+        if (ret <= 0)
+            return false;
+        data += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static bool send_text(int sock, const char* text)
+{
+    return send_all(sock, (const uint8_t*)text, strlen(text));
+}
+
+LiveEdge::LiveEdge(const char* address, int port, int hlssegments, int maxclients)
+    : Port(port)
+    , HlsSegments(hlssegments)
+    , MaxClients(maxclients)
+    , Runing(true)
+    , ListenSock(-1)
+    , ActiveClients(0)
+    , FlvCtx(nullptr)
+    , TsCtx(nullptr)
+    , SegmentStart(-1)
+    , SegmentSeq(0)
+{
+    snprintf(Address, sizeof(Address), "%s", address ? address : "127.0.0.1");
+    ServerThread = new boost::thread(&LiveEdge::ServerProc, this);
+}
+
+LiveEdge::~LiveEdge()
+{
+    Runing = false;
+    Cond.notify_all();
+    ServerThread->join();
+    delete ServerThread;
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            if (ActiveClients == 0)
+                break;
+        }
+        av_usleep(10000);
+    }
+    Close();
+}
+
+int LiveEdge::WriteProc(void* opaque, uint8_t* buf, int size)
+{
+    std::vector<uint8_t>* out = (std::vector<uint8_t>*)opaque;
+    out->insert(out->end(), buf, buf + size);
+    return size;
+}
+
+bool LiveEdge::OpenMuxer(AVFormatContext** ctx, const char* format, std::vector<uint8_t>* out, AVStream* video, AVStream* audio)
+{
+    AVStream* streams[2] = {video, audio};
+    unsigned char* buffer = nullptr;
+    AVDictionary* opt = nullptr;
+    int ret;
+
+    if (avformat_alloc_output_context2(ctx, NULL, format, NULL) < 0)
+        return false;
+    for (int i = 0; i < 2; i++)
+    {
+        if (!streams[i])
+            continue;
+        AVStream* st = avformat_new_stream(*ctx, NULL);
+        if (!st || (avcodec_parameters_copy(st->codecpar, streams[i]->codecpar) < 0))
+        {
+            CloseMuxer(ctx);
+            return false;
+        }
+        st->codecpar->codec_tag = 0;
+        st->time_base = streams[i]->time_base;
+    }
+    buffer = (unsigned char*)av_malloc(32768);
+    if (!buffer || !((*ctx)->pb = avio_alloc_context(buffer, 32768, 1, out, NULL, WriteProc, NULL)))
+    {
+        av_free(buffer);
+        CloseMuxer(ctx);
+        return false;
+    }
+    (*ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    av_dict_set(&opt, "flvflags", "no_duration_filesize+no_sequence_end", 0);
+    ret = avformat_write_header(*ctx, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        printf("Edge cannot write %s header. Error code: %d\n", format, ret);
+        CloseMuxer(ctx);
+        return false;
+    }
+    avio_flush((*ctx)->pb);
+    return true;
+}
+
+void LiveEdge::CloseMuxer(AVFormatContext** ctx)
+{
+    if (!*ctx)
+        return;
+    if ((*ctx)->pb)
+    {
+        av_freep(&(*ctx)->pb->buffer);
+        avio_context_free(&(*ctx)->pb);
+    }
+    avformat_free_context(*ctx);
+    *ctx = nullptr;
+}
+
+bool LiveEdge::Open(AVStream* video, AVStream* audio)
+{
+    Close();
+    boost::mutex::scoped_lock lock(Lock);
+    FlvOut.clear();
+    TsOut.clear();
+    if (!OpenMuxer(&FlvCtx, "flv", &FlvOut, video, audio)
+        || !OpenMuxer(&TsCtx, "mpegts", &TsOut, video, audio))
+    {
+        CloseMuxer(&FlvCtx);
+        CloseMuxer(&TsCtx);
+        return false;
+    }
+    FlvHeader = std::make_shared<std::vector<uint8_t> >();
+    FlvHeader->swap(FlvOut);
+    SegmentStart = -1;
+    return true;
+}
+
+void LiveEdge::Close()
+{
+    boost::mutex::scoped_lock lock(Lock);
+    CloseMuxer(&FlvCtx);
+    CloseMuxer(&TsCtx);
+    FlvHeader.reset();
+    GopCache.clear();
+    //players cannot take a second FLV header mid-stream, make them reconnect
+    for (std::list<std::shared_ptr<EdgeClient> >::iterator it = Clients.begin(); it != Clients.end(); ++it)
+        (*it)->Closed = true;
+    Clients.clear();
+    Segments.clear();
+    Cond.notify_all();
+}
+
+bool LiveEdge::MuxPacket(AVFormatContext* ctx, AVPacket* pkt, AVRational time_base, bool video)
+{
+    int index = video ? 0 : 1;
+    AVPacket copy;
+    if ((unsigned int)index >= ctx->nb_streams)
+        return false;
+    if (av_packet_ref(&copy, pkt) < 0)
+        return false;
+    copy.stream_index = index;
+    if (copy.dts == AV_NOPTS_VALUE)
+        copy.dts = copy.pts;
+    av_packet_rescale_ts(&copy, time_base, ctx->streams[index]->time_base);
+    copy.pos = -1;
+    int ret = av_write_frame(ctx, &copy);
+    av_packet_unref(&copy);
+    avio_flush(ctx->pb);
+    return ret >= 0;
+}
+
+void LiveEdge::PushFlvTag(EdgeChunk tag, bool key)
+{
+    if (key)
+        GopCache.clear();
+    if (key || !GopCache.empty())
+        GopCache.push_back(tag);
+    for (std::list<std::shared_ptr<EdgeClient> >::iterator it = Clients.begin(); it != Clients.end(); ++it)
+    {
+        EdgeClient* client = it->get();
+        if (client->WaitKey && !key)
+            continue;
+        client->WaitKey = false;
+        if (client->Queue.size() >= EDGE_CLIENT_MAX_QUEUE)
+        {
+            //too slow, drop its backlog and resume at the next keyframe
+            client->Queue.clear();
+            client->WaitKey = true;
+            continue;
+        }
+        client->Queue.push_back(tag);
+    }
+}
+
+void LiveEdge::FinishSegment(double duration)
+{
+    EdgeSegment segment;
+    segment.Seq      = SegmentSeq++;
+    segment.Duration = duration;
+    segment.Data     = std::make_shared<std::vector<uint8_t> >();
+    segment.Data->swap(TsOut);
+    Segments.push_back(segment);
+    while ((int)Segments.size() > HlsSegments)
+        Segments.pop_front();
+}
+
+int64_t LiveEdge::MemoryBytes(int* chunks)
+{
+    //chunks are shared with the client queues, a slow client's backlog is only counted while cached here
+    boost::mutex::scoped_lock lock(Lock);
+    int64_t bytes = 0;
+    for (size_t i = 0; i < GopCache.size(); i++)
+        bytes += GopCache[i]->capacity();
+    for (size_t i = 0; i < Segments.size(); i++)
+        bytes += Segments[i].Data->capacity();
+    *chunks = GopCache.size() + Segments.size();
+    return bytes;
+}
+
+void LiveEdge::WritePacket(AVPacket* pkt, AVRational time_base, bool video)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    if (!FlvCtx || !TsCtx)
+        return;
+    bool key = video && (pkt->flags & AV_PKT_FLAG_KEY);
+
+    if (MuxPacket(FlvCtx, pkt, time_base, video) && !FlvOut.empty())
+    {
+        EdgeChunk tag = std::make_shared<std::vector<uint8_t> >();
+        tag->swap(FlvOut);
+        PushFlvTag(tag, key);
+    }
+    FlvOut.clear();
+
+    if (video && (pkt->pts != AV_NOPTS_VALUE))
+    {
+        double now = pkt->pts * av_q2d(time_base);
+        if (key)
+        {
+            if ((SegmentStart >= 0) && (now - SegmentStart >= EDGE_SEGMENT_DURATION))
+            {
+                FinishSegment(now - SegmentStart);
+                SegmentStart = now;
+                av_opt_set(TsCtx->priv_data, "mpegts_flags", "+resend_headers", 0);
+            }
+            else if (SegmentStart < 0)
+            {
+                TsOut.clear();
+                SegmentStart = now;
+                av_opt_set(TsCtx->priv_data, "mpegts_flags", "+resend_headers", 0);
+            }
+        }
+    }
+    if (SegmentStart >= 0)
+        MuxPacket(TsCtx, pkt, time_base, video);
+    else
+        TsOut.clear();
+    Cond.notify_all();
+}
+
+void LiveEdge::ServerProc()
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    ListenSock = socket(AF_INET, SOCK_STREAM, 0);
+    if (ListenSock < 0)
+        return;
+    setsockopt(ListenSock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Port);
+    inet_pton(AF_INET, Address, &addr.sin_addr);
+    if ((bind(ListenSock, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(ListenSock, 64) < 0))
+    {
+        printf("Edge cannot listen on %s:%d\n", Address, Port);
+        close(ListenSock);
+        ListenSock = -1;
+        return;
+    }
+    printf("Edge listening on http://%s:%d/live.flv and /live.m3u8\n", Address, Port);
+
+    while (Runing)
+    {
+        struct pollfd pfd = {ListenSock, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0)
+            continue;
+        int sock = accept(ListenSock, NULL, NULL);
+        if (sock < 0)
+            continue;
+        struct timeval tv = {5, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        {
+            //every client holds a thread, past the limit new viewers are turned away instead of queued
+            boost::mutex::scoped_lock lock(Lock);
+            if (ActiveClients >= MaxClients)
+            {
+                lock.unlock();
+                send_text(sock, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 5\r\nConnection: close\r\n\r\n");
+                close(sock);
+                continue;
+            }
+            ActiveClients++;
+        }
+        boost::thread(&LiveEdge::ClientProc, this, sock).detach();
+    }
+    close(ListenSock);
+    ListenSock = -1;
+}
+
+void LiveEdge::ClientProc(int sock)
+{
+    char request[4096] = {0};
+    char path[256] = {0};
+    int len = 0;
+    long long seq = 0;
+
+    while ((len < (int)sizeof(request) - 1) && !strstr(request, "\r\n\r\n"))
+    {
+        ssize_t ret = recv(sock, request + len, sizeof(request) - 1 - len, 0);
+        if (ret <= 0)
+            break;
+        len += ret;
+    }
+    if (sscanf(request, "GET %255s", path) == 1)
+    {
+        char* query = strchr(path, '?');
+        if (query)
+            *query = 0;
+        if (!strcmp(path, "/live.flv"))
+            ServeFlv(sock);
+        else if (!strcmp(path, "/live.m3u8"))
+            ServePlaylist(sock);
+        else if (!strcmp(path, "/metrics"))
+            ServeMetrics(sock);
+        else if (sscanf(path, "/seg%lld.ts", &seq) == 1)
+            ServeSegment(sock, seq);
+        else
+            send_text(sock, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    close(sock);
+
+    boost::mutex::scoped_lock lock(Lock);
+    ActiveClients--;
+}
+
+void LiveEdge::ServeFlv(int sock)
+{
+    std::shared_ptr<EdgeClient> client = std::make_shared<EdgeClient>();
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        if (!FlvHeader)
+        {
+            send_text(sock, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            return;
+        }
+        //header and the whole current GOP go out at once, playback starts at the last keyframe
+        client->Queue.push_back(FlvHeader);
+        client->Queue.insert(client->Queue.end(), GopCache.begin(), GopCache.end());
+        client->WaitKey = GopCache.empty();
+        client->Closed = false;
+        Clients.push_back(client);
+    }
+    bool ok = send_text(sock, "HTTP/1.1 200 OK\r\nContent-Type: video/x-flv\r\nCache-Control: no-cache\r\n"
+                              "Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n");
+    while (ok && Runing)
+    {
+        EdgeChunk chunk;
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            while (client->Queue.empty() && !client->Closed && Runing)
+                Cond.timed_wait(lock, boost::posix_time::milliseconds(500));
+            if (client->Closed || !Runing)
+                break;
+            chunk = client->Queue.front();
+            client->Queue.pop_front();
+        }
+        ok = send_all(sock, chunk->data(), chunk->size());
+    }
+    boost::mutex::scoped_lock lock(Lock);
+    Clients.remove(client);
+}
+
+void LiveEdge::ServePlaylist(int sock)
+{
+    char playlist[4096];
+    char header[256];
+    int len = 0;
+    double target = EDGE_SEGMENT_DURATION;
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        for (size_t i = 0; i < Segments.size(); i++)
+            target = FFMAX(target, Segments[i].Duration);
+        len += snprintf(playlist + len, sizeof(playlist) - len
+                        , "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%lld\n"
+                        , (int)(target + 0.999), Segments.empty() ? 0LL : (long long)Segments.front().Seq);
+        for (size_t i = 0; (i < Segments.size()) && (len < (int)sizeof(playlist) - 64); i++)
+            len += snprintf(playlist + len, sizeof(playlist) - len, "#EXTINF:%.3f,\nseg%lld.ts\n"
+                            , Segments[i].Duration, (long long)Segments[i].Seq);
+    }
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/vnd.apple.mpegurl\r\n"
+             "Cache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", len);
+    if (send_text(sock, header))
+        send_all(sock, (const uint8_t*)playlist, len);
+}
+
+void LiveEdge::ServeMetrics(int sock)
+{
+    char header[256];
+    std::string text = Metrics::Dump();
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n", text.size());
+    if (send_text(sock, header))
+        send_all(sock, (const uint8_t*)text.data(), text.size());
+}
+
+void LiveEdge::ServeSegment(int sock, int64_t seq)
+{
+    char header[256];
+    EdgeChunk data;
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        for (size_t i = 0; i < Segments.size(); i++)
+        {
+            if (Segments[i].Seq == seq)
+                data = Segments[i].Data;
+        }
+    }
+    if (!data)
+    {
+        send_text(sock, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return;
+    }
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: video/mp2t\r\n"
+             "Access-Control-Allow-Origin: *\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", data->size());
+    if (send_text(sock, header))
+        send_all(sock, data->data(), data->size());
+}
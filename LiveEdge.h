@@ -0,0 +1,83 @@
+#ifndef LIVEEDGE_H
+#define LIVEEDGE_H
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <vector>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+typedef std::shared_ptr<std::vector<uint8_t> > EdgeChunk;
+
+struct EdgeClient
+{
+    std::deque<EdgeChunk>   Queue;
+    bool                    WaitKey;
+    bool                    Closed;
+};
+
+struct EdgeSegment
+{
+    int64_t     Seq;
+    double      Duration;
+    EdgeChunk   Data;
+};
+
+//serves the encoder output as HTTP-FLV (/live.flv) and HLS (/live.m3u8), new viewers start from the cached GOP
+class LiveEdge
+{
+    public:
+        LiveEdge(const char* address, int port, int hlssegments, int maxclients);
+        virtual ~LiveEdge();
+
+        bool Open(AVStream* video, AVStream* audio);
+        void Close();
+        void WritePacket(AVPacket* pkt, AVRational time_base, bool video);
+        int64_t MemoryBytes(int* chunks);
+    protected:
+        bool OpenMuxer(AVFormatContext** ctx, const char* format, std::vector<uint8_t>* out, AVStream* video, AVStream* audio);
+        void CloseMuxer(AVFormatContext** ctx);
+        bool MuxPacket(AVFormatContext* ctx, AVPacket* pkt, AVRational time_base, bool video);
+        void PushFlvTag(EdgeChunk tag, bool key);
+        void FinishSegment(double duration);
+        static int WriteProc(void* opaque, uint8_t* buf, int size);
+
+        void ServerProc();
+        void ClientProc(int sock);
+        void ServeFlv(int sock);
+        void ServePlaylist(int sock);
+        void ServeSegment(int sock, int64_t seq);
+        void ServeMetrics(int sock);
+    private:
+        char                Address[64];
+        int                 Port;
+        int                 HlsSegments;
+        int                 MaxClients;
+        bool                Runing;
+        int                 ListenSock;
+        int                 ActiveClients;
+
+        boost::mutex        Lock;
+        boost::condition_variable Cond;
+
+        AVFormatContext*    FlvCtx;
+        std::vector<uint8_t> FlvOut;
+        EdgeChunk           FlvHeader;
+        std::vector<EdgeChunk> GopCache;
+        std::list<std::shared_ptr<EdgeClient> > Clients;
+
+        AVFormatContext*    TsCtx;
+        std::vector<uint8_t> TsOut;
+        double              SegmentStart;
+        int64_t             SegmentSeq;
+        std::deque<EdgeSegment> Segments;
+
+        boost::thread*      ServerThread;
+};
+
+#endif // LIVEEDGE_H
@@ -0,0 +1,98 @@
+#include "Metrics.h"
+#include <stdio.h>
+#include <map>
+#include <boost/thread.hpp>
+
+static boost::mutex& metrics_lock()
+{
+    static boost::mutex lock;
+    return lock;
+}
+
+static std::map<std::string, double>& metrics_values()
+{
+    static std::map<std::string, double> values;
+    return values;
+}
+
+void Metrics::Set(const std::string& name, const std::string& labels, double value)
+{
+    boost::mutex::scoped_lock lock(metrics_lock());
+    if (labels.empty())
+        metrics_values()[name] = value;
+    else
+        metrics_values()[name + "{" + labels + "}"] = value;
+}
+
+void Metrics::Remove(const std::string& labels)
+{
+    boost::mutex::scoped_lock lock(metrics_lock());
+    std::map<std::string, double>& values = metrics_values();
+    for (std::map<std::string, double>::iterator it = values.begin(); it != values.end();)
+    {
+        if (it->first.find(labels) != std::string::npos)
+            values.erase(it++);
+        else
+            ++it;
+    }
+}
+
+std::string Metrics::Label(const char* key, const char* value)
+{
+    std::string label = key;
+    label += "=\"";
+    for (const char* c = value ? value : ""; *c; c++)
+    {
+        if ((*c == '"') || (*c == '\\'))
+            label += '\\';
+        if (*c == '\n')
+            label += "\\n";
+        else
+            label += *c;
+    }
+    label += "\"";
+    return label;
+}
+
+std::string Metrics::Dump()
+{
+    std::string text;
+    char value[64];
+    boost::mutex::scoped_lock lock(metrics_lock());
+    std::map<std::string, double>& values = metrics_values();
+    for (std::map<std::string, double>::iterator it = values.begin(); it != values.end(); ++it)
+    {
+        snprintf(value, sizeof(value), " %.6g\n", it->second);
+        text += it->first;
+        text += value;
+    }
+    return text;
+}
+
+bool Metrics::WriteFile(const char* path)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    std::string text = Dump();
+    FILE* file = fopen(tmp.c_str(), "w");
+    if (!file)
+        return false;
+    bool ok = (fwrite(text.data(), 1, text.size(), file) == text.size());
+    ok = (fclose(file) == 0) && ok;
+    return ok && (rename(tmp.c_str(), path) == 0);
+}
+
+static void write_proc(std::string path, int intervalms)
+{
+    while (true)
+    {
+        if (!Metrics::WriteFile(path.c_str()))
+            fprintf(stderr, "Cannot write metrics file '%s'\n", path.c_str());
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(intervalms));
+    }
+}
+
+void Metrics::WriteEvery(const char* path, int intervalms)
+{
+    //for scrapers that read a file, independent of any session's edge server
+    boost::thread(write_proc, std::string(path), intervalms).detach();
+}
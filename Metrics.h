@@ -0,0 +1,18 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+
+//process wide gauges, dumped in the Prometheus text format
+class Metrics
+{
+    public:
+        static void Set(const std::string& name, const std::string& labels, double value);
+        static void Remove(const std::string& labels);
+        static std::string Label(const char* key, const char* value);
+        static std::string Dump();
+        static bool WriteFile(const char* path);
+        static void WriteEvery(const char* path, int intervalms);
+};
+
+#endif // METRICS_H
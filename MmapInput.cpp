@@ -0,0 +1,214 @@
+#include "MmapInput.h"
+#include "Metrics.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+extern "C"
+{
+    #include <libavutil/time.h>
+}
+
+#define MMAP_READ_SIZE      32768               //avio buffer for avio_r8/avio_rb32 and friends, avio_read bypasses it (direct)
+#define MMAP_READAHEAD      (8 * 1024 * 1024)   //window kept ahead of the demuxer with MADV_WILLNEED
+#define MMAP_TAIL           (1024 * 1024)       //end of the file read with pread, it is where files get appended or cut
+
+static const char* file_path(const char* url)
+{
+    if (!strncmp(url, "file:", 5))
+        return url + 5;
+    return strstr(url, "://") ? nullptr : url;
+}
+
+MmapInput::MmapInput(const char* url, const std::string& label)
+    : Path(file_path(url) ? file_path(url) : url)
+    , Label(label + "," + Metrics::Label("input", "file"))
+    , Fd(-1)
+    , Map(nullptr)
+    , MapSize(0)
+    , Size(0)
+    , Pos(0)
+    , Verified(0)
+    , AdvisedStart(0)
+    , AdvisedEnd(-1)
+    , AvioCtx(nullptr)
+    , BytesRead(0)
+    , Remaps(0)
+    , Truncations(0)
+    , LastPublish(0)
+{
+}
+
+MmapInput::~MmapInput()
+{
+    if (AvioCtx)
+    {
+        av_freep(&AvioCtx->buffer);
+        avio_context_free(&AvioCtx);
+    }
+    if (Map)
+        munmap(Map, MapSize);
+    if (Fd >= 0)
+        close(Fd);
+    Metrics::Remove(Label);
+}
+
+bool MmapInput::Supported(const char* url)
+{
+    //pipes, devices and empty files still being created keep the file protocol
+    const char* path = file_path(url);
+    struct stat st;
+    return path && !stat(path, &st) && S_ISREG(st.st_mode) && (st.st_size > 0);
+}
+
+bool MmapInput::Open()
+{
+    Fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (Fd < 0)
+    {
+        printf("Cannot open '%s'. Error code: %d\n", Path.c_str(), errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(Fd, &st) || (st.st_size <= 0))
+        return false;
+    MapSize = Size = st.st_size;
+    Map = (uint8_t*)mmap(nullptr, MapSize, PROT_READ, MAP_SHARED, Fd, 0);
+    if (Map == MAP_FAILED)
+    {
+        printf("Cannot map '%s'. Error code: %d\n", Path.c_str(), errno);
+        Map = nullptr;
+        return false;
+    }
+    madvise(Map, Size, MADV_SEQUENTIAL);
+    Advise();
+
+    unsigned char* buffer = (unsigned char*)av_malloc(MMAP_READ_SIZE);
+    if (!buffer || !(AvioCtx = avio_alloc_context(buffer, MMAP_READ_SIZE, 0, this, ReadProc, NULL, SeekProc)))
+    {
+        av_free(buffer);
+        return false;
+    }
+    //every read is a memcpy out of the mapping, bypassing the avio buffer costs nothing
+    AvioCtx->direct = 1;
+    return true;
+}
+
+bool MmapInput::Remap()
+{
+    //a file that is still being written is picked up where the mapping ends
+    struct stat st;
+    if (fstat(Fd, &st) || (st.st_size <= Size))
+        return false;
+    if (st.st_size > MapSize)
+    {
+        void* map = mremap(Map, MapSize, st.st_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+            return false;
+        Map = (uint8_t*)map;
+        MapSize = st.st_size;
+    }
+    Size = st.st_size;
+    AdvisedEnd = -1;
+    Remaps++;
+    return true;
+}
+
+bool MmapInput::Verify()
+{
+    //pages past the end of a file truncated under the mapping raise SIGBUS, so the size is checked before the
+    //mapping is read and a shrunk file ends where it ends now
+    struct stat st;
+    if (fstat(Fd, &st))
+        return false;
+    if (st.st_size < Size)
+    {
+        Size = st.st_size;
+        AdvisedEnd = -1;
+        Truncations++;
+    }
+    Verified = Pos + MMAP_READAHEAD;
+    return Pos < Size;
+}
+
+void MmapInput::Advise()
+{
+    //renew the window once the demuxer is half way through it, or after a seek moved it elsewhere
+    if ((Pos >= AdvisedStart) && ((Pos + MMAP_READAHEAD / 2 < AdvisedEnd) || (AdvisedEnd == Size)))
+        return;
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start = Pos & ~(page - 1);
+    int64_t end = FFMIN(start + MMAP_READAHEAD, Size);
+    if (end > start)
+        madvise(Map + start, end - start, MADV_WILLNEED);
+    AdvisedStart = start;
+    AdvisedEnd = end;
+}
+
+void MmapInput::Publish()
+{
+    int64_t now = av_gettime_relative();
+    if (now - LastPublish < 1000000)
+        return;
+    LastPublish = now;
+    Metrics::Set("file_input_bytes_total", Label, BytesRead);
+    Metrics::Set("file_input_mapped_bytes", Label, Size);
+    Metrics::Set("file_input_remaps_total", Label, Remaps);
+    Metrics::Set("file_input_truncations_total", Label, Truncations);
+}
+
+int MmapInput::ReadProc(void* opaque, uint8_t* buf, int size)
+{
+    MmapInput* obj = (MmapInput*)opaque;
+    if ((obj->Pos >= obj->Size) && !obj->Remap())
+        return AVERROR_EOF;
+    int len = -1;
+    if ((obj->Pos < obj->Verified) || obj->Verify())
+    {
+        len = (int)FFMIN((int64_t)size, obj->Size - obj->Pos);
+        if (obj->Pos + len <= obj->Size - MMAP_TAIL)
+            memcpy(buf, obj->Map + obj->Pos, len);
+        else
+            len = pread(obj->Fd, buf, len, obj->Pos);
+    }
+    if (len <= 0)
+    {
+        //a cut between the fstat and the pread reads short instead of faulting
+        if (len == 0)
+            obj->Verify();
+        printf("'%s' was truncated while it was read\n", obj->Path.c_str());
+        obj->Publish();
+        return AVERROR(EIO);
+    }
+    obj->Pos += len;
+    obj->BytesRead += len;
+    obj->Advise();
+    obj->Publish();
+    return len;
+}
+
+int64_t MmapInput::SeekProc(void* opaque, int64_t offset, int whence)
+{
+    MmapInput* obj = (MmapInput*)opaque;
+    switch (whence & ~AVSEEK_FORCE)
+    {
+        case AVSEEK_SIZE:
+            return obj->Size;
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            offset += obj->Pos;
+            break;
+        case SEEK_END:
+            offset += obj->Size;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if ((offset < 0) || ((offset > obj->Size) && !obj->Remap()))
+        return AVERROR(EINVAL);
+    obj->Pos = FFMIN(offset, obj->Size);
+    obj->Verified = obj->Pos;
+    obj->Advise();
+    return obj->Pos;
+}
@@ -0,0 +1,48 @@
+#ifndef MMAPINPUT_H
+#define MMAPINPUT_H
+
+#include <string>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+//reads a local file through a read-only mapping, the demuxer copies straight out of the page cache
+//and readahead is driven with madvise instead of read() syscalls
+class MmapInput
+{
+    public:
+        MmapInput(const char* url, const std::string& label);
+        virtual ~MmapInput();
+
+        static bool Supported(const char* url);
+        bool Open();
+        AVIOContext* Context() { return AvioCtx; }
+    protected:
+        bool Remap();
+        bool Verify();
+        void Advise();
+        void Publish();
+        static int ReadProc(void* opaque, uint8_t* buf, int size);
+        static int64_t SeekProc(void* opaque, int64_t offset, int whence);
+    private:
+        std::string         Path;
+        std::string         Label;
+        int                 Fd;
+        uint8_t*            Map;
+        int64_t             MapSize;
+        int64_t             Size;           //readable part of the mapping, smaller after a truncation
+        int64_t             Pos;
+        int64_t             Verified;       //reads up to here skip the fstat, one readahead window past the last one
+        int64_t             AdvisedStart;   //readahead has been requested for this range
+        int64_t             AdvisedEnd;
+        AVIOContext*        AvioCtx;
+
+        uint64_t            BytesRead;
+        uint64_t            Remaps;
+        uint64_t            Truncations;
+        int64_t             LastPublish;
+};
+
+#endif // MMAPINPUT_H
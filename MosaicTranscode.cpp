@@ -0,0 +1,826 @@
+#include "MosaicTranscode.h"
+extern "C"
+{
+    #include <libavfilter/buffersink.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+}
+
+MosaicInput::MosaicInput(const char* inputurl, int backend, AVBufferRef* device, bool hwtiles, int tilewidth, int tileheight, int stalltimeout)
+    : Backend(backend)
+    , QSV_hw_device_ctx(device)
+    , HwTiles(hwtiles)
+    , TileWidth(tilewidth)
+    , TileHeight(tileheight)
+    , StallTimeout(stalltimeout)
+    , Runing(true)
+    , InputOpend(false)
+    , LastReadTime(0)
+    , InFmtCtx(nullptr)
+    , InVideoStream(nullptr)
+    , VideoDecoderCtx(nullptr)
+    , filter_graph(nullptr)
+    , buffersrc_ctx(nullptr)
+    , buffersink_ctx(nullptr)
+    , VFilterInited(false)
+    , Tile(nullptr)
+    , TileTime(0)
+{
+    int len = strlen(inputurl);
+    InputUrl = (char*)malloc(len + 1);
+    memset(InputUrl, 0, len + 1);
+    memcpy(InputUrl, inputurl, len);
+
+    ReadThread = new boost::thread(&MosaicInput::ReadPacketProc, this);
+}
+
+MosaicInput::~MosaicInput()
+{
+    Runing = false;
+    ReadThread->join();
+    delete ReadThread;
+    CloseInPut();
+    if (Tile)
+        av_frame_free(&Tile);
+    free(InputUrl);
+}
+
+int MosaicInput::InterruptProc(void* opaque)
+{
+    MosaicInput* obj = (MosaicInput*)opaque;
+    if (!obj->Runing)
+        return 1;
+    //a stalled network read must not hold the tile forever, reconnect instead
+    return (av_gettime_relative() - obj->LastReadTime) > (int64_t)obj->StallTimeout * 1000 * 2;
+}
+
+AVFrame* MosaicInput::GetTile()
+{
+    boost::mutex::scoped_lock lock(TileLock);
+    if (!Tile || ((av_gettime_relative() - TileTime) > (int64_t)StallTimeout * 1000))
+        return nullptr;
+    return av_frame_clone(Tile);
+}
+
+bool MosaicInput::OpenInput()
+{
+    int ret;
+    AVCodec *decoder = NULL;
+
+    InFmtCtx = avformat_alloc_context();
+    if (!InFmtCtx)
+        return false;
+    InFmtCtx->interrupt_callback.callback = InterruptProc;
+    InFmtCtx->interrupt_callback.opaque = this;
+    LastReadTime = av_gettime_relative();
+
+    AVDictionary *dco = NULL;
+    av_dict_set(&dco, "rtsp_transport", "tcp", 0);
+    av_dict_set(&dco, "stimeout", "3000000", 0);
+    if ((ret = avformat_open_input(&InFmtCtx, InputUrl, NULL, &dco)) < 0)
+    {
+        av_dict_free(&dco);
+        printf("Cannot open mosaic input '%s', Error code: %d\n", InputUrl, ret);
+        return false;
+    }
+    av_dict_free(&dco);
+    InFmtCtx->max_analyze_duration = 3 * AV_TIME_BASE;
+    InFmtCtx->probesize = 1024 * 1024 * 5;
+    if ((ret = avformat_find_stream_info(InFmtCtx, NULL)) < 0)
+    {
+        printf("Cannot find mosaic input stream information. Error code: %d\n", ret);
+        return false;
+    }
+
+    ret = av_find_best_stream(InFmtCtx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (ret < 0)
+    {
+        printf("Cannot find a video stream in mosaic input '%s'\n", InputUrl);
+        return false;
+    }
+    InVideoStream = InFmtCtx->streams[ret];
+    for (unsigned int i = 0; i < InFmtCtx->nb_streams; i ++)
+    {
+        if (InFmtCtx->streams[i] != InVideoStream)
+            InFmtCtx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    if (Backend == BACKEND_CPU)
+    {
+        decoder = avcodec_find_decoder(InVideoStream->codecpar->codec_id);
+    }
+    else switch (InVideoStream->codecpar->codec_id)
+    {
+        case AV_CODEC_ID_H264:
+            decoder = avcodec_find_decoder_by_name("h264_qsv");
+            break;
+        case AV_CODEC_ID_HEVC:
+            decoder = avcodec_find_decoder_by_name("hevc_qsv");
+            break;
+        case AV_CODEC_ID_VP8:
+            decoder = avcodec_find_decoder_by_name("vp8_qsv");
+            break;
+        case AV_CODEC_ID_VP9:
+            decoder = avcodec_find_decoder_by_name("vp9_qsv");
+            break;
+        case AV_CODEC_ID_MPEG2VIDEO:
+            decoder = avcodec_find_decoder_by_name("mpeg2_qsv");
+            break;
+        default:
+            break;
+    }
+    if (!decoder)
+    {
+        printf("The video decoder is not present in libavcodec\n");
+        return false;
+    }
+    if (!(VideoDecoderCtx = avcodec_alloc_context3(decoder)))
+        return false;
+    if ((ret = avcodec_parameters_to_context(VideoDecoderCtx, InVideoStream->codecpar)) < 0)
+    {
+        printf("avcodec_parameters_to_context error. Error code: %d\n", ret);
+        return false;
+    }
+    if (Backend == BACKEND_QSV)
+    {
+        VideoDecoderCtx->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
+        if (!VideoDecoderCtx->hw_device_ctx)
+            return false;
+        VideoDecoderCtx->get_format = get_qsv_format;
+    }
+    else
+    {
+        VideoDecoderCtx->thread_count = 0;
+    }
+    Surfaces.Attach(VideoDecoderCtx);
+    if ((ret = avcodec_open2(VideoDecoderCtx, decoder, NULL)) < 0)
+    {
+        printf("Failed to open codec for decoding. Error code: %d\n", ret);
+        return false;
+    }
+    return true;
+}
+
+void MosaicInput::CloseInPut()
+{
+    InputOpend = false;
+    if (filter_graph)
+        avfilter_graph_free(&filter_graph);
+    buffersrc_ctx = nullptr;
+    buffersink_ctx = nullptr;
+    VFilterInited = false;
+    if (VideoDecoderCtx)
+        avcodec_free_context(&VideoDecoderCtx);
+    if (InFmtCtx)
+        avformat_close_input(&InFmtCtx);
+    InVideoStream = nullptr;
+}
+
+void MosaicInput::ReadPacketProc()
+{
+    while (Runing)
+    {
+        if (!InputOpend)
+        {
+            InputOpend = OpenInput();
+            if (!InputOpend)
+            {
+                CloseInPut();
+                av_usleep(1000000);
+            }
+            continue;
+        }
+        AVPacket* pkt = av_packet_alloc();
+        LastReadTime = av_gettime_relative();
+        if (av_read_frame(InFmtCtx, pkt) < 0)
+        {
+            av_packet_free(&pkt);
+            CloseInPut();
+            continue;
+        }
+        if (pkt->stream_index == InVideoStream->index)
+            DecodeVideo(pkt);
+        av_packet_free(&pkt);
+    }
+}
+
+void MosaicInput::init_filters()
+{
+    char filter_descr[256] = {0};
+    char args[512];
+    int ret = 0;
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs  = avfilter_inout_alloc();
+    AVRational time_base = InVideoStream->time_base;
+    AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+
+    //tiles stay on the device when the compose graph overlays them there, otherwise they are composed in system memory
+    if (HwTiles)
+        snprintf(filter_descr, sizeof(filter_descr), "scale_qsv=w=%d:h=%d", TileWidth, TileHeight);
+    else if (Backend == BACKEND_QSV)
+        snprintf(filter_descr, sizeof(filter_descr), "scale_qsv=w=%d:h=%d,hwdownload,format=nv12", TileWidth, TileHeight);
+    else
+        snprintf(filter_descr, sizeof(filter_descr), "scale=w=%d:h=%d,format=nv12", TileWidth, TileHeight);
+
+    filter_graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !filter_graph || !par)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    snprintf(args, sizeof(args),
+            "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+            VideoDecoderCtx->width, VideoDecoderCtx->height, VideoDecoderCtx->pix_fmt,
+            time_base.num, time_base.den,
+            VideoDecoderCtx->sample_aspect_ratio.num, VideoDecoderCtx->sample_aspect_ratio.den);
+    ret = avfilter_graph_create_filter(&buffersrc_ctx, avfilter_get_by_name("buffer"), "in", args, NULL, filter_graph);
+    if (ret < 0)
+        goto end;
+    if (VideoDecoderCtx->hw_frames_ctx)
+    {
+        par->hw_frames_ctx = VideoDecoderCtx->hw_frames_ctx;
+        if ((ret = av_buffersrc_parameters_set(buffersrc_ctx, par)) < 0)
+            goto end;
+    }
+    ret = avfilter_graph_create_filter(&buffersink_ctx, avfilter_get_by_name("buffersink"), "out", NULL, NULL, filter_graph);
+    if (ret < 0)
+        goto end;
+
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = buffersrc_ctx;
+    outputs->pad_idx    = 0;
+    outputs->next       = NULL;
+
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = buffersink_ctx;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+
+    if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_descr, &inputs, &outputs, NULL)) < 0)
+        goto end;
+    if (Backend == BACKEND_QSV)
+    {
+        for (unsigned int i = 0; i < filter_graph->nb_filters; i++)
+        {
+            filter_graph->filters[i]->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
+            if (!filter_graph->filters[i]->hw_device_ctx)
+            {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            //the latest tile is held here and by the compose graph while the next one is scaled
+            if (HwTiles)
+                filter_graph->filters[i]->extra_hw_frames = 2;
+        }
+    }
+    ret = avfilter_graph_config(filter_graph, NULL);
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    av_freep(&par);
+    VFilterInited = (ret == 0);
+}
+
+void MosaicInput::DecodeVideo(AVPacket* pkt)
+{
+    int ret = avcodec_send_packet(VideoDecoderCtx, pkt);
+    if (ret < 0)
+        return;
+    AVFrame* frame = av_frame_alloc();
+    if (!frame)
+        return;
+    while (avcodec_receive_frame(VideoDecoderCtx, frame) == 0)
+    {
+        Surfaces.Track(frame);
+        if (!VFilterInited)
+        {
+            init_filters();
+            if (!VFilterInited)
+            {
+                printf("Cannot init tile filter for mosaic input '%s'\n", InputUrl);
+                break;
+            }
+        }
+        if (av_buffersrc_add_frame(buffersrc_ctx, frame) < 0)
+            break;
+        while (true)
+        {
+            AVFrame* tile = av_frame_alloc();
+            if (!tile)
+                break;
+            if (av_buffersink_get_frame(buffersink_ctx, tile) < 0)
+            {
+                av_frame_free(&tile);
+                break;
+            }
+            boost::mutex::scoped_lock lock(TileLock);
+            av_frame_free(&Tile);
+            Tile = tile;
+            TileTime = av_gettime_relative();
+        }
+    }
+    av_frame_free(&frame);
+}
+
+static AVFrame* upload_black(AVBufferRef* device, int width, int height)
+{
+    AVFrame* hwframe = nullptr;
+    AVFrame* black = av_frame_alloc();
+    if (!black)
+        return nullptr;
+    black->format = AV_PIX_FMT_NV12;
+    black->width  = width;
+    black->height = height;
+    if (av_frame_get_buffer(black, 32) >= 0)
+    {
+        memset(black->data[0], 16, black->linesize[0] * black->height);
+        memset(black->data[1], 128, black->linesize[1] * black->height / 2);
+        hwframe = upload_surface(device, nullptr, black);
+    }
+    av_frame_free(&black);
+    return hwframe;
+}
+
+static bool encodes_surfaces(const char* name)
+{
+    const AVCodec* codec = avcodec_find_encoder_by_name(name);
+    for (const AVPixelFormat* fmt = codec ? codec->pix_fmts : nullptr; fmt && (*fmt != AV_PIX_FMT_NONE); fmt++)
+    {
+        if (*fmt == AV_PIX_FMT_QSV)
+            return true;
+    }
+    return false;
+}
+
+MosaicTranscode::MosaicTranscode(std::vector<char*>& inputurls, MosaicInfo* mosaicset, OutputInfo* outset)
+    : MosaicSet(mosaicset)
+    , OutputSet(outset)
+    , Runing(true)
+    , OutHeadWrited(false)
+    , TileWidth(0)
+    , TileHeight(0)
+    , HwCompose(false)
+    , QSV_hw_device_ctx(nullptr)
+    , OutFmtCtx(nullptr)
+    , OutVideoStream(nullptr)
+    , VideoEncCodec(nullptr)
+    , VideoEncoderCtx(nullptr)
+    , ComposeGraph(nullptr)
+    , CanvasSrcCtx(nullptr)
+    , ComposeSinkCtx(nullptr)
+    , CanvasFrame(nullptr)
+    , BlankTile(nullptr)
+    , ComposeThread(nullptr)
+{
+    if ((MosaicSet->Columns > 0) && (MosaicSet->Rows > 0))
+    {
+        TileWidth  = (OutputSet->VideoWidth / MosaicSet->Columns) & ~1;
+        TileHeight = (OutputSet->VideoHeight / MosaicSet->Rows) & ~1;
+    }
+    if ((TileWidth < 2) || (TileHeight < 2))
+    {
+        printf("Invalid mosaic grid %dx%d for %dx%d output\n", MosaicSet->Columns, MosaicSet->Rows
+               , OutputSet->VideoWidth, OutputSet->VideoHeight);
+        return;
+    }
+
+    if (OutputSet->Backend == BACKEND_QSV)
+    {
+        int ret = av_hwdevice_ctx_create(&QSV_hw_device_ctx, AV_HWDEVICE_TYPE_QSV, "auto", NULL, 0);
+        if (ret < 0)
+        {
+            printf("Failed to create a qsv device. Error code: %d\n", ret);
+            return;
+        }
+        //a qsv encoder takes the overlaid surfaces directly, no frame leaves the device
+        if (encodes_surfaces(OutputSet->VideoEncoderName))
+        {
+            CanvasFrame = upload_black(QSV_hw_device_ctx, OutputSet->VideoWidth, OutputSet->VideoHeight);
+            BlankTile = upload_black(QSV_hw_device_ctx, TileWidth, TileHeight);
+            HwCompose = CanvasFrame && BlankTile;
+            if (!HwCompose)
+                printf("Cannot create mosaic canvas surfaces, composing in system memory\n");
+        }
+    }
+    for (size_t i = 0; (i < inputurls.size()) && (i < (size_t)(MosaicSet->Columns * MosaicSet->Rows)); i++)
+    {
+        Inputs.push_back(new MosaicInput(inputurls[i], OutputSet->Backend, QSV_hw_device_ctx, HwCompose
+                                         , TileWidth, TileHeight, MosaicSet->StallTimeout));
+    }
+    ComposeThread = new boost::thread(&MosaicTranscode::ComposeProc, this);
+}
+
+MosaicTranscode::~MosaicTranscode()
+{
+    Runing = false;
+    if (ComposeThread)
+    {
+        ComposeThread->join();
+        delete ComposeThread;
+    }
+    for (size_t i = 0; i < Inputs.size(); i++)
+        delete Inputs[i];
+    CloseOutput();
+    CloseCompose();
+    av_frame_free(&CanvasFrame);
+    av_frame_free(&BlankTile);
+    if (VideoEncoderCtx)
+        avcodec_free_context(&VideoEncoderCtx);
+    if (QSV_hw_device_ctx)
+        av_buffer_unref(&QSV_hw_device_ctx);
+}
+
+bool MosaicTranscode::OpenOutput(AVFrame* canvas)
+{
+    int ret;
+    if (!VideoEncoderCtx)
+    {
+        if (!(VideoEncCodec = avcodec_find_encoder_by_name(OutputSet->VideoEncoderName)))
+        {
+            printf("Could not find encoder '%s'\n", OutputSet->VideoEncoderName);
+            return false;
+        }
+        if (!(VideoEncoderCtx = avcodec_alloc_context3(VideoEncCodec)))
+            return false;
+        if (QSV_hw_device_ctx)
+            VideoEncoderCtx->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
+        VideoEncoderCtx->time_base = av_make_q(1, MosaicSet->FrameRate);
+        VideoEncoderCtx->framerate = av_make_q(MosaicSet->FrameRate, 1);
+        VideoEncoderCtx->pix_fmt   = AV_PIX_FMT_NV12;
+        if (canvas->hw_frames_ctx)
+        {
+            VideoEncoderCtx->pix_fmt = AV_PIX_FMT_QSV;
+            if (!(VideoEncoderCtx->hw_frames_ctx = av_buffer_ref(canvas->hw_frames_ctx)))
+            {
+                avcodec_free_context(&VideoEncoderCtx);
+                return false;
+            }
+        }
+        VideoEncoderCtx->width     = OutputSet->VideoWidth;
+        VideoEncoderCtx->height    = OutputSet->VideoHeight;
+        VideoEncoderCtx->profile   = OutputSet->VideoProfile;
+        VideoEncoderCtx->gop_size  = MosaicSet->FrameRate;
+        VideoEncoderCtx->keyint_min = MosaicSet->FrameRate;
+        VideoEncoderCtx->bit_rate  = OutputSet->VideoBitrate;
+        VideoEncoderCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER | AV_CODEC_FLAG_LOW_DELAY | AV_CODEC_FLAG_CLOSED_GOP;
+
+        AVDictionary* opt = NULL;
+        av_dict_set(&opt, "preset", "veryfast", 0);
+        av_dict_set(&opt, "tune", "zerolatency", 0);
+        av_dict_set_int(&opt, "look_ahead", 0, 0);
+        ret = avcodec_open2(VideoEncoderCtx, VideoEncCodec, &opt);
+        av_dict_free(&opt);
+        if (ret < 0)
+        {
+            printf("Failed to open mosaic encoder. Error code: %d\n", ret);
+            avcodec_free_context(&VideoEncoderCtx);
+            return false;
+        }
+    }
+
+    if ((ret = avformat_alloc_output_context2(&OutFmtCtx, NULL, OutputSet->OutputType, OutputSet->OutputUrl)) < 0)
+    {
+        printf("Failed to deduce output format from file extension. Error code: %d\n", ret);
+        return false;
+    }
+    if (!(OutVideoStream = avformat_new_stream(OutFmtCtx, VideoEncCodec)))
+    {
+        CloseOutput();
+        return false;
+    }
+    OutVideoStream->time_base = VideoEncoderCtx->time_base;
+    if (avcodec_parameters_from_context(OutVideoStream->codecpar, VideoEncoderCtx) < 0)
+    {
+        CloseOutput();
+        return false;
+    }
+    if (!(OutFmtCtx->oformat->flags & AVFMT_NOFILE))
+    {
+        if ((ret = avio_open(&OutFmtCtx->pb, OutputSet->OutputUrl, AVIO_FLAG_WRITE)) < 0)
+        {
+            printf("Could not open output file '%s'\n", OutputSet->OutputUrl);
+            CloseOutput();
+            return false;
+        }
+    }
+    AVDictionary* opt = nullptr;
+    av_dict_set(&opt, "flvflags", "no_duration_filesize", 0);
+    ret = avformat_write_header(OutFmtCtx, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        printf("Error while writing stream header. Error code: %d\n", ret);
+        CloseOutput();
+        return false;
+    }
+    OutHeadWrited = true;
+    return true;
+}
+
+void MosaicTranscode::CloseOutput()
+{
+    if (OutFmtCtx)
+    {
+        if (OutHeadWrited)
+            av_write_trailer(OutFmtCtx);
+        if (!(OutFmtCtx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&OutFmtCtx->pb);
+        avformat_free_context(OutFmtCtx);
+        OutFmtCtx = nullptr;
+    }
+    OutVideoStream = nullptr;
+    OutHeadWrited = false;
+}
+
+void MosaicTranscode::ComposeFrame(AVFrame* canvas)
+{
+    for (int i = 0; i < MosaicSet->Columns * MosaicSet->Rows; i++)
+    {
+        int x = (i % MosaicSet->Columns) * TileWidth;
+        int y = (i / MosaicSet->Columns) * TileHeight;
+        uint8_t* dsty  = canvas->data[0] + y * canvas->linesize[0] + x;
+        uint8_t* dstuv = canvas->data[1] + (y / 2) * canvas->linesize[1] + x;
+        AVFrame* tile = (i < (int)Inputs.size()) ? Inputs[i]->GetTile() : nullptr;
+
+        if (tile && (tile->width == TileWidth) && (tile->height == TileHeight))
+        {
+            for (int row = 0; row < TileHeight; row++)
+                memcpy(dsty + row * canvas->linesize[0], tile->data[0] + row * tile->linesize[0], TileWidth);
+            for (int row = 0; row < TileHeight / 2; row++)
+                memcpy(dstuv + row * canvas->linesize[1], tile->data[1] + row * tile->linesize[1], TileWidth);
+        }
+        else
+        {
+            //missing or stalled input, fill the tile instead of waiting
+            for (int row = 0; row < TileHeight; row++)
+                memset(dsty + row * canvas->linesize[0], 16, TileWidth);
+            for (int row = 0; row < TileHeight / 2; row++)
+                memset(dstuv + row * canvas->linesize[1], 128, TileWidth);
+        }
+        av_frame_free(&tile);
+    }
+}
+
+void MosaicTranscode::ComposeProc()
+{
+    int64_t start = av_gettime_relative();
+    int64_t frameno = 0;
+    while (Runing)
+    {
+        int64_t due = start + frameno * 1000000 / MosaicSet->FrameRate;
+        int64_t now = av_gettime_relative();
+        if (now < due)
+        {
+            av_usleep(due - now);
+            continue;
+        }
+        if (now - due > 1000000)
+        {
+            start = now - frameno * 1000000 / MosaicSet->FrameRate;
+        }
+
+        AVFrame* canvas = nullptr;
+        if (HwCompose)
+        {
+            if (!(canvas = ComposeSurface(frameno++)))
+            {
+                printf("Error during mosaic composition.\n");
+                continue;
+            }
+        }
+        else
+        {
+            if (!(canvas = av_frame_alloc()))
+                continue;
+            canvas->format = AV_PIX_FMT_NV12;
+            canvas->width  = OutputSet->VideoWidth;
+            canvas->height = OutputSet->VideoHeight;
+            if (av_frame_get_buffer(canvas, 32) < 0)
+            {
+                av_frame_free(&canvas);
+                continue;
+            }
+            if (TileWidth * MosaicSet->Columns != canvas->width || TileHeight * MosaicSet->Rows != canvas->height)
+            {
+                memset(canvas->data[0], 16, canvas->linesize[0] * canvas->height);
+                memset(canvas->data[1], 128, canvas->linesize[1] * canvas->height / 2);
+            }
+            ComposeFrame(canvas);
+            canvas->pts = frameno++;
+        }
+        //opened with the first canvas, a composed surface brings the frames context the encoder reads
+        if (!OutHeadWrited && !OpenOutput(canvas))
+        {
+            av_frame_free(&canvas);
+            av_usleep(1000000);
+            continue;
+        }
+        if (encode_write(canvas) < 0)
+            printf("Error during mosaic encoding and writing.\n");
+        av_frame_free(&canvas);
+    }
+}
+
+int MosaicTranscode::CreateFrameSource(AVFilterContext** src_ctx, const char* name, AVFrame* frame, AVFilterInOut** outputs)
+{
+    char args[512];
+    int ret;
+    AVFilterInOut* inout;
+    AVBufferSrcParameters *par;
+
+    snprintf(args, sizeof(args),
+            "video_size=%dx%d:pix_fmt=%d:time_base=1/%d:pixel_aspect=1/1",
+            frame->width, frame->height, frame->format, MosaicSet->FrameRate);
+    ret = avfilter_graph_create_filter(src_ctx, avfilter_get_by_name("buffer"), name, args, NULL, ComposeGraph);
+    if (ret < 0)
+        return ret;
+    if (!(par = av_buffersrc_parameters_alloc()))
+        return AVERROR(ENOMEM);
+    par->hw_frames_ctx = frame->hw_frames_ctx;
+    ret = av_buffersrc_parameters_set(*src_ctx, par);
+    av_freep(&par);
+    if (ret < 0)
+        return ret;
+
+    if (!(inout = avfilter_inout_alloc()))
+        return AVERROR(ENOMEM);
+    inout->name       = av_strdup(name);
+    inout->filter_ctx = *src_ctx;
+    inout->pad_idx    = 0;
+    inout->next       = *outputs;
+    *outputs          = inout;
+    return 0;
+}
+
+bool MosaicTranscode::InitCompose(std::vector<AVFrame*>& tiles)
+{
+    std::string descr;
+    char name[32];
+    char link[512];
+    char last[32] = "canvas";
+    char next[32];
+    int ret = 0;
+    AVFilterInOut *outputs = nullptr;
+    AVFilterInOut *inputs  = avfilter_inout_alloc();
+
+    ComposeGraph = avfilter_graph_alloc();
+    if (!inputs || !ComposeGraph)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = CreateFrameSource(&CanvasSrcCtx, "canvas", CanvasFrame, &outputs)) < 0)
+        goto end;
+    //every tile is overlaid on the result of the previous one, the last overlay feeds the sink
+    TileSrcCtx.assign(tiles.size(), nullptr);
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        snprintf(name, sizeof(name), "t%d", (int)i);
+        if ((ret = CreateFrameSource(&TileSrcCtx[i], name, tiles[i], &outputs)) < 0)
+            goto end;
+        if (i + 1 < tiles.size())
+            snprintf(next, sizeof(next), "m%d", (int)i);
+        else
+            snprintf(next, sizeof(next), "out");
+        snprintf(link, sizeof(link), "%s[%s][%s]overlay_qsv=x=%d:y=%d[%s]", i ? ";" : "", last, name
+                 , (int)(i % MosaicSet->Columns) * TileWidth, (int)(i / MosaicSet->Columns) * TileHeight, next);
+        descr += link;
+        memcpy(last, next, sizeof(last));
+    }
+    if (tiles.empty())
+        descr = "[canvas]null[out]";
+    if ((ret = avfilter_graph_create_filter(&ComposeSinkCtx, avfilter_get_by_name("buffersink"), "out", NULL, NULL, ComposeGraph)) < 0)
+        goto end;
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = ComposeSinkCtx;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+    av_log(NULL, AV_LOG_DEBUG, "Mosaic filter: %s\n", descr.c_str());
+
+    if ((ret = avfilter_graph_parse_ptr(ComposeGraph, descr.c_str(), &inputs, &outputs, NULL)) < 0)
+        goto end;
+    for (unsigned int i = 0; i < ComposeGraph->nb_filters; i++)
+    {
+        ComposeGraph->filters[i]->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
+        if (!ComposeGraph->filters[i]->hw_device_ctx)
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    ret = avfilter_graph_config(ComposeGraph, NULL);
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret < 0)
+    {
+        printf("Cannot init mosaic compose filter. Error code: %d\n", ret);
+        CloseCompose();
+        return false;
+    }
+    ComposeKey.clear();
+    for (size_t i = 0; i < tiles.size(); i++)
+        ComposeKey.push_back(tiles[i]->hw_frames_ctx->data);
+    return true;
+}
+
+void MosaicTranscode::CloseCompose()
+{
+    avfilter_graph_free(&ComposeGraph);
+    CanvasSrcCtx = nullptr;
+    TileSrcCtx.clear();
+    ComposeSinkCtx = nullptr;
+    ComposeKey.clear();
+}
+
+AVFrame* MosaicTranscode::ComposeSurface(int64_t pts)
+{
+    std::vector<AVFrame*> tiles;
+    std::vector<uint8_t*> key;
+    AVFrame* canvas = nullptr;
+    bool ok = true;
+
+    for (size_t i = 0; i < Inputs.size(); i++)
+    {
+        AVFrame* tile = Inputs[i]->GetTile();
+        if (!tile || !tile->hw_frames_ctx || (tile->width != TileWidth) || (tile->height != TileHeight))
+        {
+            //missing or stalled input, the blank surface is overlaid instead of waiting
+            av_frame_free(&tile);
+            tile = av_frame_clone(BlankTile);
+        }
+        if (!tile)
+        {
+            ok = false;
+            break;
+        }
+        tiles.push_back(tile);
+        key.push_back(tile->hw_frames_ctx->data);
+    }
+    //a reconnected input or a stalled one brings surfaces from another pool, the sources are rebuilt for it
+    if (ok && ComposeGraph && (key != ComposeKey))
+        CloseCompose();
+    if (ok && !ComposeGraph)
+        ok = InitCompose(tiles);
+
+    if (ok)
+    {
+        CanvasFrame->pts = pts;
+        ok = (av_buffersrc_add_frame_flags(CanvasSrcCtx, CanvasFrame, AV_BUFFERSRC_FLAG_KEEP_REF) >= 0);
+    }
+    for (size_t i = 0; ok && (i < tiles.size()); i++)
+    {
+        tiles[i]->pts = pts;
+        ok = (av_buffersrc_add_frame_flags(TileSrcCtx[i], tiles[i], 0) >= 0);
+    }
+    if (ok && (canvas = av_frame_alloc()) && (av_buffersink_get_frame(ComposeSinkCtx, canvas) < 0))
+        av_frame_free(&canvas);
+    if (!ok)
+        CloseCompose();
+    for (size_t i = 0; i < tiles.size(); i++)
+        av_frame_free(&tiles[i]);
+    return canvas;
+}
+
+int MosaicTranscode::encode_write(AVFrame *frame)
+{
+    int ret = 0;
+    AVPacket enc_pkt;
+
+    av_init_packet(&enc_pkt);
+    enc_pkt.data = NULL;
+    enc_pkt.size = 0;
+
+    if ((ret = avcodec_send_frame(VideoEncoderCtx, frame)) < 0)
+    {
+        printf("Error during encoding. Error code: %d\n", ret);
+        return -1;
+    }
+    while (1)
+    {
+        ret = avcodec_receive_packet(VideoEncoderCtx, &enc_pkt);
+        if (ret != 0)
+            break;
+        enc_pkt.stream_index = OutVideoStream->index;
+        av_packet_rescale_ts(&enc_pkt, VideoEncoderCtx->time_base, OutVideoStream->time_base);
+        enc_pkt.pos = 0;
+        if (OutHeadWrited && OutFmtCtx)
+        {
+            ret = av_interleaved_write_frame(OutFmtCtx, &enc_pkt);
+            if (ret < 0)
+            {
+                printf("Error during writing data to output file. Error code: %d\n", ret);
+                if (ret != -22)
+                {
+                    CloseOutput();
+                    return -1;
+                }
+            }
+        }
+        av_packet_unref(&enc_pkt);
+    }
+    return ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF)) ? 0 : -1;
+}
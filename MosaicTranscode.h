@@ -0,0 +1,100 @@
+#ifndef MOSAICTRANSCODE_H
+#define MOSAICTRANSCODE_H
+
+#include <string>
+#include <vector>
+#include "QSVTranscode.h"
+
+struct MosaicInfo
+{
+    int Columns;
+    int Rows;
+    int FrameRate       = 25;
+    int StallTimeout    = 2000; //ms without a new frame before the tile is filled
+};
+
+class MosaicInput
+{
+    public:
+        MosaicInput(const char* inputurl, int backend, AVBufferRef* device, bool hwtiles, int tilewidth, int tileheight, int stalltimeout);
+        virtual ~MosaicInput();
+
+        AVFrame* GetTile();
+    protected:
+        bool OpenInput();
+        void CloseInPut();
+        void ReadPacketProc();
+        void DecodeVideo(AVPacket* pkt);
+        void init_filters();
+        static int InterruptProc(void* opaque);
+    private:
+        char*               InputUrl;
+        int                 Backend;
+        AVBufferRef*        QSV_hw_device_ctx;
+        bool                HwTiles;            //tiles stay on the device for the compose graph
+        int                 TileWidth;
+        int                 TileHeight;
+        int                 StallTimeout;
+        bool                Runing;
+        bool                InputOpend;
+        int64_t             LastReadTime;
+
+        AVFormatContext*    InFmtCtx;
+        AVStream*           InVideoStream;
+        AVCodecContext*     VideoDecoderCtx;
+        SurfacePool         Surfaces;
+        AVFilterGraph*      filter_graph;
+        AVFilterContext*    buffersrc_ctx;
+        AVFilterContext*    buffersink_ctx;
+        bool                VFilterInited;
+
+        boost::mutex        TileLock;
+        AVFrame*            Tile;
+        int64_t             TileTime;
+
+        boost::thread*      ReadThread;
+};
+
+class MosaicTranscode
+{
+    public:
+        MosaicTranscode(std::vector<char*>& inputurls, MosaicInfo* mosaicset, OutputInfo* outset);
+        virtual ~MosaicTranscode();
+    protected:
+        bool OpenOutput(AVFrame* canvas);
+        void CloseOutput();
+        void ComposeProc();
+        void ComposeFrame(AVFrame* canvas);
+        AVFrame* ComposeSurface(int64_t pts);
+        bool InitCompose(std::vector<AVFrame*>& tiles);
+        void CloseCompose();
+        int CreateFrameSource(AVFilterContext** src_ctx, const char* name, AVFrame* frame, AVFilterInOut** outputs);
+        int encode_write(AVFrame *frame);
+    private:
+        MosaicInfo*         MosaicSet;
+        OutputInfo*         OutputSet;
+        bool                Runing;
+        bool                OutHeadWrited;
+        int                 TileWidth;
+        int                 TileHeight;
+        bool                HwCompose;          //tiles overlaid on the device and encoded from surfaces
+
+        AVBufferRef*        QSV_hw_device_ctx;
+        AVFormatContext*    OutFmtCtx;
+        AVStream*           OutVideoStream;
+        AVCodec*            VideoEncCodec;
+        AVCodecContext*     VideoEncoderCtx;
+
+        AVFilterGraph*      ComposeGraph;
+        AVFilterContext*    CanvasSrcCtx;
+        std::vector<AVFilterContext*> TileSrcCtx;
+        AVFilterContext*    ComposeSinkCtx;
+        std::vector<uint8_t*> ComposeKey;       //frames context of each tile source, a change rebuilds the graph
+        AVFrame*            CanvasFrame;
+        AVFrame*            BlankTile;
+
+        std::vector<MosaicInput*> Inputs;
+        boost::thread*      ComposeThread;
+};
+
+#endif // MOSAICTRANSCODE_H
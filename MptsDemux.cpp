@@ -0,0 +1,228 @@
+#include "MptsDemux.h"
+extern "C"
+{
+    #include <libavutil/time.h>
+}
+
+MptsDemux::MptsDemux(const char* inputurl, int udpjitterms)
+    : UdpJitterMs(udpjitterms)
+    , Runing(true)
+    , InputOpend(false)
+    , Gen(0)
+    , RoutesChanged(false)
+    , InFmtCtx(nullptr)
+    , UdpIn(nullptr)
+{
+    InputUrl = strdup(inputurl);
+    ReadThread = new boost::thread(&MptsDemux::ReadPacketProc, this);
+}
+
+MptsDemux::~MptsDemux()
+{
+    Runing = false;
+    ReadThread->join();
+    delete ReadThread;
+    //pipelines may still hold streams of the input, stop them first
+    for (size_t i = 0; i < Routes.size(); i++)
+        delete Routes[i].Pipeline;
+    Routes.clear();
+    CloseInPut();
+    free(InputUrl);
+}
+
+QSVTranscode* MptsDemux::AddProgram(OutputInfo* outset, AudioEncodeInfo* audioset)
+{
+    MptsRoute route = {nullptr, outset, nullptr, nullptr};
+    route.Pipeline = new QSVTranscode(InputUrl, outset, audioset, this);
+    boost::mutex::scoped_lock lock(Lock);
+    Routes.push_back(route);
+    //stream and program discard flags belong to the demux thread, it applies the change between reads
+    RoutesChanged = true;
+    return route.Pipeline;
+}
+
+static AVStream* copy_stream(AVFormatContext* copies, AVStream* stream)
+{
+    AVStream* copy = avformat_new_stream(copies, NULL);
+    if (!copy || (avcodec_parameters_copy(copy->codecpar, stream->codecpar) < 0))
+        return nullptr;
+    //the index keeps matching the stream_index of the pushed packets
+    copy->index          = stream->index;
+    copy->id             = stream->id;
+    copy->time_base      = stream->time_base;
+    copy->avg_frame_rate = stream->avg_frame_rate;
+    copy->r_frame_rate   = stream->r_frame_rate;
+    copy->start_time     = stream->start_time;
+    copy->sample_aspect_ratio = stream->sample_aspect_ratio;
+    return copy;
+}
+
+bool MptsDemux::GetStreams(QSVTranscode* pipeline, AVFormatContext* copies, AVStream** video, AVStream** audio, int* generation)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    if (!InputOpend)
+        return false;
+    for (size_t i = 0; i < Routes.size(); i++)
+    {
+        if (Routes[i].Pipeline == pipeline)
+        {
+            //copied under the lock, so a pipeline never touches the streams of a closed input
+            *video = Routes[i].Video ? copy_stream(copies, Routes[i].Video) : nullptr;
+            *audio = Routes[i].Audio ? copy_stream(copies, Routes[i].Audio) : nullptr;
+            *generation = Gen;
+            return *video != nullptr;
+        }
+    }
+    return false;
+}
+
+int MptsDemux::Generation()
+{
+    boost::mutex::scoped_lock lock(Lock);
+    return Gen;
+}
+
+void MptsDemux::UpdateRoutes()
+{
+    std::vector<bool> used(InFmtCtx->nb_streams, false);
+    for (size_t i = 0; i < Routes.size(); i++)
+    {
+        if (!QSVTranscode::SelectStreams(InFmtCtx, Routes[i].OutputSet, &Routes[i].Video, &Routes[i].Audio))
+            printf("MPTS input '%s' has no video for program %d\n", InputUrl, Routes[i].OutputSet->Program);
+        if (Routes[i].Video)
+            used[Routes[i].Video->index] = true;
+        if (Routes[i].Audio)
+            used[Routes[i].Audio->index] = true;
+    }
+    //the mpegts demuxer skips PES parsing of discarded streams and programs
+    for (unsigned int i = 0; i < InFmtCtx->nb_streams; i ++)
+        InFmtCtx->streams[i]->discard = used[i] ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    for (unsigned int i = 0; i < InFmtCtx->nb_programs; i ++)
+    {
+        AVProgram* program = InFmtCtx->programs[i];
+        program->discard = AVDISCARD_ALL;
+        for (unsigned int j = 0; j < program->nb_stream_indexes; j ++)
+        {
+            if (used[program->stream_index[j]])
+                program->discard = AVDISCARD_DEFAULT;
+        }
+    }
+}
+
+int MptsDemux::InterruptProc(void* opaque)
+{
+    MptsDemux* obj = (MptsDemux*)opaque;
+    return !obj->Runing;
+}
+
+bool MptsDemux::OpenInput()
+{
+    int ret;
+    AVInputFormat* informat = NULL;
+
+    InFmtCtx = avformat_alloc_context();
+    if (!InFmtCtx)
+        return false;
+    InFmtCtx->interrupt_callback.callback = InterruptProc;
+    InFmtCtx->interrupt_callback.opaque = this;
+    if (!strncmp(InputUrl, "udp://", 6))
+    {
+        UdpIn = new UdpInput(InputUrl, UdpJitterMs, Metrics::Label("mpts", InputUrl));
+        if (!UdpIn->Open(&InFmtCtx->interrupt_callback))
+        {
+            printf("Cannot open udp input '%s'\n", InputUrl);
+            return false;
+        }
+        InFmtCtx->pb = UdpIn->Context();
+        InFmtCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    informat = av_find_input_format("mpegts");
+    if ((ret = avformat_open_input(&InFmtCtx, InputUrl, informat, NULL)) < 0)
+    {
+        printf("Cannot open MPTS input '%s', Error code: %d\n", InputUrl, ret);
+        return false;
+    }
+    InFmtCtx->max_analyze_duration = 3 * AV_TIME_BASE;
+    InFmtCtx->probesize = 1024 * 1024 * 10;
+    if ((ret = avformat_find_stream_info(InFmtCtx, NULL)) < 0)
+    {
+        printf("Cannot find MPTS input stream information. Error code: %d\n", ret);
+        return false;
+    }
+
+    boost::mutex::scoped_lock lock(Lock);
+    UpdateRoutes();
+    RoutesChanged = false;
+    Gen++;
+    InputOpend = true;
+    return true;
+}
+
+void MptsDemux::CloseInPut()
+{
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        InputOpend = false;
+        Gen++;
+        for (size_t i = 0; i < Routes.size(); i++)
+        {
+            Routes[i].Video = nullptr;
+            Routes[i].Audio = nullptr;
+        }
+    }
+    //pipelines only hold their own copies of the streams, nothing waits for them to let go
+    if (InFmtCtx)
+    {
+        AVFormatContext* CloseFmtCtx = InFmtCtx;
+        InFmtCtx = nullptr;
+        avformat_close_input(&CloseFmtCtx);
+    }
+    if (UdpIn)
+    {
+        delete UdpIn;
+        UdpIn = nullptr;
+    }
+}
+
+void MptsDemux::ReadPacketProc()
+{
+    while (Runing)
+    {
+        if (!InputOpend)
+        {
+            if (!OpenInput())
+            {
+                CloseInPut();
+                av_usleep(1000000);
+            }
+            continue;
+        }
+
+        AVPacket* pkt = av_packet_alloc();
+        if (av_read_frame(InFmtCtx, pkt) < 0)
+        {
+            av_packet_free(&pkt);
+            CloseInPut();
+            continue;
+        }
+        {
+            //packets are refcounted, every program gets a reference instead of a copy
+            boost::mutex::scoped_lock lock(Lock);
+            if (RoutesChanged)
+            {
+                UpdateRoutes();
+                RoutesChanged = false;
+            }
+            for (size_t i = 0; i < Routes.size(); i++)
+            {
+                if ((!Routes[i].Video || (Routes[i].Video->index != pkt->stream_index))
+                    && (!Routes[i].Audio || (Routes[i].Audio->index != pkt->stream_index)))
+                    continue;
+                AVPacket* ref = av_packet_clone(pkt);
+                if (ref && !Routes[i].Pipeline->PushPacket(ref))
+                    av_packet_free(&ref);
+            }
+        }
+        av_packet_free(&pkt);
+    }
+}
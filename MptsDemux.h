@@ -0,0 +1,48 @@
+#ifndef MPTSDEMUX_H
+#define MPTSDEMUX_H
+
+#include <vector>
+#include "QSVTranscode.h"
+
+struct MptsRoute
+{
+    QSVTranscode*   Pipeline;
+    OutputInfo*     OutputSet;
+    AVStream*       Video;
+    AVStream*       Audio;
+};
+
+//reads and demuxes a multi-program transport stream once and feeds the
+//streams of each program to its own transcode pipeline
+class MptsDemux
+{
+    public:
+        MptsDemux(const char* inputurl, int udpjitterms);
+        virtual ~MptsDemux();
+
+        QSVTranscode* AddProgram(OutputInfo* outset, AudioEncodeInfo* audioset);
+        bool GetStreams(QSVTranscode* pipeline, AVFormatContext* copies, AVStream** video, AVStream** audio, int* generation);
+        int Generation();
+    protected:
+        bool OpenInput();
+        void CloseInPut();
+        void UpdateRoutes();
+        void ReadPacketProc();
+        static int InterruptProc(void* opaque);
+    private:
+        char*               InputUrl;
+        int                 UdpJitterMs;
+        bool                Runing;
+        bool                InputOpend;
+        int                 Gen;
+        bool                RoutesChanged;  //set by AddProgram, applied by the demux thread
+
+        AVFormatContext*    InFmtCtx;
+        UdpInput*           UdpIn;
+
+        boost::mutex        Lock;
+        std::vector<MptsRoute> Routes;
+        boost::thread*      ReadThread;
+};
+
+#endif // MPTSDEMUX_H
@@ -1,15 +1,23 @@
 #include "QSVTranscode.h"
+#include "CapacityModel.h"
+#include "MptsDemux.h"
+#include <unistd.h>
 extern "C"
 {
     #include <libavutil/hwcontext_qsv.h>
     #include <libavutil/error.h>
     #include <libavfilter/buffersink.h>
     #include <libavutil/opt.h>
+    #include <libavutil/pixdesc.h>
     #include <libavutil/time.h>
     #include <libswresample/swresample.h>
+    #include <libswscale/swscale.h>
 }
 
-static AVPixelFormat get_qsv_format(AVCodecContext *avctx, const enum AVPixelFormat *pix_fmts)
+#define STREAM_END_OF_FILE  2   //queued after the last packet of a batch item
+#define LOGO_POOL_SURFACES  3   //logo surfaces: the one in the graph, a swapped one and one in flight
+
+AVPixelFormat get_qsv_format(AVCodecContext *avctx, const enum AVPixelFormat *pix_fmts)
 {
     while (*pix_fmts != AV_PIX_FMT_NONE)
     {
@@ -18,9 +26,9 @@ static AVPixelFormat get_qsv_format(AVCodecContext *avctx, const enum AVPixelFor
             AVHWFramesContext  *frames_ctx;
             AVQSVFramesContext *frames_hwctx;
             int ret;
-            QSVTranscode* obj = (QSVTranscode*)avctx->opaque;
-            /* create a pool of surfaces to be used by the decoder */
-            avctx->hw_frames_ctx = av_hwframe_ctx_alloc(obj->QSV_hw_device_ctx);
+            /* create a pool of surfaces to be used by the decoder, a reinit replaces the previous one */
+            av_buffer_unref(&avctx->hw_frames_ctx);
+            avctx->hw_frames_ctx = av_hwframe_ctx_alloc(avctx->hw_device_ctx);
             if (!avctx->hw_frames_ctx)
                 return AV_PIX_FMT_NONE;
             frames_ctx   = (AVHWFramesContext*)avctx->hw_frames_ctx->data;
@@ -30,7 +38,7 @@ static AVPixelFormat get_qsv_format(AVCodecContext *avctx, const enum AVPixelFor
             frames_ctx->sw_format         = avctx->sw_pix_fmt;
             frames_ctx->width             = FFALIGN(avctx->coded_width,  32);
             frames_ctx->height            = FFALIGN(avctx->coded_height, 32);
-            frames_ctx->initial_pool_size = 32;
+            frames_ctx->initial_pool_size = avctx->opaque ? ((SurfacePool*)avctx->opaque)->PoolSize(avctx) : 32;
 
             frames_hwctx->frame_type = MFX_MEMTYPE_VIDEO_MEMORY_DECODER_TARGET;
 
@@ -49,18 +57,45 @@ static AVPixelFormat get_qsv_format(AVCodecContext *avctx, const enum AVPixelFor
     return AV_PIX_FMT_NONE;
 }
 
-QSVTranscode::QSVTranscode(char* inputurl,  OutputInfo* outset, AudioEncodeInfo* audioset)
+QSVTranscode::QSVTranscode(char* inputurl,  OutputInfo* outset, AudioEncodeInfo* audioset, MptsDemux* demux
+                           , const std::vector<BatchItem>* batch)
     : QSV_hw_device_ctx(nullptr)
     , filter_graph(nullptr)
     , buffersrc_ctx(nullptr)
     , buffersink_ctx(nullptr)
+    , canvassrc_ctx(nullptr)
+    , CanvasFrame(nullptr)
+    , logosrc_ctx(nullptr)
+    , LogoFrame(nullptr)
+    , LogoFramesCtx(nullptr)
     , AudioPts(0)
     , Runing(true)
     , InputOpend(false)
     , OutputOpend(false)
     , OutHeadWrited(false)
+    , Demux(demux)
+    , BatchIndex(0)
+    , BatchComplete(false)
+    , BatchFileDone(false)
+    , BatchStart(0)
+    , FileStart(0)
+    , FileFrames(0)
+    , BatchFrames(0)
+    , CheckpointLoaded(false)
+    , CheckpointOn(false)
+    , LastCheckpointPts(AV_NOPTS_VALUE)
+    , LastAudioMuxPts(AV_NOPTS_VALUE)
+    , ResumeVideoPts(AV_NOPTS_VALUE)
+    , ResumeAudioPts(AV_NOPTS_VALUE)
+    , ResumeOffset(-1)
+    , ResumeFrames(0)
+    , InputGeneration(0)
     , InFmtCtx(nullptr)
+    , StreamCopies(nullptr)
+    , UdpIn(nullptr)
+    , FileIn(nullptr)
     , OutFmtCtx(nullptr)
+    , UdpOut(nullptr)
     , VideoDecoderCtx(nullptr)
     , VideoEncoderCtx(nullptr)
     , AudioDecoderCtx(nullptr)
@@ -75,17 +110,65 @@ QSVTranscode::QSVTranscode(char* inputurl,  OutputInfo* outset, AudioEncodeInfo*
     , AudioEncCodec(nullptr)
     , SwrCtx(nullptr)
     , PcmBuffer(nullptr)
+    , PcmFormat(AV_SAMPLE_FMT_NONE)
+    , PcmChannels(0)
+    , Edge(nullptr)
+    , Timeshift(nullptr)
+    , Quality(nullptr)
+    , Complexity(nullptr)
+    , Scaler(nullptr)
+    , Admitted(false)
+    , Backend(outset->Backend)
+    , QueuedWidth(0)
+    , QueuedHeight(0)
+    , QueuedFps(0)
+    , NumaNode(ThreadPlacement::PickNode(outset))
+    , StageFrames(0)
+    , StatsStart(0)
+    , Shedding(false)
+    , DecoderFramesData(nullptr)
+    , KeyFramePending(false)
+    , LastKeyFrameTime(0)
 {
     PktBuffer = av_fifo_alloc(sizeof(AVPacket**) * 10);
     av_fifo_reset(PktBuffer);
 
     OutputSet = outset;
     AudioSet = audioset;
+    if (outset->CheckpointPath && !demux && !batch)
+    {
+        //a checkpointed file job ends at EOF like a batch of one instead of reopening the input
+        BatchItem item;
+        item.InputUrl = inputurl;
+        item.OutputUrl = outset->OutputUrl;
+        Batch.push_back(item);
+        batch = &Batch;
+    }
+    if (batch && !batch->empty())
+    {
+        Batch = *batch;
+        inputurl = &Batch[0].InputUrl[0];
+        OutputSet->OutputUrl = &Batch[0].OutputUrl[0];
+        BatchStart = FileStart = av_gettime_relative();
+    }
 
     int len = strlen(inputurl);
     InputUrl = (char*)malloc(len + 1);
     memset(InputUrl, 0, len + 1);
     memcpy(InputUrl, inputurl, len);
+    memset(StageTime, 0, sizeof(StageTime));
+    SessionLabel = Metrics::Label("session", OutputSet->OutputUrl);
+    Memory.Configure(SessionLabel, OutputSet->MemoryBudget);
+    Surfaces.Configure(SessionLabel, OutputSet->SurfacePoolCap);
+
+    if (OutputSet->EdgePort > 0)
+        Edge = new LiveEdge(OutputSet->EdgeAddress, OutputSet->EdgePort, OutputSet->EdgeHlsSegments, OutputSet->EdgeMaxClients);
+    if (OutputSet->TimeshiftPath && (OutputSet->TimeshiftBytes > 0))
+        Timeshift = new TimeshiftRing(OutputSet->TimeshiftPath, OutputSet->TimeshiftBytes, SessionLabel);
+    if (OutputSet->QualitySampleInterval > 0)
+        Quality = new QualitySampler(SessionLabel, OutputSet->QualitySampleInterval);
+    if ((OutputSet->BitrateFloor > 0) || (OutputSet->BitrateCeiling > 0))
+        Complexity = new ComplexityAnalyzer(SessionLabel, OutputSet->ComplexitySampleInterval);
 
     ReadThread = new boost::thread(&QSVTranscode::ReadPacketProc, this);
     WriteThread = new boost::thread(&QSVTranscode::WritePacketProc, this);
@@ -96,14 +179,35 @@ QSVTranscode::~QSVTranscode()
     Runing = false;
     ReadThread->join();
     WriteThread->join();
+    if (Edge)
+        delete Edge;
+    if (Timeshift)
+        delete Timeshift;
+    if (Quality)
+        delete Quality;
+    if (Complexity)
+        delete Complexity;
+    if (Scaler)
+        delete Scaler;
+    if (Admitted)
+        CapacityModel::Instance().Release(this);
+    Metrics::Remove(SessionLabel);
     if(InFmtCtx)
         avformat_close_input(&InFmtCtx);
+    if (StreamCopies)
+        avformat_free_context(StreamCopies);
+    if (UdpIn)
+        delete UdpIn;
+    if (FileIn)
+        delete FileIn;
     if (OutFmtCtx)
     {
         if (OutHeadWrited)
             av_write_trailer(OutFmtCtx);
         avformat_close_input(&OutFmtCtx);
     }
+    if (UdpOut)
+        delete UdpOut;
     if (VideoDecoderCtx)
         avcodec_free_context(&VideoDecoderCtx);
     if (VideoEncoderCtx)
@@ -112,6 +216,11 @@ QSVTranscode::~QSVTranscode()
         av_buffer_unref(&QSV_hw_device_ctx);
     if (filter_graph)
         avfilter_graph_free(&filter_graph);
+    if (CanvasFrame)
+        av_frame_free(&CanvasFrame);
+    if (LogoFrame)
+        av_frame_free(&LogoFrame);
+    av_buffer_unref(&LogoFramesCtx);
     if (QSV_hw_device_ctx)
         av_buffer_unref(&QSV_hw_device_ctx);
     if (PktBuffer)
@@ -124,17 +233,50 @@ QSVTranscode::~QSVTranscode()
     free(InputUrl);
 }
 
-bool QSVTranscode::OpenInput()
+bool QSVTranscode::SelectStreams(AVFormatContext* ctx, OutputInfo* outset, AVStream** video, AVStream** audio)
 {
-    int ret;
-    AVCodec *decoder = NULL;
-
-    ret = av_hwdevice_ctx_create(&QSV_hw_device_ctx, AV_HWDEVICE_TYPE_QSV, "auto", NULL, 0);
-    if (ret < 0)
+    AVProgram* program = nullptr;
+    *video = nullptr;
+    *audio = nullptr;
+    if (outset->Program >= 0)
     {
-        printf("Failed to create a qsv device. Error code: %d\n", ret);
-        return -1;
+        for (unsigned int i = 0; i < ctx->nb_programs; i ++)
+        {
+            if (ctx->programs[i]->id == outset->Program)
+                program = ctx->programs[i];
+        }
+        if (!program)
+        {
+            printf("Cannot find program %d in the input\n", outset->Program);
+            return false;
+        }
     }
+    unsigned int count = program ? program->nb_stream_indexes : ctx->nb_streams;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        AVStream* stream = ctx->streams[program ? program->stream_index[i] : i];
+        if (((stream->codecpar->codec_id == AV_CODEC_ID_H264)
+            || (stream->codecpar->codec_id == AV_CODEC_ID_HEVC)
+            || (stream->codecpar->codec_id == AV_CODEC_ID_VP8)
+            || (stream->codecpar->codec_id == AV_CODEC_ID_VP9)
+            || (stream->codecpar->codec_id == AV_CODEC_ID_MPEG2VIDEO))
+            && ((outset->VideoPid <= 0) || (stream->id == outset->VideoPid)))
+        {
+            *video = stream;
+        }
+        if ((stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            && ((outset->AudioPid <= 0) || (stream->id == outset->AudioPid)))
+        {
+            *audio = stream;
+        }
+    }
+    return *video != nullptr;
+}
+
+bool QSVTranscode::OpenSource()
+{
+    int ret;
+
     InFmtCtx = avformat_alloc_context();
     if(!InFmtCtx)
     {
@@ -142,10 +284,41 @@ bool QSVTranscode::OpenInput()
         InFmtCtx = nullptr;
         return -2;
     }
+    InFmtCtx->interrupt_callback.callback = InterruptProc;
+    InFmtCtx->interrupt_callback.opaque = this;
+    AVInputFormat* informat = NULL;
+    if (OutputSet->UdpBatchInput && !strncmp(InputUrl, "udp://", 6))
+    {
+        UdpIn = new UdpInput(InputUrl, OutputSet->UdpJitterMs, SessionLabel);
+        if (!UdpIn->Open(&InFmtCtx->interrupt_callback))
+        {
+            printf("Cannot open udp input '%s'\n", InputUrl);
+            return false;
+        }
+        InFmtCtx->pb = UdpIn->Context();
+        Memory.Set(MEM_UDP_INPUT, UdpIn->MemoryBytes(), 1);
+        InFmtCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        informat = av_find_input_format("mpegts");
+    }
+    else if (OutputSet->MmapFileInput && MmapInput::Supported(InputUrl))
+    {
+        FileIn = new MmapInput(InputUrl, SessionLabel);
+        if (FileIn->Open())
+        {
+            InFmtCtx->pb = FileIn->Context();
+            InFmtCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        }
+        else
+        {
+            printf("Cannot map '%s', reading it through the file protocol\n", InputUrl);
+            delete FileIn;
+            FileIn = nullptr;
+        }
+    }
     AVDictionary *dco = NULL;
     av_dict_set(&dco, "rtsp_transport", "tcp", 0);
     av_dict_set(&dco, "stimeout", "3000000", 0);
-    if ((ret = avformat_open_input(&InFmtCtx, InputUrl, NULL,  &dco)) < 0)
+    if ((ret = avformat_open_input(&InFmtCtx, InputUrl, informat,  &dco)) < 0)
     {
 	av_dict_free(&dco);
         printf("Cannot open input file '%s', Error code: %d\n",InputUrl, ret);
@@ -159,33 +332,107 @@ bool QSVTranscode::OpenInput()
     if ((ret = avformat_find_stream_info(InFmtCtx, NULL)) < 0)
     {
         printf("Cannot find input stream information. Error code: %d\n", ret);
-        return ret;
+        return false;
     }
 
+    SelectStreams(InFmtCtx, OutputSet, &InVideoStream, &InAudioStream);
+    //nothing but the selected streams is parsed or returned by av_read_frame
     for (unsigned int i = 0; i < InFmtCtx->nb_streams; i ++)
     {
-        if ((InFmtCtx->streams[i]->codecpar->codec_id == AV_CODEC_ID_H264)
-            || (InFmtCtx->streams[i]->codecpar->codec_id == AV_CODEC_ID_HEVC)
-            || (InFmtCtx->streams[i]->codecpar->codec_id == AV_CODEC_ID_VP8)
-            || (InFmtCtx->streams[i]->codecpar->codec_id == AV_CODEC_ID_VP9)
-            || (InFmtCtx->streams[i]->codecpar->codec_id == AV_CODEC_ID_MPEG2VIDEO))
-        {
-            InVideoStream = InFmtCtx->streams[i];
-        }
-        if (InFmtCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-        {
-            InAudioStream = InFmtCtx->streams[i];
-        }
+        if ((InFmtCtx->streams[i] != InVideoStream) && (InFmtCtx->streams[i] != InAudioStream))
+            InFmtCtx->streams[i]->discard = AVDISCARD_ALL;
     }
+    return true;
+}
+
+bool QSVTranscode::AdmitSession(int width, int height, double fps)
+{
+    int admission = CapacityModel::Instance().Admit(this, width, height, fps, OutputSet);
+    if (admission == ADMISSION_QUEUE)
+    {
+        if (QueuedFps <= 0)
+            printf("No capacity for '%s' now, session queued\n", InputUrl);
+        QueuedWidth = width;
+        QueuedHeight = height;
+        QueuedFps = fps;
+        return false;
+    }
+    if (admission == ADMISSION_REJECT)
+    {
+        printf("No capacity for '%s', session rejected\n", InputUrl);
+        Runing = false;
+        return false;
+    }
+    if (admission == ADMISSION_CPU)
+    {
+        //OutputSet is shared by batch and MPTS sessions, the route only applies to this one
+        printf("No hardware capacity for '%s', session routed to the CPU backend\n", InputUrl);
+        Backend = BACKEND_CPU;
+    }
+    QueuedFps = 0;
+    Admitted = true;
+    return true;
+}
+
+bool QSVTranscode::OpenInput()
+{
+    int ret;
+    AVCodec *decoder = NULL;
+
+    //a queued session keeps its input closed until there is capacity for it
+    if (!Admitted && (QueuedFps > 0) && !AdmitSession(QueuedWidth, QueuedHeight, QueuedFps))
+        return false;
+    //in MPTS mode the streams are copied, the demuxer may close its input right after
+    if (Demux && !StreamCopies && !(StreamCopies = avformat_alloc_context()))
+        return false;
+    if (Demux ? !Demux->GetStreams(this, StreamCopies, &InVideoStream, &InAudioStream, &InputGeneration) : !OpenSource())
+        return false;
 
     if (!InVideoStream )
     {
         printf("Cannot find a video stream in the input file. \n");
         return false;
     }
+    if (VideoDecoderCtx && !Batch.empty())
+    {
+        AVCodecParameters* par = InVideoStream->codecpar;
+        if ((par->codec_id != BatchParams.CodecId) || (par->width != BatchParams.Width)
+            || (par->height != BatchParams.Height) || (par->format != BatchParams.Format)
+            || av_cmp_q(InVideoStream->time_base, BatchParams.TimeBase)
+            || av_cmp_q(InVideoStream->avg_frame_rate, BatchParams.FrameRate))
+        {
+            printf("Batch input '%s' differs from the previous item, rebuilding the video pipeline\n", InputUrl);
+            ResetVideoPipeline();
+        }
+    }
+    if (OutputSet->CheckpointPath && !Demux && !CheckpointLoaded)
+    {
+        LoadCheckpoint();
+        if (!Runing)
+            return false;
+    }
+    if (!Admitted)
+    {
+        double fps = av_q2d(InVideoStream->avg_frame_rate);
+        if (!AdmitSession(InVideoStream->codecpar->width, InVideoStream->codecpar->height, (fps > 0) ? fps : 25))
+            return false;
+    }
+    if ((Backend == BACKEND_QSV) && !QSV_hw_device_ctx)
+    {
+        ret = av_hwdevice_ctx_create(&QSV_hw_device_ctx, AV_HWDEVICE_TYPE_QSV, "auto", NULL, 0);
+        if (ret < 0)
+        {
+            printf("Failed to create a qsv device. Error code: %d\n", ret);
+            return false;
+        }
+    }
     if (!VideoDecoderCtx)
     {
-        switch (InVideoStream->codecpar->codec_id)
+        if (Backend == BACKEND_CPU)
+        {
+            decoder = avcodec_find_decoder(InVideoStream->codecpar->codec_id);
+        }
+        else switch (InVideoStream->codecpar->codec_id)
         {
             case AV_CODEC_ID_H264:
                 decoder = avcodec_find_decoder_by_name("h264_qsv");
@@ -206,12 +453,12 @@ bool QSVTranscode::OpenInput()
                 break;
         }
         if (!decoder) {
-            printf("The QSV decoder is not present in libavcodec\n");
-            return -1;
+            printf("The video decoder is not present in libavcodec\n");
+            return false;
         }
 
         if (!(VideoDecoderCtx = avcodec_alloc_context3(decoder)))
-            return AVERROR(ENOMEM);
+            return false;
 
         if ((ret = avcodec_parameters_to_context(VideoDecoderCtx, InVideoStream->codecpar)) < 0)
         {
@@ -219,16 +466,29 @@ bool QSVTranscode::OpenInput()
             return false;
         }
 
-        VideoDecoderCtx->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
-        if (!VideoDecoderCtx->hw_device_ctx)
+        if (Backend == BACKEND_QSV)
         {
-            printf("A hardware device reference create failed.\n");
-            return false;
+            VideoDecoderCtx->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
+            if (!VideoDecoderCtx->hw_device_ctx)
+            {
+                printf("A hardware device reference create failed.\n");
+                return false;
+            }
+            VideoDecoderCtx->get_format    = get_qsv_format;
         }
-        VideoDecoderCtx->opaque = this;
-        VideoDecoderCtx->get_format    = get_qsv_format;
-
-        if ((ret = avcodec_open2(VideoDecoderCtx, decoder, NULL)) < 0)
+        else
+        {
+            VideoDecoderCtx->thread_count = 0;
+        }
+        Surfaces.Attach(VideoDecoderCtx);
+
+        //decoder workers inherit the affinity of the thread that opens the codec
+        cpu_set_t previous;
+        bool pinned = ThreadPlacement::Apply(OutputSet, NumaNode, ROLE_COMPUTE, SessionLabel, nullptr, &previous);
+        ret = avcodec_open2(VideoDecoderCtx, decoder, NULL);
+        if (pinned)
+            ThreadPlacement::Restore(&previous);
+        if (ret < 0)
         {
             printf("Failed to open codec for decoding. Error code: %d\n", ret);
             return false;
@@ -240,9 +500,12 @@ bool QSVTranscode::OpenInput()
 bool QSVTranscode::OpenOutput()
 {
     int ret;
-    if (!(VideoEncCodec = avcodec_find_encoder_by_name(OutputSet->VideoEncoderName)))
+    const char* encodername = OutputSet->VideoEncoderName;
+    if ((Backend == BACKEND_CPU) && OutputSet->CpuEncoderName)
+        encodername = OutputSet->CpuEncoderName;
+    if (!(VideoEncCodec = avcodec_find_encoder_by_name(encodername)))
     {
-        printf("Could not find encoder '%s'\n", OutputSet->VideoEncoderName);
+        printf("Could not find encoder '%s'\n", encodername);
         return false;
     }
 
@@ -368,16 +631,15 @@ bool QSVTranscode::OpenOutput()
         {
             if (AudioSet)
             {
-                PcmBuffer = av_audio_fifo_alloc(AudioSet->SampleFmt
-                                                , av_get_channel_layout_nb_channels(AudioSet->ChannelLayOut)
-                                                , 1);
+                PcmFormat = AudioSet->SampleFmt;
+                PcmChannels = av_get_channel_layout_nb_channels(AudioSet->ChannelLayOut);
             }
             else
             {
-                PcmBuffer = av_audio_fifo_alloc(AudioDecoderCtx->sample_fmt
-                                                , AudioDecoderCtx->channels
-                                                , 1);
+                PcmFormat = AudioDecoderCtx->sample_fmt;
+                PcmChannels = AudioDecoderCtx->channels;
             }
+            PcmBuffer = av_audio_fifo_alloc(PcmFormat, PcmChannels, 1);
         }
     }
     else
@@ -387,12 +649,337 @@ bool QSVTranscode::OpenOutput()
     return true;
 }
 
+bool QSVTranscode::BuildFilterDescr(char* descr, int size)
+{
+    int srcw = VideoDecoderCtx->width;
+    int srch = VideoDecoderCtx->height;
+    int dstw = OutputSet->VideoWidth;
+    int dsth = OutputSet->VideoHeight;
+    bool crop = (OutputSet->CropWidth > 0) && (OutputSet->CropHeight > 0);
+    bool needcanvas = false;
+    int len = 0;
+
+    if (crop)
+    {
+        srcw = OutputSet->CropWidth;
+        srch = OutputSet->CropHeight;
+    }
+    if (OutputSet->PadToFit)
+    {
+        if ((int64_t)srcw * OutputSet->VideoHeight > (int64_t)srch * OutputSet->VideoWidth)
+            dsth = (int)av_rescale(srch, OutputSet->VideoWidth, srcw) & ~1;
+        else
+            dstw = (int)av_rescale(srcw, OutputSet->VideoHeight, srch) & ~1;
+    }
+
+    if (Backend == BACKEND_QSV)
+    {
+        //one vpp pass does deinterlace, crop and scale, padding is a composite onto a cached black surface
+        if (OutputSet->Deinterlace || crop)
+        {
+            len += snprintf(descr + len, size - len, "[in]vpp_qsv=w=%d:h=%d", dstw, dsth);
+            if (OutputSet->Deinterlace)
+                len += snprintf(descr + len, size - len, ":deinterlace=2");
+            if (crop)
+                len += snprintf(descr + len, size - len, ":cx=%d:cy=%d:cw=%d:ch=%d"
+                                , OutputSet->CropX, OutputSet->CropY, OutputSet->CropWidth, OutputSet->CropHeight);
+        }
+        else
+        {
+            len += snprintf(descr + len, size - len, "[in]scale_qsv=w=%d:h=%d:mode=hq", dstw, dsth);
+        }
+        if ((dstw != OutputSet->VideoWidth) || (dsth != OutputSet->VideoHeight))
+        {
+            needcanvas = true;
+            len += snprintf(descr + len, size - len, "[v];[canvas][v]overlay_qsv=x=%d:y=%d"
+                            , (OutputSet->VideoWidth - dstw) / 2, (OutputSet->VideoHeight - dsth) / 2);
+        }
+        if (LogoFrame)
+        {
+            len += snprintf(descr + len, size - len, "[main];[main][logo]overlay_qsv=x=%d:y=%d:alpha=%d"
+                            , OutputSet->LogoX, OutputSet->LogoY, OutputSet->LogoOpacity);
+        }
+        snprintf(descr + len, size - len, "[out]");
+    }
+    else
+    {
+        AVPixelFormat swfmt = AV_PIX_FMT_YUV420P;
+        if (VideoEncCodec && VideoEncCodec->pix_fmts)
+        {
+            for (const AVPixelFormat* fmt = VideoEncCodec->pix_fmts; *fmt != AV_PIX_FMT_NONE; fmt++)
+            {
+                if (!(av_pix_fmt_desc_get(*fmt)->flags & AV_PIX_FMT_FLAG_HWACCEL))
+                {
+                    swfmt = *fmt;
+                    break;
+                }
+            }
+        }
+        //crop and the common downscale ratios run in the slice scaler ahead of the graph, deinterlacing has to come first
+        int cropx = crop ? OutputSet->CropX : 0;
+        int cropy = crop ? OutputSet->CropY : 0;
+        if (!OutputSet->Deinterlace && SliceScaler::Supported(VideoDecoderCtx->pix_fmt, srcw, srch, dstw, dsth, cropx, cropy))
+        {
+            if (!Scaler)
+            {
+                //unplaced sessions all run on every cpu, they split it instead of oversubscribing it
+                Scaler = new SliceScaler(OutputSet->ScaleThreads, OutputSet->Placement == PLACEMENT_NONE);
+            }
+            if (!Scaler->Configure(VideoDecoderCtx->pix_fmt, srcw, srch, dstw, dsth, cropx, cropy))
+            {
+                delete Scaler;
+                Scaler = nullptr;
+            }
+        }
+        else if (Scaler)
+        {
+            delete Scaler;
+            Scaler = nullptr;
+        }
+        len += snprintf(descr + len, size - len, "[in]");
+        if (Scaler)
+        {
+            len += snprintf(descr + len, size - len, "null");
+        }
+        else
+        {
+            if (OutputSet->Deinterlace)
+                len += snprintf(descr + len, size - len, "yadif=mode=send_frame:deint=interlaced,");
+            if (crop)
+                len += snprintf(descr + len, size - len, "crop=w=%d:h=%d:x=%d:y=%d,"
+                                , OutputSet->CropWidth, OutputSet->CropHeight, OutputSet->CropX, OutputSet->CropY);
+            len += snprintf(descr + len, size - len, "scale=w=%d:h=%d", dstw, dsth);
+        }
+        if ((dstw != OutputSet->VideoWidth) || (dsth != OutputSet->VideoHeight))
+            len += snprintf(descr + len, size - len, ",pad=w=%d:h=%d:x=(ow-iw)/2:y=(oh-ih)/2"
+                            , OutputSet->VideoWidth, OutputSet->VideoHeight);
+        if (LogoFrame)
+            len += snprintf(descr + len, size - len, "[main];[main][logo]overlay=x=%d:y=%d:format=yuv420"
+                            , OutputSet->LogoX, OutputSet->LogoY);
+        snprintf(descr + len, size - len, ",format=pix_fmts=%s[out]", av_get_pix_fmt_name(swfmt));
+    }
+    return needcanvas;
+}
+
+//cache, when given, keeps the frames context so later uploads of the same size come from its pool
+AVFrame* upload_surface(AVBufferRef* device, AVBufferRef** cache, AVFrame* swframe)
+{
+    AVHWFramesContext  *frames_ctx;
+    AVQSVFramesContext *frames_hwctx;
+    AVBufferRef* frames_ref = nullptr;
+    AVFrame* hwframe = nullptr;
+
+    if (cache && *cache)
+    {
+        frames_ref = av_buffer_ref(*cache);
+        if (!frames_ref)
+            return nullptr;
+        goto upload;
+    }
+    frames_ref = av_hwframe_ctx_alloc(device);
+    if (!frames_ref)
+        return nullptr;
+    frames_ctx   = (AVHWFramesContext*)frames_ref->data;
+    frames_hwctx = (AVQSVFramesContext*)frames_ctx->hwctx;
+    frames_ctx->format            = AV_PIX_FMT_QSV;
+    frames_ctx->sw_format         = (AVPixelFormat)swframe->format;
+    frames_ctx->width             = FFALIGN(swframe->width,  32);
+    frames_ctx->height            = FFALIGN(swframe->height, 32);
+    //a swapped image is uploaded while the filter graph still holds the previous one
+    frames_ctx->initial_pool_size = cache ? LOGO_POOL_SURFACES : 1;
+    frames_hwctx->frame_type = MFX_MEMTYPE_VIDEO_MEMORY_PROCESSOR_TARGET;
+    if (av_hwframe_ctx_init(frames_ref) < 0)
+        goto end;
+    if (cache && !(*cache = av_buffer_ref(frames_ref)))
+        goto end;
+
+upload:
+    hwframe = av_frame_alloc();
+    if (!hwframe)
+        goto end;
+    if ((av_hwframe_get_buffer(frames_ref, hwframe, 0) < 0)
+        || (av_hwframe_transfer_data(hwframe, swframe, 0) < 0))
+    {
+        av_frame_free(&hwframe);
+        goto end;
+    }
+    hwframe->width  = swframe->width;
+    hwframe->height = swframe->height;
+end:
+    av_buffer_unref(&frames_ref);
+    return hwframe;
+}
+
+static AVFrame* decode_image(const char* path)
+{
+    AVFormatContext* fmtctx = nullptr;
+    AVCodecContext* decctx = nullptr;
+    AVCodec* decoder = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket pkt;
+    int stream;
+
+    if (avformat_open_input(&fmtctx, path, NULL, NULL) < 0)
+        return nullptr;
+    if ((avformat_find_stream_info(fmtctx, NULL) < 0)
+        || ((stream = av_find_best_stream(fmtctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0)) < 0))
+        goto end;
+    if (!(decctx = avcodec_alloc_context3(decoder))
+        || (avcodec_parameters_to_context(decctx, fmtctx->streams[stream]->codecpar) < 0)
+        || (avcodec_open2(decctx, decoder, NULL) < 0))
+        goto end;
+
+    frame = av_frame_alloc();
+    if (!frame)
+        goto end;
+    av_init_packet(&pkt);
+    while (av_read_frame(fmtctx, &pkt) >= 0)
+    {
+        if (pkt.stream_index == stream)
+            avcodec_send_packet(decctx, &pkt);
+        av_packet_unref(&pkt);
+        if (avcodec_receive_frame(decctx, frame) == 0)
+            goto end;
+    }
+    avcodec_send_packet(decctx, NULL);
+    if (avcodec_receive_frame(decctx, frame) < 0)
+        av_frame_free(&frame);
+end:
+    if (decctx)
+        avcodec_free_context(&decctx);
+    avformat_close_input(&fmtctx);
+    return frame;
+}
+
+AVFrame* QSVTranscode::LoadLogo(const char* path, int width, int height)
+{
+    AVPixelFormat fmt = (Backend == BACKEND_QSV) ? AV_PIX_FMT_BGRA : AV_PIX_FMT_YUVA420P;
+    struct SwsContext* sws = nullptr;
+    AVFrame* logo = nullptr;
+    AVFrame* image = decode_image(path);
+    if (!image)
+    {
+        printf("Cannot load logo image '%s'\n", path);
+        return nullptr;
+    }
+    if (width <= 0)
+        width = image->width;
+    if (height <= 0)
+        height = image->height;
+
+    logo = av_frame_alloc();
+    if (!logo)
+        goto end;
+    logo->format = fmt;
+    logo->width  = width;
+    logo->height = height;
+    if (av_frame_get_buffer(logo, 32) < 0)
+    {
+        av_frame_free(&logo);
+        goto end;
+    }
+    sws = sws_getContext(image->width, image->height, (AVPixelFormat)image->format
+                         , width, height, fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws)
+    {
+        av_frame_free(&logo);
+        goto end;
+    }
+    sws_scale(sws, image->data, image->linesize, 0, image->height, logo->data, logo->linesize);
+    sws_freeContext(sws);
+
+    if (Backend == BACKEND_QSV)
+    {
+        AVFrame* hwlogo = upload_surface(QSV_hw_device_ctx, &LogoFramesCtx, logo);
+        av_frame_free(&logo);
+        logo = hwlogo;
+    }
+    else if (OutputSet->LogoOpacity < 255)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            uint8_t* alpha = logo->data[3] + y * logo->linesize[3];
+            for (int x = 0; x < width; x++)
+                alpha[x] = alpha[x] * OutputSet->LogoOpacity / 255;
+        }
+    }
+end:
+    av_frame_free(&image);
+    return logo;
+}
+
+bool QSVTranscode::SetLogo(const char* path)
+{
+    int width, height;
+    {
+        boost::mutex::scoped_lock lock(LogoLock);
+        if (!logosrc_ctx || !LogoFrame)
+        {
+            printf("Logo overlay is not enabled for this output\n");
+            return false;
+        }
+        width = LogoFrame->width;
+        height = LogoFrame->height;
+    }
+    //decoded outside the lock, the new surface comes from the pool the logo source was configured with
+    AVFrame* logo = LoadLogo(path, width, height);
+    if (!logo)
+        return false;
+    boost::mutex::scoped_lock lock(LogoLock);
+    av_frame_free(&LogoFrame);
+    LogoFrame = logo;
+    return true;
+}
+
+int QSVTranscode::CreateFrameSource(AVFilterContext** src_ctx, const char* name, AVFrame* frame, AVFilterInOut** outputs)
+{
+    char args[512];
+    int ret;
+    AVFilterInOut* inout;
+    AVRational time_base = InVideoStream->time_base;
+
+    snprintf(args, sizeof(args),
+            "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=1/1",
+            frame->width, frame->height, frame->format,
+            time_base.num, time_base.den);
+    ret = avfilter_graph_create_filter(src_ctx, avfilter_get_by_name("buffer"), name, args, NULL, filter_graph);
+    if (ret < 0)
+        return ret;
+    if (frame->hw_frames_ctx)
+    {
+        AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+        if (!par)
+            return AVERROR(ENOMEM);
+        par->hw_frames_ctx = frame->hw_frames_ctx;
+        ret = av_buffersrc_parameters_set(*src_ctx, par);
+        av_freep(&par);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (!(inout = avfilter_inout_alloc()))
+        return AVERROR(ENOMEM);
+    inout->name       = av_strdup(name);
+    inout->filter_ctx = *src_ctx;
+    inout->pad_idx    = 0;
+    inout->next       = *outputs;
+    *outputs          = inout;
+    return 0;
+}
+
+int QSVTranscode::FeedFrameSource(AVFilterContext* src_ctx, AVFrame* frame, int64_t pts)
+{
+    frame->pts = pts;
+    frame->best_effort_timestamp = pts;
+    return av_buffersrc_add_frame_flags(src_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+}
+
 void QSVTranscode::init_filters()
 {
-    char filter_descr[100] = {0};
-    sprintf(filter_descr,"scale_qsv=w=%d:h=%d:mode=hq", OutputSet->VideoWidth, OutputSet->VideoHeight);
+    char filter_descr[1024] = {0};
     char args[512];
     int ret = 0;
+    bool needcanvas = false;
     const AVFilter *buffersrc  = avfilter_get_by_name("buffer");
     const AVFilter *buffersink = avfilter_get_by_name("buffersink");
     AVFilterInOut *outputs = avfilter_inout_alloc();
@@ -407,9 +994,19 @@ void QSVTranscode::init_filters()
         goto end;
     }
 
+    if (OutputSet->LogoPath && !LogoFrame)
+    {
+        //decoded, scaled and uploaded once, every frame only adds a reference
+        AVFrame* logo = LoadLogo(OutputSet->LogoPath, OutputSet->LogoWidth, OutputSet->LogoHeight);
+        boost::mutex::scoped_lock lock(LogoLock);
+        LogoFrame = logo;
+    }
+    needcanvas = BuildFilterDescr(filter_descr, sizeof(filter_descr));
+    av_log(NULL, AV_LOG_DEBUG, "Video filter: %s\n", filter_descr);
+
     snprintf(args, sizeof(args),
             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-            VideoDecoderCtx->width, VideoDecoderCtx->height, VideoDecoderCtx->pix_fmt,
+            Scaler ? Scaler->Width() : VideoDecoderCtx->width, Scaler ? Scaler->Height() : VideoDecoderCtx->height, VideoDecoderCtx->pix_fmt,
             time_base.num, time_base.den,
             VideoDecoderCtx->sample_aspect_ratio.num, VideoDecoderCtx->sample_aspect_ratio.den);
 
@@ -419,11 +1016,13 @@ void QSVTranscode::init_filters()
         fprintf(stderr, "Cannot create buffer source\n");
         goto end;
     }
-    par->hw_frames_ctx = av_buffer_ref(VideoDecoderCtx->hw_frames_ctx);
-    ret = av_buffersrc_parameters_set(buffersrc_ctx, par);
-    if (ret < 0)
-        goto end;
-    av_freep(&par);
+    if (VideoDecoderCtx->hw_frames_ctx)
+    {
+        par->hw_frames_ctx = VideoDecoderCtx->hw_frames_ctx;
+        ret = av_buffersrc_parameters_set(buffersrc_ctx, par);
+        if (ret < 0)
+            goto end;
+    }
 
     ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph);
     if (ret < 0) {
@@ -436,6 +1035,38 @@ void QSVTranscode::init_filters()
     outputs->pad_idx    = 0;
     outputs->next       = NULL;
 
+    if (needcanvas)
+    {
+        AVFrame* black = av_frame_alloc();
+        if (black && !CanvasFrame)
+        {
+            black->format = AV_PIX_FMT_NV12;
+            black->width  = OutputSet->VideoWidth;
+            black->height = OutputSet->VideoHeight;
+            if (av_frame_get_buffer(black, 32) >= 0)
+            {
+                memset(black->data[0], 16, black->linesize[0] * black->height);
+                memset(black->data[1], 128, black->linesize[1] * black->height / 2);
+                CanvasFrame = upload_surface(QSV_hw_device_ctx, nullptr, black);
+            }
+        }
+        av_frame_free(&black);
+        if (!CanvasFrame)
+        {
+            fprintf(stderr, "Cannot create pad canvas\n");
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if ((ret = CreateFrameSource(&canvassrc_ctx, "canvas", CanvasFrame, &outputs)) < 0)
+            goto end;
+    }
+    if (LogoFrame)
+    {
+        boost::mutex::scoped_lock lock(LogoLock);
+        if ((ret = CreateFrameSource(&logosrc_ctx, "logo", LogoFrame, &outputs)) < 0)
+            goto end;
+    }
+
     inputs->name       = av_strdup("out");
     inputs->filter_ctx = buffersink_ctx;
     inputs->pad_idx    = 0;
@@ -444,13 +1075,16 @@ void QSVTranscode::init_filters()
     if ((ret = avfilter_graph_parse_ptr(filter_graph, filter_descr, &inputs, &outputs, NULL)) < 0)
         goto end;
 
-    for (unsigned int i = 0; i < filter_graph->nb_filters; i++)
+    if (Backend == BACKEND_QSV)
     {
-        filter_graph->filters[i]->hw_device_ctx = av_buffer_ref(VideoDecoderCtx->hw_device_ctx);
-        if (!filter_graph->filters[i]->hw_device_ctx)
+        for (unsigned int i = 0; i < filter_graph->nb_filters; i++)
         {
-            ret = AVERROR(ENOMEM);
-            goto end;
+            filter_graph->filters[i]->hw_device_ctx = av_buffer_ref(QSV_hw_device_ctx);
+            if (!filter_graph->filters[i]->hw_device_ctx)
+            {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
         }
     }
 
@@ -460,6 +1094,7 @@ void QSVTranscode::init_filters()
 end:
     avfilter_inout_free(&inputs);
     avfilter_inout_free(&outputs);
+    av_freep(&par);
 
     VFilterInited = (ret == 0);
     return;
@@ -527,7 +1162,33 @@ void QSVTranscode::WriteOutHead()
         return;
     }
 
-    if (!(OutFmtCtx->flags & AVFMT_NOFILE))
+    CheckpointOn = OutputSet->CheckpointPath && !strcmp(OutFmtCtx->oformat->name, "mpegts") && !strstr(OutputSet->OutputUrl, "://");
+    if (OutputSet->CheckpointPath && !CheckpointOn)
+        printf("Checkpoints need a mpegts file output, '%s' is not checkpointed\n", OutputSet->OutputUrl);
+    if (OutputSet->UdpPacedOutput && !strncmp(OutputSet->OutputUrl, "udp://", 6))
+    {
+        UdpOut = new UdpOutput(OutputSet->OutputUrl, OutputSet->UdpMuxRate, SessionLabel);
+        if (!UdpOut->Open())
+        {
+            printf("Could not open udp output '%s'\n", OutputSet->OutputUrl);
+            CloseOutput();
+            return;
+        }
+        OutFmtCtx->pb = UdpOut->Context();
+        Memory.Set(MEM_UDP_OUTPUT, UdpOut->MemoryBytes(), 1);
+        OutFmtCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    else if (CheckpointOn && (ResumeOffset >= 0))
+    {
+        //the file already starts with a header, this one goes to a buffer that is thrown away
+        ret = avio_open_dyn_buf(&OutFmtCtx->pb);
+        if (ret < 0)
+        {
+            CloseOutput();
+            return;
+        }
+    }
+    else if (!(OutFmtCtx->flags & AVFMT_NOFILE))
     {
         ret = avio_open(&OutFmtCtx->pb, OutputSet->OutputUrl, AVIO_FLAG_WRITE);
         if (ret < 0)
@@ -548,6 +1209,8 @@ void QSVTranscode::WriteOutHead()
     AVDictionary* opt = nullptr;
     //av_dict_set(&opt, "stimeout", "1000000", 0);
     av_dict_set(&opt, "flvflags", "no_duration_filesize+add_keyframe_index", 0);
+    if (OutputSet->UdpMuxRate > 0)
+        av_dict_set_int(&opt, "muxrate", OutputSet->UdpMuxRate, 0);
     if ((ret = avformat_write_header(OutFmtCtx, &opt)) < 0)
     {
         printf("Error while writing stream header. Error code: %d\n", ret);
@@ -556,11 +1219,42 @@ void QSVTranscode::WriteOutHead()
         return;
     }
     av_dict_free(&opt);
+    if (CheckpointOn && (ResumeOffset >= 0))
+    {
+        uint8_t* header = nullptr;
+        AVDictionary* fileopt = nullptr;
+        avio_close_dyn_buf(OutFmtCtx->pb, &header);
+        av_free(header);
+        OutFmtCtx->pb = nullptr;
+        //keep what the checkpoint covers and continue right behind it
+        av_dict_set(&fileopt, "truncate", "0", 0);
+        ret = truncate(OutputSet->OutputUrl, ResumeOffset);
+        if (ret == 0)
+            ret = avio_open2(&OutFmtCtx->pb, OutputSet->OutputUrl, AVIO_FLAG_WRITE, NULL, &fileopt);
+        av_dict_free(&fileopt);
+        if ((ret < 0) || (avio_seek(OutFmtCtx->pb, ResumeOffset, SEEK_SET) < 0))
+        {
+            printf("Cannot resume output '%s'\n", OutputSet->OutputUrl);
+            CloseOutput();
+            return;
+        }
+        ResumeOffset = -1;
+    }
     OutHeadWrited = true;
+    RequestKeyFrame();
+    if (Edge)
+        Edge->Open(OutVideoStream, OutAudioStream);
+    if (Timeshift && !Timeshift->Open(OutVideoStream, OutAudioStream))
+        printf("Cannot open timeshift ring '%s'\n", OutputSet->TimeshiftPath);
 }
 
 void QSVTranscode::CloseOutput()
 {
+    if (Edge)
+        Edge->Close();
+    //the last GOP goes to the ring now instead of when the output is opened again
+    if (Timeshift)
+        Timeshift->Close();
     if (OutFmtCtx)
     {
         AVFormatContext* CloseFmtCtx =  OutFmtCtx;
@@ -569,12 +1263,24 @@ void QSVTranscode::CloseOutput()
             av_write_trailer(CloseFmtCtx);
         avformat_close_input(&CloseFmtCtx);
     }
+    if (UdpOut)
+    {
+        delete UdpOut;
+        UdpOut = nullptr;
+        Memory.Set(MEM_UDP_OUTPUT, 0, 0);
+    }
     OutAudioStream = nullptr;
     OutVideoStream = nullptr;
     OutputOpend = false;
     OutHeadWrited = false;
 }
 
+int QSVTranscode::InterruptProc(void* opaque)
+{
+    QSVTranscode* obj = (QSVTranscode*)opaque;
+    return !obj->Runing;
+}
+
 void QSVTranscode::CloseInPut()
 {
     InputOpend = false;
@@ -584,12 +1290,30 @@ void QSVTranscode::CloseInPut()
         InFmtCtx = nullptr;
         avformat_close_input(&CloseFmtCtx);
     }
+    if (UdpIn)
+    {
+        delete UdpIn;
+        UdpIn = nullptr;
+        Memory.Set(MEM_UDP_INPUT, 0, 0);
+    }
+    if (FileIn)
+    {
+        delete FileIn;
+        FileIn = nullptr;
+    }
     InAudioStream = nullptr;
     InVideoStream = nullptr;
+    if (StreamCopies)
+    {
+        avformat_free_context(StreamCopies);
+        StreamCopies = nullptr;
+    }
     if (VideoDecoderCtx)
     {
         avcodec_free_context(&VideoDecoderCtx);
         VideoDecoderCtx = nullptr;
+        Memory.Set(MEM_DECODER_SURFACES, 0, 0);
+        DecoderFramesData = nullptr;
     }
     if (AudioDecoderCtx)
     {
@@ -601,7 +1325,7 @@ void QSVTranscode::CloseInPut()
 void QSVTranscode::openencoder()
 {
     int ret;
-    AVFilterContext* filter_ctxn = filter_graph->filters[2];
+    AVBufferRef* sink_frames_ctx = av_buffersink_get_hw_frames_ctx(buffersink_ctx);
     if (!VideoEncoderCtx)
     {
         if (!(VideoEncoderCtx = avcodec_alloc_context3(VideoEncCodec)))
@@ -609,28 +1333,34 @@ void QSVTranscode::openencoder()
             printf( "Cannot open alloc encoder\n");
             return ;
         }
-        VideoEncoderCtx->hw_frames_ctx = av_buffer_ref(filter_ctxn->outputs[0]->hw_frames_ctx);
-        if (!VideoEncoderCtx->hw_frames_ctx)
+        if (sink_frames_ctx)
         {
-            printf( "Failed to create a qsv device\n");
-            return;
+            VideoEncoderCtx->hw_frames_ctx = av_buffer_ref(sink_frames_ctx);
+            if (!VideoEncoderCtx->hw_frames_ctx)
+            {
+                printf( "Failed to create a qsv device\n");
+                return;
+            }
         }
 
         int VFrameRate = InVideoStream->avg_frame_rate.num / InVideoStream->avg_frame_rate.den;
         VideoEncoderCtx->time_base = av_make_q(1, VFrameRate);
-        VideoEncoderCtx->pix_fmt   = VideoDecoderCtx->pix_fmt;
-        VideoEncoderCtx->width     = OutputSet->VideoWidth;
-        VideoEncoderCtx->height    = OutputSet->VideoHeight;
+        VideoEncoderCtx->pix_fmt   = (AVPixelFormat)av_buffersink_get_format(buffersink_ctx);
+        VideoEncoderCtx->width     = av_buffersink_get_w(buffersink_ctx);
+        VideoEncoderCtx->height    = av_buffersink_get_h(buffersink_ctx);
         VideoEncoderCtx->profile   = OutputSet->VideoProfile;
         VideoEncoderCtx->level     = 4;
-        VideoEncoderCtx->gop_size  = VFrameRate;
+        VideoEncoderCtx->gop_size  = VFrameRate * OutputSet->GopSeconds;
 
         VideoEncoderCtx->bit_rate = OutputSet->VideoBitrate;
-        VideoEncoderCtx->keyint_min = VFrameRate;
+        VideoEncoderCtx->keyint_min = VFrameRate * OutputSet->GopSeconds;
         VideoEncoderCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER | AV_CODEC_FLAG_LOW_DELAY | AV_CODEC_FLAG_CLOSED_GOP;
 
+        EncoderProfileInfo profile;
+        if (OutputSet->EncoderProfilePath && !EncoderProfile::Load(OutputSet->EncoderProfilePath, &profile))
+            printf("Cannot read encoder profile '%s', using the defaults\n", OutputSet->EncoderProfilePath);
+
         AVDictionary* opt = NULL;
-        av_dict_set(&opt, "preset", "veryfast",0);
         av_dict_set(&opt, "tune", "zerolatency", 0);
         if (VideoEncoderCtx->codec_id == AV_CODEC_ID_H264)
         {
@@ -640,23 +1370,65 @@ void QSVTranscode::openencoder()
         {
             av_dict_set_int(&opt, "idr_interval",1,0);
         }
-        av_dict_set_int(&opt, "look_ahead",0,0);
-        if ((ret = avcodec_open2(VideoEncoderCtx, VideoEncCodec, &opt)) < 0)
+        //qsv spells it forced_idr, libx264 forced-idr
+        if (EncoderProfile::HasOption(VideoEncCodec, "forced_idr"))
+            av_dict_set_int(&opt, "forced_idr",1,0);
+        else if (EncoderProfile::HasOption(VideoEncCodec, "forced-idr"))
+            av_dict_set_int(&opt, "forced-idr",1,0);
+        EncoderProfile::Apply(profile, VideoEncoderCtx, &opt);
+        if (Complexity)
+            Complexity->Prepare(VideoEncoderCtx);
+        cpu_set_t previous;
+        bool pinned = ThreadPlacement::Apply(OutputSet, NumaNode, ROLE_ENCODE, SessionLabel, nullptr, &previous);
+        ret = avcodec_open2(VideoEncoderCtx, VideoEncCodec, &opt);
+        if (pinned)
+            ThreadPlacement::Restore(&previous);
+        if (ret < 0)
         {
             printf("Failed to open encode codec. Error code: %d\n", ret);
             return;
         }
+        if (Quality)
+            Quality->Open(VideoEncoderCtx);
+        if (Complexity)
+            Complexity->Configure(VideoEncoderCtx, OutputSet->VideoBitrate, OutputSet->BitrateFloor, OutputSet->BitrateCeiling);
     }
     VEncInited = true;
 }
 
 void QSVTranscode::ReadPacketProc()
 {
+    ThreadPlacement::Apply(OutputSet, NumaNode, ROLE_IO, SessionLabel, "read");
     while(Runing)
     {
         if (!InputOpend)
         {
+            bool resumed = CheckpointLoaded;
             InputOpend = OpenInput();
+            if (!InputOpend && !resumed && CheckpointLoaded && Runing)
+            {
+                //the checkpoint seek went to the input that was just closed, seek the next one again
+                CheckpointLoaded = false;
+            }
+            if (!InputOpend && !Batch.empty() && Runing && (QueuedFps <= 0))
+            {
+                //a batch item that cannot be opened is skipped, the first one too
+                printf("Skipping batch item '%s'\n", InputUrl);
+                InputOpend = OpenNextBatchItem();
+            }
+            if (!InputOpend)
+            {
+                CloseInPut();
+                av_usleep(1000000);
+            }
+        }
+        else if (Demux)
+        {
+            //packets are pushed by the shared demuxer, only follow its reconnects
+            if (Demux->Generation() != InputGeneration)
+                CloseInPut();
+            else
+                av_usleep(10000);
         }
         else
         {
@@ -666,47 +1438,297 @@ void QSVTranscode::ReadPacketProc()
                 av_init_packet(pkt);
                 if (av_read_frame(InFmtCtx, pkt) < 0)
                 {
-                    av_packet_unref(pkt);
+                    av_packet_free(&pkt);
                     break;
                 }
-                int needTranslate = 0;
-                if(InVideoStream){
-                     if (pkt->stream_index == InVideoStream->index){
-                        needTranslate = 1;
-                     }
-                      if (pkt->stream_index == InVideoStream->index)
-                        pkt->stream_index = 0;
-                }
+                if (!PushPacket(pkt))
+                    av_packet_free(&pkt);
+            }
+            if (Batch.empty() || !Runing || !NextBatchItem())
+                CloseInPut();
+        }
+    }
+}
 
-                if(InAudioStream){
-                    if((pkt->stream_index == InAudioStream->index)){
-                        needTranslate = 1;
-                    }
-                       if (pkt->stream_index == InAudioStream->index)
-                        pkt->stream_index = 1;
-                }
+bool QSVTranscode::PushPacket(AVPacket* pkt)
+{
+    AVStream* video = InVideoStream;
+    AVStream* audio = InAudioStream;
+    if (!InputOpend)
+        return false;
+    if (video && (pkt->stream_index == video->index))
+        pkt->stream_index = 0;
+    else if (audio && (pkt->stream_index == audio->index))
+        pkt->stream_index = 1;
+    else
+        return false;
 
-                    pkt->dts = pkt->pts;
-                    if (av_fifo_space(PktBuffer) < sizeof(AVPacket**))
-                    {
-                        av_fifo_realloc2(PktBuffer, av_fifo_space(PktBuffer) + av_fifo_size(PktBuffer) + sizeof(AVPacket**) * 10);
-                    }
-                    av_fifo_generic_write(PktBuffer, &pkt, sizeof(AVPacket**), nullptr);
+    pkt->dts = pkt->pts;
+    QueuePacket(pkt);
+    return true;
+}
+
+void QSVTranscode::QueuePacket(AVPacket* pkt)
+{
+    if (av_fifo_space(PktBuffer) < sizeof(AVPacket**))
+    {
+        av_fifo_realloc2(PktBuffer, av_fifo_space(PktBuffer) + av_fifo_size(PktBuffer) + sizeof(AVPacket**) * 10);
+    }
+    //the write thread may free pkt as soon as it is in the fifo
+    Memory.Add(MEM_PACKET_QUEUE, pkt->size + sizeof(AVPacket), 1);
+    av_fifo_generic_write(PktBuffer, &pkt, sizeof(AVPacket**), nullptr);
+}
+
+bool QSVTranscode::NextBatchItem()
+{
+    //stop the write thread from reopening the output until the next item is open
+    InputOpend = false;
+    {
+        boost::mutex::scoped_lock lock(BatchLock);
+        BatchFileDone = false;
+    }
+    AVPacket* eof = av_packet_alloc();
+    eof->stream_index = STREAM_END_OF_FILE;
+    QueuePacket(eof);
+    {
+        boost::mutex::scoped_lock lock(BatchLock);
+        while (Runing && !BatchFileDone)
+            BatchCond.timed_wait(lock, boost::posix_time::milliseconds(100));
+    }
+    if (!Runing)
+        return false;
+
+    BatchParams.CodecId = InVideoStream->codecpar->codec_id;
+    BatchParams.Width = InVideoStream->codecpar->width;
+    BatchParams.Height = InVideoStream->codecpar->height;
+    BatchParams.Format = InVideoStream->codecpar->format;
+    BatchParams.TimeBase = InVideoStream->time_base;
+    BatchParams.FrameRate = InVideoStream->avg_frame_rate;
+    //the decoder and encoder stay open, only the demuxer is per file
+    return OpenNextBatchItem();
+}
+
+bool QSVTranscode::OpenNextBatchItem()
+{
+    while (true)
+    {
+        avformat_close_input(&InFmtCtx);
+        if (FileIn)
+        {
+            delete FileIn;
+            FileIn = nullptr;
+        }
+        InVideoStream = nullptr;
+        InAudioStream = nullptr;
+        if (++BatchIndex >= Batch.size())
+            break;
+        free(InputUrl);
+        InputUrl = strdup(Batch[BatchIndex].InputUrl.c_str());
+        CheckpointLoaded = false;
+        LastCheckpointPts = AV_NOPTS_VALUE;
+        LastAudioMuxPts = AV_NOPTS_VALUE;
+        ResumeVideoPts = AV_NOPTS_VALUE;
+        ResumeAudioPts = AV_NOPTS_VALUE;
+        ResumeOffset = -1;
+        ResumeFrames = 0;
+        OutputSet->OutputUrl = &Batch[BatchIndex].OutputUrl[0];
+        if (OpenInput())
+        {
+            InputOpend = true;
+            return true;
+        }
+        printf("Skipping batch item '%s'\n", InputUrl);
+    }
+
+    int64_t elapsed = av_gettime_relative() - BatchStart;
+    printf("Batch done: %d items, %lld frames in %.2fs, %.1f fps\n", (int)Batch.size(), (long long)BatchFrames
+           , elapsed / 1000000.0, BatchFrames * 1000000.0 / FFMAX(elapsed, 1));
+    BatchComplete = true;
+    Runing = false;
+    return false;
+}
+
+void QSVTranscode::FinishBatchFile()
+{
+    //drain decoder and encoder into this item's output, then make them ready for the next item
+    if (VideoDecoderCtx)
+    {
+        DecodeVideo(nullptr);
+        avcodec_flush_buffers(VideoDecoderCtx);
+    }
+    if (VFilterInited)
+        FlushFilters();
+    if (VEncInited && OutHeadWrited)
+        encode_write(nullptr);
+    CloseOutput();
+    if (CheckpointOn)
+        SaveCheckpoint(AV_NOPTS_VALUE, true);
+    if (VEncInited)
+    {
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+        if (VideoEncCodec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+        {
+            avcodec_flush_buffers(VideoEncoderCtx);
+        }
+        else
+#endif
+        {
+            //a drained encoder without flush support cannot take new frames
+            avcodec_free_context(&VideoEncoderCtx);
+            VEncInited = false;
+        }
+    }
+    if (AudioDecoderCtx)
+        avcodec_free_context(&AudioDecoderCtx);
+    if (AudioEncoderCtx)
+        avcodec_free_context(&AudioEncoderCtx);
+    if (SwrCtx)
+        swr_free(&SwrCtx);
+    if (PcmBuffer)
+        av_audio_fifo_reset(PcmBuffer);
+    AudioPts = 0;
+
+    int64_t now = av_gettime_relative();
+    printf("Batch item %d/%d '%s': %lld frames in %.2fs, %.1f fps\n", (int)BatchIndex + 1, (int)Batch.size(), InputUrl
+           , (long long)FileFrames, (now - FileStart) / 1000000.0, FileFrames * 1000000.0 / FFMAX(now - FileStart, 1));
+    BatchFrames += FileFrames;
+    FileFrames = 0;
+    FileStart = now;
+    Metrics::Set("batch_items_done", SessionLabel, BatchIndex + 1);
+    Metrics::Set("batch_fps", SessionLabel, BatchFrames * 1000000.0 / FFMAX(now - BatchStart, 1));
+
+    boost::mutex::scoped_lock lock(BatchLock);
+    BatchFileDone = true;
+    BatchCond.notify_all();
+}
+
+void QSVTranscode::LoadCheckpoint()
+{
+    CheckpointInfo info;
+    CheckpointLoaded = true;
+    if (!Checkpoint::Load(OutputSet->CheckpointPath, &info) || (info.InputUrl != InputUrl) || (info.OutputUrl != OutputSet->OutputUrl))
+        return;
+    if (info.Done)
+    {
+        printf("'%s' is already transcoded to '%s'\n", InputUrl, OutputSet->OutputUrl);
+        BatchComplete = true;
+        Runing = false;
+        return;
+    }
+    if (av_seek_frame(InFmtCtx, InVideoStream->index, info.VideoPts, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        printf("Cannot seek '%s' to the checkpoint, starting over\n", InputUrl);
+        return;
+    }
+    printf("Resuming '%s' at pts %lld, output offset %lld\n", InputUrl, (long long)info.VideoPts, (long long)info.OutputOffset);
+    ResumeVideoPts = info.VideoPts;
+    ResumeAudioPts = info.AudioPts;
+    ResumeOffset = info.OutputOffset;
+    ResumeFrames = info.Frames;
+    LastCheckpointPts = info.VideoPts;
+}
+
+void QSVTranscode::SaveCheckpoint(int64_t pts, bool done)
+{
+    CheckpointInfo info;
+    if (!done)
+    {
+        if ((LastCheckpointPts != AV_NOPTS_VALUE)
+            && (av_rescale_q(pts - LastCheckpointPts, InVideoStream->time_base, av_make_q(1, AV_TIME_BASE)) < (int64_t)OutputSet->CheckpointInterval * AV_TIME_BASE))
+            return;
+        //the previous GOP and the audio muxed so far must be in the file before the checkpoint points past them
+        av_interleaved_write_frame(OutFmtCtx, NULL);
+        //mpegts holds the audio PES until it is full, muxers with AVFMT_ALLOW_FLUSH write it out here
+        av_write_frame(OutFmtCtx, NULL);
+        avio_flush(OutFmtCtx->pb);
+        info.OutputOffset = avio_tell(OutFmtCtx->pb);
+    }
+    else
+    {
+        info.OutputOffset = 0;
+    }
+    info.InputUrl = InputUrl;
+    info.OutputUrl = OutputSet->OutputUrl;
+    info.VideoPts = pts;
+    info.AudioPts = LastAudioMuxPts;
+    info.Frames = ResumeFrames + FileFrames;
+    info.Done = done;
+    if (Checkpoint::Save(OutputSet->CheckpointPath, info))
+        LastCheckpointPts = pts;
+    else
+        printf("Cannot save checkpoint '%s'\n", OutputSet->CheckpointPath);
+}
 
+void QSVTranscode::FlushFilters()
+{
+    //filters like fps and deinterlacers hold frames back until they see EOF
+    AVFrame* filt_frame = av_frame_alloc();
+    if (filt_frame && (av_buffersrc_add_frame_flags(buffersrc_ctx, NULL, 0) >= 0))
+    {
+        if (canvassrc_ctx)
+            av_buffersrc_add_frame_flags(canvassrc_ctx, NULL, 0);
+        {
+            boost::mutex::scoped_lock lock(LogoLock);
+            if (logosrc_ctx)
+                av_buffersrc_add_frame_flags(logosrc_ctx, NULL, 0);
+        }
+        while (av_buffersink_get_frame(buffersink_ctx, filt_frame) >= 0)
+        {
+            if (VEncInited && OutHeadWrited)
+            {
+                filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+                filt_frame->pts = filt_frame->best_effort_timestamp;
+                if (encode_write(filt_frame) < 0)
+                    printf("Error during encoding and writing.\n");
+                FileFrames++;
             }
-            CloseInPut();
+            av_frame_unref(filt_frame);
         }
     }
+    av_frame_free(&filt_frame);
+    //a graph that has seen EOF takes no more frames, the next item builds a new one
+    CloseFilters();
+}
+
+void QSVTranscode::CloseFilters()
+{
+    if (filter_graph)
+        avfilter_graph_free(&filter_graph);
+    Memory.Set(MEM_FILTER_SURFACES, 0, 0);
+    buffersrc_ctx = nullptr;
+    buffersink_ctx = nullptr;
+    canvassrc_ctx = nullptr;
+    {
+        boost::mutex::scoped_lock lock(LogoLock);
+        logosrc_ctx = nullptr;
+    }
+    VFilterInited = false;
+}
+
+void QSVTranscode::ResetVideoPipeline()
+{
+    if (VideoDecoderCtx)
+        avcodec_free_context(&VideoDecoderCtx);
+    Memory.Set(MEM_DECODER_SURFACES, 0, 0);
+    DecoderFramesData = nullptr;
+    CloseFilters();
+    if (VideoEncoderCtx)
+        avcodec_free_context(&VideoEncoderCtx);
+    VEncInited = false;
 }
 
 void QSVTranscode::WritePacketProc()
 {
+    ThreadPlacement::Apply(OutputSet, NumaNode, ROLE_COMPUTE, SessionLabel, "write");
     while (Runing)
     {
         if (!OutputOpend)
         {
             if (!InputOpend)
+            {
+                av_usleep(10000);
                 continue;
+            }
             OutputOpend = OpenOutput();
             av_usleep(1000);
         }
@@ -722,6 +1744,18 @@ void QSVTranscode::WritePacketProc()
                     {
                         continue;
                     }
+                    Memory.Add(MEM_PACKET_QUEUE, -(int64_t)(pkt->size + sizeof(AVPacket)), -1);
+                    if (pkt->stream_index == STREAM_END_OF_FILE)
+                    {
+                        av_packet_free(&pkt);
+                        FinishBatchFile();
+                        break;
+                    }
+                    if (ShedPacket(pkt))
+                    {
+                        av_packet_free(&pkt);
+                        continue;
+                    }
                     if (pkt->stream_index == 0)
                     {
                         DecodeVideo(pkt);
@@ -730,7 +1764,7 @@ void QSVTranscode::WritePacketProc()
                     {
                         DecodeAudio(pkt);
                     }
-                    av_packet_unref(pkt);
+                    av_packet_free(&pkt);
                 }
                 else
                 {
@@ -744,7 +1778,9 @@ void QSVTranscode::WritePacketProc()
     {
         AVPacket* pkt = nullptr;
         av_fifo_generic_read(PktBuffer, &pkt, sizeof(AVPacket**), nullptr);
-        av_packet_unref(pkt);
+        if (pkt)
+            Memory.Add(MEM_PACKET_QUEUE, -(int64_t)(pkt->size + sizeof(AVPacket)), -1);
+        av_packet_free(&pkt);
     }
 }
 
@@ -752,10 +1788,12 @@ void QSVTranscode::DecodeVideo(AVPacket* pkt)
 {
     AVFrame *frame;
     AVFrame *filt_frame;
+    int64_t stagestart = av_gettime_relative();
     int ret = avcodec_send_packet(VideoDecoderCtx, pkt);
     if (ret < 0)
     {
         printf("Error during decoding. Error code: %d\n", ret);
+        GrowSurfaces(ret);
         return;
     }
     while (ret >= 0)
@@ -766,10 +1804,12 @@ void QSVTranscode::DecodeVideo(AVPacket* pkt)
             return;
 
         ret = avcodec_receive_frame(VideoDecoderCtx, frame);
+        AddStageTime(STAGE_DECODE, &stagestart);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
         {
             av_frame_free(&frame);
             av_frame_free(&filt_frame);
+            ReportStats();
             return;
         }
         else
@@ -777,25 +1817,73 @@ void QSVTranscode::DecodeVideo(AVPacket* pkt)
             if (ret < 0)
             {
                 printf("Error while decoding. Error code: %d\n", ret);
+                GrowSurfaces(ret);
                 goto fail;
             }
         }
+        Surfaces.Track(frame);
+        if (frame->hw_frames_ctx && (frame->hw_frames_ctx->data != DecoderFramesData))
+        {
+            //get_format created a new surface pool
+            int frames;
+            int64_t bytes = SessionMemory::FramesBytes(frame->hw_frames_ctx, &frames);
+            Memory.Set(MEM_DECODER_SURFACES, bytes, frames);
+            DecoderFramesData = frame->hw_frames_ctx->data;
+        }
+        if (ResumeVideoPts != AV_NOPTS_VALUE)
+        {
+            //frames from the seek keyframe up to the checkpoint are already in the output
+            if (frame->best_effort_timestamp < ResumeVideoPts)
+                goto fail;
+            ResumeVideoPts = AV_NOPTS_VALUE;
+        }
         if (!VFilterInited)
         {
             init_filters();
             if (!VFilterInited)
                goto fail;
+            int frames;
+            int64_t bytes = SessionMemory::FramesBytes(av_buffersink_get_hw_frames_ctx(buffersink_ctx), &frames);
+            Memory.Set(MEM_FILTER_SURFACES, bytes, frames);
         }
         frame->pts = frame->best_effort_timestamp;
-        if (av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+        if (Scaler)
+        {
+            AVFrame* scaled = Scaler->Scale(frame);
+            if (!scaled)
+            {
+                av_log(NULL, AV_LOG_ERROR, "Error while scaling the frame\n");
+                break;
+            }
+            ret = av_buffersrc_add_frame_flags(buffersrc_ctx, scaled, 0);
+            av_frame_free(&scaled);
+        }
+        else
+            ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+        if (ret < 0)
         //if (av_buffersrc_add_frame_flags(buffersrc_ctx, frame, 0) < 0)
         {
             av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
             break;
         }
+        if (canvassrc_ctx && (FeedFrameSource(canvassrc_ctx, CanvasFrame, frame->pts) < 0))
+        {
+            av_log(NULL, AV_LOG_ERROR, "Error while feeding the pad canvas\n");
+            break;
+        }
+        if (logosrc_ctx)
+        {
+            boost::mutex::scoped_lock lock(LogoLock);
+            if (FeedFrameSource(logosrc_ctx, LogoFrame, frame->pts) < 0)
+            {
+                av_log(NULL, AV_LOG_ERROR, "Error while feeding the logo\n");
+                break;
+            }
+        }
         while (1)
         {
             ret = av_buffersink_get_frame(buffersink_ctx, filt_frame);
+            AddStageTime(STAGE_FILTER, &stagestart);
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
                 break;
             if (ret < 0)
@@ -812,10 +1900,25 @@ void QSVTranscode::DecodeVideo(AVPacket* pkt)
                 if (!OutHeadWrited)
                     goto fail;
             }
-            filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+            filt_frame->pict_type = TakeKeyFrameRequest() ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
             filt_frame->pts = filt_frame->best_effort_timestamp;
+            if (Quality)
+                Quality->AddReference(filt_frame);
+            if (Complexity && Complexity->Update(filt_frame, VideoEncoderCtx))
+            {
+                //the encoder cannot change its bitrate while running, drain it and open one at the new target
+                encode_write(nullptr);
+                avcodec_free_context(&VideoEncoderCtx);
+                VEncInited = false;
+                openencoder();
+                if (!VEncInited)
+                    goto fail;
+            }
             if ((ret = encode_write(filt_frame)) < 0)
                 printf("Error during encoding and writing.\n");
+            AddStageTime(STAGE_ENCODE, &stagestart);
+            StageFrames++;
+            FileFrames++;
         }
 fail:
         av_frame_free(&frame);
@@ -832,6 +1935,13 @@ void QSVTranscode::DecodeAudio(AVPacket* pkt)
     {
         if(!OutAudioStream)
             return;
+        if (ResumeAudioPts != AV_NOPTS_VALUE)
+        {
+            if (pkt->pts <= ResumeAudioPts)
+                return;
+            ResumeAudioPts = AV_NOPTS_VALUE;
+        }
+        int64_t inpts = pkt->pts;
         pkt->stream_index = OutAudioStream->index;
         av_packet_rescale_ts(pkt, InAudioStream->time_base, OutAudioStream->time_base);
         pkt->pos = 0;
@@ -840,6 +1950,10 @@ void QSVTranscode::DecodeAudio(AVPacket* pkt)
         {
             if (!AudioDecoderCtx)
             {
+                if (Edge)
+                    Edge->WritePacket(pkt, OutAudioStream->time_base, false);
+                if (Timeshift)
+                    Timeshift->WritePacket(pkt, OutAudioStream->time_base, false);
                 int ret = av_interleaved_write_frame(OutFmtCtx, pkt);
                 //int ret = av_write_frame(OutFmtCtx, pkt);
                 if (ret  < 0)
@@ -848,6 +1962,8 @@ void QSVTranscode::DecodeAudio(AVPacket* pkt)
                     if(ret != -22)
                         CloseOutput();
                 }
+                else
+                    LastAudioMuxPts = inpts;
             }
             else
             {
@@ -929,7 +2045,13 @@ void QSVTranscode::DecodeAudio(AVPacket* pkt)
                         av_packet_unref(&output_packet);
                         break;
                     }
+                    //samples still in PcmBuffer or the encoder are not in the output, resume after this packet
+                    int64_t muxpts = av_rescale_q(output_packet.pts, AudioEncoderCtx->time_base, InAudioStream->time_base);
                     av_packet_rescale_ts(&output_packet,AudioEncoderCtx->time_base, OutVideoStream->time_base);
+                    if (Edge)
+                        Edge->WritePacket(&output_packet, OutVideoStream->time_base, false);
+                    if (Timeshift)
+                        Timeshift->WritePacket(&output_packet, OutVideoStream->time_base, false);
                     ret = av_interleaved_write_frame(OutFmtCtx, &output_packet);
                     if (ret < 0)
                     {
@@ -940,6 +2062,8 @@ void QSVTranscode::DecodeAudio(AVPacket* pkt)
                             return ;
                         }
                     }
+                    else
+                        LastAudioMuxPts = muxpts;
                 }
             }
         }
@@ -969,13 +2093,24 @@ int QSVTranscode::encode_write(AVFrame *frame)
         }
         //enc_pkt.pts = frame->pts;
         enc_pkt.stream_index = OutVideoStream->index;
+        if (CheckpointOn && (enc_pkt.flags & AV_PKT_FLAG_KEY) && OutHeadWrited && OutFmtCtx)
+            SaveCheckpoint(enc_pkt.pts, false);
+        if (Quality)
+            Quality->AddPacket(&enc_pkt);
         av_packet_rescale_ts(&enc_pkt,InVideoStream->time_base, OutVideoStream->time_base);
 
         enc_pkt.pos = 0;
+        if (Edge)
+            Edge->WritePacket(&enc_pkt, OutVideoStream->time_base, true);
+        if (Timeshift)
+            Timeshift->WritePacket(&enc_pkt, OutVideoStream->time_base, true);
         if (OutHeadWrited && OutFmtCtx)
         {
+            int size = enc_pkt.size;
             ret = av_interleaved_write_frame(OutFmtCtx, &enc_pkt);
             //ret = av_write_frame(OutFmtCtx, &enc_pkt);
+            if ((ret >= 0) && Complexity)
+                Complexity->AddOutput(size);
             if (ret < 0)
             {
                 printf( "Error during writing data to output file. Error code: %d\n", ret);
@@ -996,3 +2131,164 @@ end:
     return ret;
 }
 
+bool QSVTranscode::RequestKeyFrame()
+{
+    boost::mutex::scoped_lock lock(KeyFrameLock);
+    KeyFramePending = true;
+    return (av_gettime_relative() - LastKeyFrameTime) >= (int64_t)OutputSet->KeyFrameMinInterval * 1000;
+}
+
+bool QSVTranscode::TakeKeyFrameRequest()
+{
+    boost::mutex::scoped_lock lock(KeyFrameLock);
+    if (!KeyFramePending)
+        return false;
+    //requests inside the interval are merged into one IDR when it expires
+    int64_t now = av_gettime_relative();
+    if ((now - LastKeyFrameTime) < (int64_t)OutputSet->KeyFrameMinInterval * 1000)
+        return false;
+    KeyFramePending = false;
+    LastKeyFrameTime = now;
+    return true;
+}
+
+void QSVTranscode::AddStageTime(int stage, int64_t* start)
+{
+    int64_t now = av_gettime_relative();
+    StageTime[stage] += now - *start;
+    *start = now;
+}
+
+void QSVTranscode::ReportStats()
+{
+    static const char* stagenames[STAGE_COUNT] = {"decode", "filter", "encode"};
+    int64_t now = av_gettime_relative();
+    int64_t busy = 0;
+    if (StatsStart == 0)
+        StatsStart = now;
+    if (now - StatsStart < 2000000)
+        return;
+
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        busy += StageTime[i];
+        Metrics::Set("session_stage_us_per_frame", SessionLabel + "," + Metrics::Label("stage", stagenames[i])
+                     , StageFrames ? (double)StageTime[i] / StageFrames : 0);
+        StageTime[i] = 0;
+    }
+    Metrics::Set("session_fps", SessionLabel, StageFrames * 1000000.0 / (now - StatsStart));
+    Metrics::Set("session_backend", SessionLabel, Backend);
+    Metrics::Set("session_thread_cpu", SessionLabel + "," + Metrics::Label("thread", "write"), sched_getcpu());
+    CapacityModel::Instance().Report(this, busy, now - StatsStart);
+    StageFrames = 0;
+    StatsStart = now;
+    AccountMemory();
+    Memory.Publish();
+    Surfaces.Publish();
+    if (Scaler)
+        Scaler->Publish(SessionLabel);
+    if (Complexity)
+        Complexity->Publish();
+    if (Timeshift)
+        Timeshift->Publish();
+}
+
+bool QSVTranscode::GrowSurfaces(int error)
+{
+    //a fixed QSV pool cannot grow, the flush makes the decoder call get_format again for a larger one
+    if ((error != AVERROR(ENOMEM)) || !VideoDecoderCtx->hw_device_ctx || !Surfaces.Grow())
+        return false;
+    printf("Decoder ran out of surfaces, rebuilding a larger pool\n");
+    avcodec_flush_buffers(VideoDecoderCtx);
+    return true;
+}
+
+void QSVTranscode::AccountMemory()
+{
+    if (PcmBuffer)
+    {
+        int samples = av_audio_fifo_size(PcmBuffer) + av_audio_fifo_space(PcmBuffer);
+        Memory.Set(MEM_PCM_FIFO, (int64_t)samples * av_get_bytes_per_sample(PcmFormat) * PcmChannels, 1);
+    }
+    else
+    {
+        Memory.Set(MEM_PCM_FIFO, 0, 0);
+    }
+    if (Backend == BACKEND_CPU)
+    {
+        int frames;
+        int64_t bytes = Surfaces.PoolBytes(&frames);
+        Memory.Set(MEM_DECODER_SURFACES, bytes, frames);
+    }
+    int objects = 0;
+    int64_t bytes = Timeshift ? Timeshift->MemoryBytes(&objects) : 0;
+    Memory.Set(MEM_TIMESHIFT_QUEUE, bytes, objects);
+    objects = 0;
+    bytes = Edge ? Edge->MemoryBytes(&objects) : 0;
+    Memory.Set(MEM_EDGE_CACHE, bytes, objects);
+    objects = 0;
+    bytes = Quality ? Quality->MemoryBytes(&objects) : 0;
+    Memory.Set(MEM_QUALITY_SAMPLES, bytes, objects);
+    objects = 0;
+    bytes = Complexity ? Complexity->MemoryBytes(&objects) : 0;
+    Memory.Set(MEM_COMPLEXITY_SAMPLES, bytes, objects);
+}
+
+void QSVTranscode::ShrinkBuffers()
+{
+    //the pcm fifo only ever grows, a burst of audio ahead of video leaves its capacity behind
+    if (PcmBuffer)
+    {
+        int size = av_audio_fifo_size(PcmBuffer);
+        int keep = FFMAX(size, (AudioEncoderCtx ? AudioEncoderCtx->frame_size : 1024) * 2);
+        AVAudioFifo* fifo = nullptr;
+        uint8_t** pcmdata = nullptr;
+        if ((size + av_audio_fifo_space(PcmBuffer) > keep * 2) && (fifo = av_audio_fifo_alloc(PcmFormat, PcmChannels, keep)))
+        {
+            if ((size > 0) && (av_samples_alloc_array_and_samples(&pcmdata, NULL, PcmChannels, size, PcmFormat, 1) >= 0))
+            {
+                av_audio_fifo_read(PcmBuffer, (void **)pcmdata, size);
+                av_audio_fifo_write(fifo, (void **)pcmdata, size);
+                av_freep(&pcmdata[0]);
+                av_freep(&pcmdata);
+            }
+            if (av_audio_fifo_size(fifo) == size)
+            {
+                av_audio_fifo_free(PcmBuffer);
+                PcmBuffer = fifo;
+            }
+            else
+            {
+                av_audio_fifo_free(fifo);
+            }
+        }
+    }
+    AccountMemory();
+}
+
+bool QSVTranscode::ShedPacket(AVPacket* pkt)
+{
+    if (!Shedding)
+    {
+        if ((OutputSet->MemoryPolicy == MEMORY_REPORT) || !Memory.OverBudget())
+            return false;
+        ShrinkBuffers();
+        int64_t excess = Memory.Total() - Memory.Budget();
+        //only a backlog is worth dropping, fixed pools over the budget are reported and left alone
+        if ((excess <= 0) || (OutputSet->MemoryPolicy != MEMORY_SHED) || (Memory.Bytes(MEM_PACKET_QUEUE) < excess))
+            return false;
+        printf("Session over its memory budget, dropping the packet backlog\n");
+        Shedding = true;
+    }
+    //the decoder restarts cleanly at a keyframe once the backlog is gone or back under three quarters of the budget
+    if ((pkt->stream_index == 0) && (pkt->flags & AV_PKT_FLAG_KEY)
+        && ((Memory.Bytes(MEM_PACKET_QUEUE) == 0) || (Memory.Total() <= Memory.Budget() * 3 / 4)))
+    {
+        Shedding = false;
+        return false;
+    }
+    Memory.CountShed();
+    return true;
+}
+
+
@@ -1,12 +1,29 @@
 #ifndef QSVTRANSCODE_H
 #define QSVTRANSCODE_H
 
+#include <string>
+#include <vector>
 #include <boost/thread.hpp>
+#include "LiveEdge.h"
+#include "Timeshift.h"
+#include "Metrics.h"
+#include "Checkpoint.h"
+#include "EncoderProfile.h"
+#include "QualitySampler.h"
+#include "ComplexityAnalyzer.h"
+#include "SessionMemory.h"
+#include "SurfacePool.h"
+#include "SliceScaler.h"
+#include "ThreadPlacement.h"
+#include "UdpInput.h"
+#include "MmapInput.h"
+#include "UdpOutput.h"
 
 extern "C"
 {
     #include <libavformat/avformat.h>
     #include <libavcodec/avcodec.h>
+    #include <libavfilter/avfilter.h>
     #include <libavfilter/buffersrc.h>
     #include <libavutil/fifo.h>
     #include <libavutil/time.h>
@@ -14,6 +31,20 @@ extern "C"
 }
 
 
+enum TranscodeBackend
+{
+    BACKEND_QSV = 0,
+    BACKEND_CPU = 1
+};
+
+enum PipelineStage
+{
+    STAGE_DECODE = 0,
+    STAGE_FILTER,
+    STAGE_ENCODE,
+    STAGE_COUNT
+};
+
 struct OutputInfo
 {
     int VideoWidth;
@@ -23,6 +54,66 @@ struct OutputInfo
     char* OutputUrl;
     char* OutputType;
     char* VideoEncoderName;
+
+    int   Backend       = BACKEND_QSV;
+    const char* CpuEncoderName = nullptr;//encoder used when the session runs on the CPU backend, nullptr never routes there
+    bool  Deinterlace   = false;
+    int   CropX         = 0;
+    int   CropY         = 0;
+    int   CropWidth     = 0;    //0 means no crop
+    int   CropHeight    = 0;
+    bool  PadToFit      = false;//keep aspect ratio, pad to VideoWidth x VideoHeight
+
+    char* LogoPath      = nullptr;
+    int   LogoX         = 0;
+    int   LogoY         = 0;
+    int   LogoWidth     = 0;    //0 means image size
+    int   LogoHeight    = 0;
+    int   LogoOpacity   = 255;  //0 - 255
+
+    int   EdgePort      = 0;    //0 means no embedded HTTP-FLV/HLS server
+    char* EdgeAddress   = nullptr;
+    int   EdgeHlsSegments = 6;
+    int   EdgeMaxClients = 256;     //concurrent viewers, each one has a thread
+
+    char* TimeshiftPath = nullptr;  //ring file the output is recorded into for rewinding, the keyframe index is <path>.idx
+    int64_t TimeshiftBytes = 2LL << 30; //ring file size, fixed for the life of the channel
+
+    int   GopSeconds    = 1;
+    int   KeyFrameMinInterval = 500; //ms between two forced keyframes
+
+    int   Placement     = PLACEMENT_NONE;
+    int   NumaNode      = -1;       //-1 lets PLACEMENT_SESSION spread sessions over the nodes
+    char* SessionCpus   = nullptr;  //cpu list like "0-3,8", overrides NumaNode
+    char* IoCpus        = nullptr;  //PLACEMENT_SPLIT: reader thread
+    char* ComputeCpus   = nullptr;  //PLACEMENT_SPLIT: decode/filter thread and decoder workers
+    char* EncoderCpus   = nullptr;  //PLACEMENT_SPLIT: encoder workers, ComputeCpus when unset
+
+    int   Program       = -1;       //MPTS program number, -1 takes the streams of any program
+    int   VideoPid      = 0;        //0 takes any video PID of the program
+    int   AudioPid      = 0;
+
+    char* CheckpointPath = nullptr; //file transcodes to a mpegts file resume from here after a restart
+    int   CheckpointInterval = 30;  //seconds of output between two checkpoints
+
+    bool  UdpBatchInput = true;     //udp:// inputs go through UdpInput instead of the stock protocol
+    int   UdpJitterMs   = 50;
+    bool  MmapFileInput = true;     //local files go through MmapInput instead of the file protocol
+    bool  UdpPacedOutput = true;    //udp:// outputs go through UdpOutput instead of the stock protocol
+    int   UdpMuxRate    = 0;        //bit/s, also sets the mpegts muxrate; 0 paces at the rate measured from the PCR
+
+    int   QualitySampleInterval = 0; //every Nth encoded frame is scored for PSNR/SSIM, 0 disables
+
+    int   BitrateFloor  = 0;        //bit/s, content-adaptive bitrate moves between floor and ceiling; both 0 keep VideoBitrate
+    int   BitrateCeiling = 0;       //0 means VideoBitrate
+    int   ComplexitySampleInterval = 5; //every Nth frame is analysed for the adaptive bitrate
+
+    char* EncoderProfilePath = nullptr; //profile written by --tune for this channel class, built in defaults when unset
+
+    int64_t MemoryBudget = 0;       //bytes per session, 0 disables
+    int   MemoryPolicy  = MEMORY_SHED;
+    int   SurfacePoolCap = 32;      //most decoder surfaces a pool may grow to
+    int   ScaleThreads  = 0;        //CPU backend slice scaler workers, 0 uses the cpus the session is placed on (up to 8), split between unplaced sessions
 };
 
 struct AudioEncodeInfo
@@ -33,16 +124,57 @@ struct AudioEncodeInfo
     AVSampleFormat      SampleFmt;
 };
 
+struct BatchItem
+{
+    std::string InputUrl;
+    std::string OutputUrl;
+};
+
+//what the warm pipeline was built for, a batch item with other values rebuilds it
+struct BatchVideoParams
+{
+    AVCodecID       CodecId;
+    int             Width;
+    int             Height;
+    int             Format;
+    AVRational      TimeBase;
+    AVRational      FrameRate;
+};
+
+class MptsDemux;
+
+AVPixelFormat get_qsv_format(AVCodecContext *avctx, const enum AVPixelFormat *pix_fmts);
+//copies a system memory frame into a qsv surface
+AVFrame* upload_surface(AVBufferRef* device, AVBufferRef** cache, AVFrame* swframe);
+
 class QSVTranscode
 {
     public:
-        QSVTranscode(char* inputurl, OutputInfo* outset, AudioEncodeInfo* audioset);
+        QSVTranscode(char* inputurl, OutputInfo* outset, AudioEncodeInfo* audioset, MptsDemux* demux = nullptr
+                     , const std::vector<BatchItem>* batch = nullptr);
         virtual ~QSVTranscode();
     public:
         AVBufferRef*        QSV_hw_device_ctx;
         AVBufferRef*        qsv_hw_frames_ctx;
+
+        bool SetLogo(const char* path);
+        bool RequestKeyFrame();
+        bool PushPacket(AVPacket* pkt);
+        bool BatchFinished() { return BatchComplete; }
+        static bool SelectStreams(AVFormatContext* ctx, OutputInfo* outset, AVStream** video, AVStream** audio);
     protected:
+        bool OpenSource();
         bool OpenInput();
+        bool AdmitSession(int width, int height, double fps);
+        void QueuePacket(AVPacket* pkt);
+        bool NextBatchItem();
+        bool OpenNextBatchItem();
+        void FinishBatchFile();
+        void FlushFilters();
+        void CloseFilters();
+        void ResetVideoPipeline();
+        void LoadCheckpoint();
+        void SaveCheckpoint(int64_t pts, bool done);
         bool OpenOutput();
 
         void ReadPacketProc();
@@ -51,17 +183,35 @@ class QSVTranscode
         void DecodeVideo(AVPacket* pkt);
         void DecodeAudio(AVPacket* pkt);
         int encode_write(AVFrame *frame);
+        bool TakeKeyFrameRequest();
+        void AddStageTime(int stage, int64_t* start);
+        void ReportStats();
+        void AccountMemory();
+        void ShrinkBuffers();
+        bool ShedPacket(AVPacket* pkt);
+        bool GrowSurfaces(int error);
 
         void init_filters();
+        bool BuildFilterDescr(char* descr, int size);
+        int CreateFrameSource(AVFilterContext** src_ctx, const char* name, AVFrame* frame, AVFilterInOut** outputs);
+        int FeedFrameSource(AVFilterContext* src_ctx, AVFrame* frame, int64_t pts);
+        AVFrame* LoadLogo(const char* path, int width, int height);
         void openencoder();
         void Check();
         void WriteOutHead();
         void CloseOutput();
         void CloseInPut();
+        static int InterruptProc(void* opaque);
     private:
         AVFilterGraph*      filter_graph;
         AVFilterContext*    buffersrc_ctx;
         AVFilterContext*    buffersink_ctx;
+        AVFilterContext*    canvassrc_ctx;
+        AVFrame*            CanvasFrame;
+        AVFilterContext*    logosrc_ctx;
+        AVFrame*            LogoFrame;
+        AVBufferRef*        LogoFramesCtx;  //QSV pool of the logo source, swapped logos are uploaded into it
+        boost::mutex        LogoLock;
     private:
         int64_t             AudioPts;
         OutputInfo*         OutputSet;
@@ -72,8 +222,33 @@ class QSVTranscode
         bool                OutHeadWrited;
         char*               InputUrl;
 
+        MptsDemux*          Demux;
+        std::vector<BatchItem> Batch;
+        size_t              BatchIndex;
+        bool                BatchComplete;
+        bool                BatchFileDone;
+        boost::mutex        BatchLock;
+        boost::condition_variable BatchCond;
+        BatchVideoParams    BatchParams;
+        int64_t             BatchStart;
+        int64_t             FileStart;
+        int64_t             FileFrames;
+        int64_t             BatchFrames;
+        bool                CheckpointLoaded;
+        bool                CheckpointOn;
+        int64_t             LastCheckpointPts;
+        int64_t             LastAudioMuxPts;
+        int64_t             ResumeVideoPts;
+        int64_t             ResumeAudioPts;
+        int64_t             ResumeOffset;
+        int64_t             ResumeFrames;
+        int                 InputGeneration;
         AVFormatContext*    InFmtCtx;
+        AVFormatContext*    StreamCopies;   //own copies of the program's streams in MPTS mode
+        UdpInput*           UdpIn;
+        MmapInput*          FileIn;
         AVFormatContext*    OutFmtCtx;
+        UdpOutput*          UdpOut;
         AVCodecContext*     VideoDecoderCtx;
         AVCodecContext*     VideoEncoderCtx;
 
@@ -93,6 +268,33 @@ class QSVTranscode
 
         AVFifoBuffer*       PktBuffer;
         AVAudioFifo*        PcmBuffer;
+        AVSampleFormat      PcmFormat;
+        int                 PcmChannels;
+
+        LiveEdge*           Edge;
+        TimeshiftRing*      Timeshift;
+        QualitySampler*     Quality;
+        ComplexityAnalyzer* Complexity;
+        SliceScaler*        Scaler;
+
+        bool                Admitted;
+        int                 Backend;        //OutputSet->Backend unless admission routed this session elsewhere
+        int                 QueuedWidth;    //what a queued session asks for, admission is retried without reopening the input
+        int                 QueuedHeight;
+        double              QueuedFps;
+        int                 NumaNode;       //picked once so every stage of the session runs on the same node
+        std::string         SessionLabel;
+        int64_t             StageTime[STAGE_COUNT];
+        int64_t             StageFrames;
+        int64_t             StatsStart;
+        SessionMemory       Memory;
+        SurfacePool         Surfaces;
+        bool                Shedding;
+        uint8_t*            DecoderFramesData;
+
+        boost::mutex        KeyFrameLock;
+        bool                KeyFramePending;
+        int64_t             LastKeyFrameTime;
 
         boost::thread*      ReadThread;
         boost::thread*      WriteThread;
@@ -0,0 +1,357 @@
+#include "QualitySampler.h"
+#include "Metrics.h"
+#include "SessionMemory.h"
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+extern "C"
+{
+    #include <libavutil/hwcontext.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/time.h>
+}
+
+#define QUALITY_MAX_PACKETS     120     //a worker this far behind drops to the next keyframe
+#define QUALITY_MAX_REFERENCES  8
+#define QUALITY_WINDOW          30      //samples in the rolling scores
+#define QUALITY_SSIM_C1         (0.01 * 255 * 0.01 * 255)
+#define QUALITY_SSIM_C2         (0.03 * 255 * 0.03 * 255)
+
+#ifdef __SSE2__
+static inline int hsum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+#endif
+
+uint64_t QualitySampler::SquaredError(const uint8_t* a, int astride, const uint8_t* b, int bstride, int width, int height)
+{
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++, a += astride, b += bstride)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        //one row of 16 bit differences squared and paired by madd stays far below 2^31 per lane
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        sum += (uint32_t)hsum_epi32(acc);
+#endif
+        for (; x < width; x++)
+        {
+            int d = a[x] - b[x];
+            sum += d * d;
+        }
+    }
+    return sum;
+}
+
+static double ssim_block(int s1, int s2, int ss, int s12)
+{
+    double mu1 = s1 / 64.0;
+    double mu2 = s2 / 64.0;
+    double var = ss / 64.0 - mu1 * mu1 - mu2 * mu2;
+    double cov = s12 / 64.0 - mu1 * mu2;
+    return ((2 * mu1 * mu2 + QUALITY_SSIM_C1) * (2 * cov + QUALITY_SSIM_C2))
+           / ((mu1 * mu1 + mu2 * mu2 + QUALITY_SSIM_C1) * (var + QUALITY_SSIM_C2));
+}
+
+double QualitySampler::Ssim(const uint8_t* a, int astride, const uint8_t* b, int bstride, int width, int height)
+{
+    //mean SSIM over non overlapping 8x8 blocks
+    double total = 0;
+    int blocks = 0;
+    for (int by = 0; by + 8 <= height; by += 8)
+    {
+        for (int bx = 0; bx + 8 <= width; bx += 8)
+        {
+            const uint8_t* pa = a + by * astride + bx;
+            const uint8_t* pb = b + by * bstride + bx;
+            int s1, s2, ss, s12;
+#ifdef __SSE2__
+            __m128i zero = _mm_setzero_si128();
+            __m128i sum1 = zero, sum2 = zero, sq = zero, cross = zero;
+            for (int y = 0; y < 8; y++, pa += astride, pb += bstride)
+            {
+                __m128i va = _mm_loadl_epi64((const __m128i*)pa);
+                __m128i vb = _mm_loadl_epi64((const __m128i*)pb);
+                sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(va, zero));
+                sum2 = _mm_add_epi32(sum2, _mm_sad_epu8(vb, zero));
+                __m128i wa = _mm_unpacklo_epi8(va, zero);
+                __m128i wb = _mm_unpacklo_epi8(vb, zero);
+                sq = _mm_add_epi32(sq, _mm_add_epi32(_mm_madd_epi16(wa, wa), _mm_madd_epi16(wb, wb)));
+                cross = _mm_add_epi32(cross, _mm_madd_epi16(wa, wb));
+            }
+            s1 = _mm_cvtsi128_si32(sum1);
+            s2 = _mm_cvtsi128_si32(sum2);
+            ss = hsum_epi32(sq);
+            s12 = hsum_epi32(cross);
+#else
+            s1 = s2 = ss = s12 = 0;
+            for (int y = 0; y < 8; y++, pa += astride, pb += bstride)
+            {
+                for (int x = 0; x < 8; x++)
+                {
+                    s1 += pa[x];
+                    s2 += pb[x];
+                    ss += pa[x] * pa[x] + pb[x] * pb[x];
+                    s12 += pa[x] * pb[x];
+                }
+            }
+#endif
+            total += ssim_block(s1, s2, ss, s12);
+            blocks++;
+        }
+    }
+    return blocks ? total / blocks : 1.0;
+}
+
+QualitySampler::QualitySampler(const std::string& label, int interval)
+    : Label(label)
+    , Interval(interval)
+    , Runing(true)
+    , FrameCount(0)
+    , WaitKey(true)
+    , DecoderCtx(nullptr)
+    , Samples(0)
+    , Dropped(0)
+    , MainTime(0)
+    , WorkTime(0)
+{
+    WorkThread = new boost::thread(&QualitySampler::WorkProc, this);
+}
+
+QualitySampler::~QualitySampler()
+{
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        Runing = false;
+    }
+    Cond.notify_all();
+    WorkThread->join();
+    delete WorkThread;
+    Flush();
+    if (DecoderCtx)
+        avcodec_free_context(&DecoderCtx);
+}
+
+void QualitySampler::Flush()
+{
+    boost::mutex::scoped_lock lock(Lock);
+    while (!Packets.empty())
+    {
+        av_packet_free(&Packets.front());
+        Packets.pop_front();
+    }
+    while (!References.empty())
+    {
+        av_frame_free(&References.front());
+        References.pop_front();
+    }
+    WaitKey = true;
+}
+
+bool QualitySampler::Open(AVCodecContext* encoder)
+{
+    //a reopened encoder starts a new stream, the local decoder starts over with it
+    boost::mutex::scoped_lock decodelock(DecodeLock);
+    Flush();
+    if (DecoderCtx)
+        avcodec_free_context(&DecoderCtx);
+    AVCodec* decoder = avcodec_find_decoder(encoder->codec_id);
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    if (!decoder || !par || !(DecoderCtx = avcodec_alloc_context3(decoder))
+        || (avcodec_parameters_from_context(par, encoder) < 0)
+        || (avcodec_parameters_to_context(DecoderCtx, par) < 0))
+    {
+        avcodec_parameters_free(&par);
+        if (DecoderCtx)
+            avcodec_free_context(&DecoderCtx);
+        printf("Quality sampler has no software decoder for the output\n");
+        return false;
+    }
+    avcodec_parameters_free(&par);
+    DecoderCtx->thread_count = 1;
+    if (avcodec_open2(DecoderCtx, decoder, NULL) < 0)
+    {
+        avcodec_free_context(&DecoderCtx);
+        return false;
+    }
+    return true;
+}
+
+int64_t QualitySampler::MemoryBytes(int* objects)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    int64_t bytes = 0;
+    for (size_t i = 0; i < References.size(); i++)
+        bytes += SessionMemory::FrameBytes(References[i]);
+    for (size_t i = 0; i < Packets.size(); i++)
+        bytes += Packets[i]->size;
+    *objects = References.size() + Packets.size();
+    return bytes;
+}
+
+void QualitySampler::AddReference(AVFrame* frame)
+{
+    if ((Interval <= 0) || (FrameCount++ % Interval))
+        return;
+    int64_t start = av_gettime_relative();
+    AVFrame* reference = av_frame_alloc();
+    if (!reference)
+        return;
+    //hardware surfaces go back to their pool right away, the copy is what the pipeline pays per sample
+    int ret = frame->hw_frames_ctx ? av_hwframe_transfer_data(reference, frame, 0) : av_frame_ref(reference, frame);
+    if (ret < 0)
+    {
+        av_frame_free(&reference);
+        return;
+    }
+    reference->pts = frame->pts;
+    boost::mutex::scoped_lock lock(Lock);
+    if (References.size() >= QUALITY_MAX_REFERENCES)
+    {
+        av_frame_free(&References.front());
+        References.pop_front();
+        Dropped++;
+    }
+    References.push_back(reference);
+    MainTime += av_gettime_relative() - start;
+}
+
+void QualitySampler::AddPacket(AVPacket* pkt)
+{
+    if (Interval <= 0)
+        return;
+    int64_t start = av_gettime_relative();
+    boost::mutex::scoped_lock lock(Lock);
+    if (Packets.size() >= QUALITY_MAX_PACKETS)
+    {
+        while (!Packets.empty())
+        {
+            av_packet_free(&Packets.front());
+            Packets.pop_front();
+        }
+        WaitKey = true;
+        Dropped++;
+    }
+    if (WaitKey && !(pkt->flags & AV_PKT_FLAG_KEY))
+        return;
+    WaitKey = false;
+    AVPacket* ref = av_packet_clone(pkt);
+    if (ref)
+    {
+        Packets.push_back(ref);
+        Cond.notify_one();
+    }
+    MainTime += av_gettime_relative() - start;
+}
+
+void QualitySampler::WorkProc()
+{
+    //scores must never take cpu from the encode
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    AVFrame* decoded = av_frame_alloc();
+    while (true)
+    {
+        AVPacket* pkt = nullptr;
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            while (Runing && Packets.empty())
+                Cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+            if (!Runing)
+                break;
+            pkt = Packets.front();
+            Packets.pop_front();
+        }
+
+        int64_t start = av_gettime_relative();
+        boost::mutex::scoped_lock decodelock(DecodeLock);
+        int ret = DecoderCtx ? avcodec_send_packet(DecoderCtx, pkt) : -1;
+        av_packet_free(&pkt);
+        while (ret >= 0)
+        {
+            ret = avcodec_receive_frame(DecoderCtx, decoded);
+            if (ret < 0)
+                break;
+            AVFrame* reference = nullptr;
+            {
+                //references come in display order like the decoder output, older ones were never encoded or got dropped
+                boost::mutex::scoped_lock lock(Lock);
+                while (!References.empty() && (References.front()->pts < decoded->best_effort_timestamp))
+                {
+                    av_frame_free(&References.front());
+                    References.pop_front();
+                    Dropped++;
+                }
+                if (!References.empty() && (References.front()->pts == decoded->best_effort_timestamp))
+                {
+                    reference = References.front();
+                    References.pop_front();
+                }
+            }
+            if (reference)
+            {
+                Score(reference, decoded);
+                av_frame_free(&reference);
+            }
+            av_frame_unref(decoded);
+        }
+        WorkTime += av_gettime_relative() - start;
+    }
+    av_frame_free(&decoded);
+}
+
+void QualitySampler::Score(AVFrame* reference, AVFrame* decoded)
+{
+    const AVPixFmtDescriptor* refdesc = av_pix_fmt_desc_get((AVPixelFormat)reference->format);
+    const AVPixFmtDescriptor* decdesc = av_pix_fmt_desc_get((AVPixelFormat)decoded->format);
+    if (!refdesc || !decdesc || (refdesc->comp[0].depth != 8) || (decdesc->comp[0].depth != 8))
+        return;
+
+    //luma only, what Y-PSNR and SSIM-Y report
+    int width = FFMIN(reference->width, decoded->width);
+    int height = FFMIN(reference->height, decoded->height);
+    uint64_t sse = SquaredError(reference->data[0], reference->linesize[0], decoded->data[0], decoded->linesize[0], width, height);
+    double psnr = sse ? 10 * log10(255.0 * 255.0 * width * height / sse) : 100;
+    double ssim = Ssim(reference->data[0], reference->linesize[0], decoded->data[0], decoded->linesize[0], width, height);
+
+    PsnrWindow.push_back(psnr);
+    SsimWindow.push_back(ssim);
+    if (PsnrWindow.size() > QUALITY_WINDOW)
+    {
+        PsnrWindow.pop_front();
+        SsimWindow.pop_front();
+    }
+    double psnrsum = 0;
+    double ssimsum = 0;
+    for (size_t i = 0; i < PsnrWindow.size(); i++)
+    {
+        psnrsum += PsnrWindow[i];
+        ssimsum += SsimWindow[i];
+    }
+    Samples++;
+
+    boost::mutex::scoped_lock lock(Lock);
+    Metrics::Set("quality_psnr_y", Label, psnrsum / PsnrWindow.size());
+    Metrics::Set("quality_ssim_y", Label, ssimsum / SsimWindow.size());
+    Metrics::Set("quality_samples_total", Label, Samples);
+    Metrics::Set("quality_dropped_total", Label, Dropped);
+    Metrics::Set("quality_pipeline_us_per_sample", Label, (double)MainTime / Samples);
+    Metrics::Set("quality_worker_us_per_sample", Label, (double)WorkTime / Samples);
+}
@@ -0,0 +1,57 @@
+#ifndef QUALITYSAMPLER_H
+#define QUALITYSAMPLER_H
+
+#include <deque>
+#include <string>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+//scores every Nth encoded frame against the filter graph output it was encoded from,
+//decoding the encoder's packets in software on an idle priority thread
+class QualitySampler
+{
+    public:
+        QualitySampler(const std::string& label, int interval);
+        virtual ~QualitySampler();
+
+        bool Open(AVCodecContext* encoder);
+        void AddReference(AVFrame* frame);
+        void AddPacket(AVPacket* pkt);
+        int64_t MemoryBytes(int* objects);
+
+        static uint64_t SquaredError(const uint8_t* a, int astride, const uint8_t* b, int bstride, int width, int height);
+        static double Ssim(const uint8_t* a, int astride, const uint8_t* b, int bstride, int width, int height);
+    protected:
+        void WorkProc();
+        void Score(AVFrame* reference, AVFrame* decoded);
+        void Flush();
+    private:
+        std::string         Label;
+        int                 Interval;
+        bool                Runing;
+        int64_t             FrameCount;
+        bool                WaitKey;
+
+        boost::mutex        Lock;
+        boost::condition_variable Cond;
+        std::deque<AVPacket*> Packets;
+        std::deque<AVFrame*> References;
+
+        boost::mutex        DecodeLock;
+        AVCodecContext*     DecoderCtx;
+
+        std::deque<double>  PsnrWindow;
+        std::deque<double>  SsimWindow;
+        uint64_t            Samples;
+        uint64_t            Dropped;
+        int64_t             MainTime;
+        int64_t             WorkTime;
+
+        boost::thread*      WorkThread;
+};
+
+#endif // QUALITYSAMPLER_H
@@ -0,0 +1,99 @@
+#include "SessionMemory.h"
+#include "Metrics.h"
+#include <string.h>
+extern "C"
+{
+    #include <libavutil/hwcontext.h>
+    #include <libavutil/imgutils.h>
+}
+
+static const char* pool_names[MEM_POOL_COUNT] = {"packet_queue", "pcm_fifo", "decoder_surfaces", "filter_surfaces", "udp_input", "udp_output",
+                                                 "timeshift_queue", "edge_cache", "quality_samples", "complexity_samples"};
+
+SessionMemory::SessionMemory()
+    : BudgetBytes(0)
+    , PeakBytes(0)
+    , ShedPackets(0)
+{
+    memset(PoolBytes, 0, sizeof(PoolBytes));
+    memset(PoolObjects, 0, sizeof(PoolObjects));
+}
+
+void SessionMemory::Configure(const std::string& label, int64_t budget)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    Label = label;
+    BudgetBytes = budget;
+}
+
+void SessionMemory::Add(int pool, int64_t bytes, int objects)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    PoolBytes[pool] += bytes;
+    PoolObjects[pool] += objects;
+}
+
+void SessionMemory::Set(int pool, int64_t bytes, int objects)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    PoolBytes[pool] = bytes;
+    PoolObjects[pool] = objects;
+}
+
+int64_t SessionMemory::Bytes(int pool)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    return PoolBytes[pool];
+}
+
+int64_t SessionMemory::Total()
+{
+    boost::mutex::scoped_lock lock(Lock);
+    int64_t total = 0;
+    for (int i = 0; i < MEM_POOL_COUNT; i++)
+        total += PoolBytes[i];
+    return total;
+}
+
+bool SessionMemory::OverBudget()
+{
+    return (BudgetBytes > 0) && (Total() > BudgetBytes);
+}
+
+void SessionMemory::Publish()
+{
+    int64_t total = Total();
+    boost::mutex::scoped_lock lock(Lock);
+    PeakBytes = FFMAX(PeakBytes, total);
+    for (int i = 0; i < MEM_POOL_COUNT; i++)
+    {
+        std::string labels = Label + "," + Metrics::Label("pool", pool_names[i]);
+        Metrics::Set("session_memory_bytes", labels, PoolBytes[i]);
+        Metrics::Set("session_memory_objects", labels, PoolObjects[i]);
+    }
+    Metrics::Set("session_memory_total_bytes", Label, total);
+    Metrics::Set("session_memory_peak_bytes", Label, PeakBytes);
+    Metrics::Set("session_memory_budget_bytes", Label, BudgetBytes);
+    Metrics::Set("session_memory_over_budget", Label, (BudgetBytes > 0) && (total > BudgetBytes));
+    Metrics::Set("session_memory_shed_packets", Label, ShedPackets);
+}
+
+int64_t SessionMemory::FramesBytes(AVBufferRef* hw_frames_ctx, int* frames)
+{
+    //what the pool was created with, fixed size pools never allocate past it
+    *frames = 0;
+    if (!hw_frames_ctx)
+        return 0;
+    AVHWFramesContext* ctx = (AVHWFramesContext*)hw_frames_ctx->data;
+    int size = av_image_get_buffer_size(ctx->sw_format, ctx->width, ctx->height, 1);
+    *frames = ctx->initial_pool_size;
+    return size > 0 ? (int64_t)size * ctx->initial_pool_size : 0;
+}
+
+int64_t SessionMemory::FrameBytes(const AVFrame* frame)
+{
+    int64_t bytes = 0;
+    for (int i = 0; frame && (i < AV_NUM_DATA_POINTERS) && frame->buf[i]; i++)
+        bytes += frame->buf[i]->size;
+    return bytes;
+}
@@ -0,0 +1,64 @@
+#ifndef SESSIONMEMORY_H
+#define SESSIONMEMORY_H
+
+#include <stdint.h>
+#include <string>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavutil/buffer.h>
+    #include <libavutil/frame.h>
+}
+
+enum MemoryPool
+{
+    MEM_PACKET_QUEUE = 0,   //demuxed packets waiting for the write thread
+    MEM_PCM_FIFO,           //allocated capacity, not just the queued samples
+    MEM_DECODER_SURFACES,
+    MEM_FILTER_SURFACES,
+    MEM_UDP_INPUT,
+    MEM_UDP_OUTPUT,
+    MEM_TIMESHIFT_QUEUE,    //segments waiting for the ring writer
+    MEM_EDGE_CACHE,         //GOP cache for new viewers and the HLS segments
+    MEM_QUALITY_SAMPLES,    //downloaded references and packets waiting to be scored
+    MEM_COMPLEXITY_SAMPLES, //luma of the last sample and the downloaded sample
+    MEM_POOL_COUNT
+};
+
+enum MemoryPolicy
+{
+    MEMORY_REPORT = 0,      //only export the over budget state
+    MEMORY_SHRINK,          //give back unused buffer capacity
+    MEMORY_SHED             //shrink, then drop the packet backlog and resume at the next keyframe
+};
+
+//bytes and objects held by one session, checked against its budget
+class SessionMemory
+{
+    public:
+        SessionMemory();
+
+        void Configure(const std::string& label, int64_t budget);
+        void Add(int pool, int64_t bytes, int objects);
+        void Set(int pool, int64_t bytes, int objects);
+        int64_t Bytes(int pool);
+        int64_t Total();
+        int64_t Budget() { return BudgetBytes; }
+        bool OverBudget();
+        void CountShed() { ShedPackets++; }
+        void Publish();
+
+        static int64_t FramesBytes(AVBufferRef* hw_frames_ctx, int* frames);
+        static int64_t FrameBytes(const AVFrame* frame);
+    private:
+        boost::mutex        Lock;
+        std::string         Label;
+        int64_t             BudgetBytes;
+        int64_t             PoolBytes[MEM_POOL_COUNT];
+        int                 PoolObjects[MEM_POOL_COUNT];
+        int64_t             PeakBytes;
+        uint64_t            ShedPackets;
+};
+
+#endif // SESSIONMEMORY_H
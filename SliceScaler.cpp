@@ -0,0 +1,370 @@
+#include "SliceScaler.h"
+#include "Metrics.h"
+#include <sched.h>
+#include <string.h>
+#include <boost/atomic.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+extern "C"
+{
+    #include <libavutil/buffer.h>
+    #include <libavutil/time.h>
+}
+
+#define SCALE_MAX_THREADS   8
+#define SCALE_ALIGN         32
+
+//scalers of unplaced sessions, they all run on every cpu
+static boost::atomic<int> shared_scalers(0);
+
+//x / 9 for the 3x3 box sums, exact enough for 8 bit and the same in the SIMD and scalar paths
+static inline int div9(int v)
+{
+    return ((v + 4) * 7282) >> 16;
+}
+
+static void down2_row(uint8_t* dst, const uint8_t* s0, const uint8_t* s1, int dstw, int step)
+{
+    int bytes = dstw * step;
+    int x = 0;
+#ifdef __SSE2__
+    if (step == 1)
+    {
+        __m128i mask = _mm_set1_epi16(0x00ff);
+        for (; x + 16 <= bytes; x += 16)
+        {
+            __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(s0 + 2 * x)), _mm_loadu_si128((const __m128i*)(s1 + 2 * x)));
+            __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(s0 + 2 * x + 16)), _mm_loadu_si128((const __m128i*)(s1 + 2 * x + 16)));
+            a = _mm_and_si128(_mm_avg_epu8(a, _mm_srli_epi16(a, 8)), mask);
+            b = _mm_and_si128(_mm_avg_epu8(b, _mm_srli_epi16(b, 8)), mask);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+        }
+    }
+    else
+    {
+        //interleaved UV: pairs of 16 bit pixels, packs_epi32 is signed so the values are biased around it
+        __m128i mask = _mm_set1_epi32(0xffff);
+        __m128i bias = _mm_set1_epi32(0x8000);
+        __m128i unbias = _mm_set1_epi16((short)0x8000);
+        for (; x + 16 <= bytes; x += 16)
+        {
+            __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(s0 + 2 * x)), _mm_loadu_si128((const __m128i*)(s1 + 2 * x)));
+            __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(s0 + 2 * x + 16)), _mm_loadu_si128((const __m128i*)(s1 + 2 * x + 16)));
+            a = _mm_sub_epi32(_mm_and_si128(_mm_avg_epu8(a, _mm_srli_epi32(a, 16)), mask), bias);
+            b = _mm_sub_epi32(_mm_and_si128(_mm_avg_epu8(b, _mm_srli_epi32(b, 16)), mask), bias);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_add_epi16(_mm_packs_epi32(a, b), unbias));
+        }
+    }
+#endif
+    for (; x < bytes; x++)
+    {
+        int i = 2 * x - x % step;
+        int v0 = (s0[i] + s1[i] + 1) >> 1;
+        int v1 = (s0[i + step] + s1[i + step] + 1) >> 1;
+        dst[x] = (v0 + v1 + 1) >> 1;
+    }
+}
+
+//tmp = w0 * s0 + w1 * s1 + w2 * s2, the vertical half of the 3 tap filters
+static void sum_rows(int16_t* tmp, const uint8_t* s0, const uint8_t* s1, const uint8_t* s2, int w0, int w1, int w2, int bytes)
+{
+    int x = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i m0 = _mm_set1_epi16(w0);
+    __m128i m1 = _mm_set1_epi16(w1);
+    __m128i m2 = _mm_set1_epi16(w2);
+    for (; x + 16 <= bytes; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s0 + x));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s1 + x));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s2 + x));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), m0)
+                                                 , _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), m1))
+                                   , _mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), m2));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), m0)
+                                                 , _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), m1))
+                                   , _mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), m2));
+        _mm_storeu_si128((__m128i*)(tmp + x), lo);
+        _mm_storeu_si128((__m128i*)(tmp + x + 8), hi);
+    }
+#endif
+    for (; x < bytes; x++)
+        tmp[x] = w0 * s0[x] + w1 * s1[x] + w2 * s2[x];
+}
+
+static void down3_cols(uint8_t* dst, const int16_t* tmp, int dstw, int step)
+{
+    for (int x = 0; x < dstw; x++)
+    {
+        const int16_t* t = tmp + 3 * x * step;
+        for (int c = 0; c < step; c++)
+            dst[x * step + c] = div9(t[c] + t[step + c] + t[2 * step + c]);
+    }
+}
+
+static void down15_cols(uint8_t* dst, const int16_t* tmp, int dstw, int step)
+{
+    for (int x = 0; x < dstw; x += 2)
+    {
+        const int16_t* t = tmp + 3 * x / 2 * step;
+        for (int c = 0; c < step; c++)
+        {
+            dst[x * step + c] = div9(2 * t[c] + t[step + c]);
+            dst[(x + 1) * step + c] = div9(t[step + c] + 2 * t[2 * step + c]);
+        }
+    }
+}
+
+void SliceScaler::ScalePlane(uint8_t* dst, int dststride, const uint8_t* src, int srcstride
+                             , int dstw, int rows, int step, int ratio, int16_t* tmp)
+{
+    int srcbytes = dstw * step * ratio / 2;
+    switch (ratio)
+    {
+        case 4:
+            for (int y = 0; y < rows; y++, dst += dststride, src += 2 * srcstride)
+                down2_row(dst, src, src + srcstride, dstw, step);
+            break;
+        case 6:
+            for (int y = 0; y < rows; y++, dst += dststride, src += 3 * srcstride)
+            {
+                sum_rows(tmp, src, src + srcstride, src + 2 * srcstride, 1, 1, 1, srcbytes);
+                down3_cols(dst, tmp, dstw, step);
+            }
+            break;
+        case 3:
+            //3 source rows make 2 output rows, weighted 2:1 and 1:2
+            for (int y = 0; y < rows; y += 2, dst += 2 * dststride, src += 3 * srcstride)
+            {
+                sum_rows(tmp, src, src + srcstride, src + 2 * srcstride, 2, 1, 0, srcbytes);
+                down15_cols(dst, tmp, dstw, step);
+                sum_rows(tmp, src, src + srcstride, src + 2 * srcstride, 0, 1, 2, srcbytes);
+                down15_cols(dst + dststride, tmp, dstw, step);
+            }
+            break;
+    }
+}
+
+static int scale_ratio(int srcw, int srch, int dstw, int dsth)
+{
+    if ((srcw == dstw * 2) && (srch == dsth * 2))
+        return 4;
+    if ((srcw == dstw * 3) && (srch == dsth * 3))
+        return 6;
+    if ((srcw * 2 == dstw * 3) && (srch * 2 == dsth * 3))
+        return 3;
+    return 0;
+}
+
+SliceScaler::SliceScaler(int threads, bool shared)
+    : Threads(threads)
+    , Cpus(1)
+    , Shared(false)
+    , Bands(1)
+    , Runing(true)
+    , Format(AV_PIX_FMT_NONE)
+    , SrcWidth(0)
+    , SrcHeight(0)
+    , DstWidth(0)
+    , DstHeight(0)
+    , CropX(0)
+    , CropY(0)
+    , Ratio(0)
+    , Generation(0)
+    , Pending(0)
+    , Src(nullptr)
+    , Dst(nullptr)
+    , ScaleTime(0)
+    , ScaleFrames(0)
+{
+    memset(Pools, 0, sizeof(Pools));
+    memset(Linesize, 0, sizeof(Linesize));
+    if (Threads <= 0)
+    {
+        //the cpus this session was placed on, workers inherit the same affinity
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        Cpus = (sched_getaffinity(0, sizeof(set), &set) == 0) ? CPU_COUNT(&set) : 1;
+        Threads = Cpus;
+        Shared = shared;
+        if (Shared)
+            shared_scalers++;
+    }
+    Threads = FFMAX(1, FFMIN(Threads, SCALE_MAX_THREADS));
+    Bands = Threads;
+    Tmp.resize(Threads);
+    for (int i = 1; i < Threads; i++)
+        Workers.push_back(new boost::thread(&SliceScaler::WorkerProc, this, i));
+}
+
+SliceScaler::~SliceScaler()
+{
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        Runing = false;
+    }
+    Cond.notify_all();
+    for (size_t i = 0; i < Workers.size(); i++)
+    {
+        Workers[i]->join();
+        delete Workers[i];
+    }
+    for (int i = 0; i < 3; i++)
+        av_buffer_pool_uninit(&Pools[i]);
+    if (Shared)
+        shared_scalers--;
+}
+
+bool SliceScaler::Supported(int format, int srcw, int srch, int dstw, int dsth, int cropx, int cropy)
+{
+    if ((format != AV_PIX_FMT_NV12) && (format != AV_PIX_FMT_YUV420P))
+        return false;
+    if ((cropx | cropy | dstw | dsth) & 1)
+        return false;
+    int ratio = scale_ratio(srcw, srch, dstw, dsth);
+    //1.5:1 works on pairs of chroma pixels and rows
+    return (ratio == 4) || (ratio == 6) || ((ratio == 3) && !((dstw | dsth) & 3));
+}
+
+bool SliceScaler::Configure(int format, int srcw, int srch, int dstw, int dsth, int cropx, int cropy)
+{
+    if (!Supported(format, srcw, srch, dstw, dsth, cropx, cropy))
+        return false;
+    if ((format == Format) && (srcw == SrcWidth) && (srch == SrcHeight) && (dstw == DstWidth) && (dsth == DstHeight))
+    {
+        CropX = cropx;
+        CropY = cropy;
+        return true;
+    }
+    for (int i = 0; i < 3; i++)
+        av_buffer_pool_uninit(&Pools[i]);
+    Format = format;
+    SrcWidth = srcw;
+    SrcHeight = srch;
+    DstWidth = dstw;
+    DstHeight = dsth;
+    CropX = cropx;
+    CropY = cropy;
+    Ratio = scale_ratio(srcw, srch, dstw, dsth);
+    int planes = (format == AV_PIX_FMT_NV12) ? 2 : 3;
+    for (int i = 0; i < planes; i++)
+    {
+        Linesize[i] = FFALIGN((i && (planes == 3)) ? dstw / 2 : dstw, SCALE_ALIGN);
+        if (!(Pools[i] = av_buffer_pool_init(Linesize[i] * (i ? dsth / 2 : dsth) + SCALE_ALIGN, NULL)))
+            return false;
+    }
+    for (int i = 0; i < Threads; i++)
+        Tmp[i].resize(srcw * 2 + 16);
+    return true;
+}
+
+AVFrame* SliceScaler::Scale(const AVFrame* src)
+{
+    if ((src->format != Format) || (src->width < CropX + SrcWidth) || (src->height < CropY + SrcHeight))
+        return nullptr;
+    int64_t start = av_gettime_relative();
+    AVFrame* dst = av_frame_alloc();
+    if (!dst)
+        return nullptr;
+    dst->format = Format;
+    dst->width = DstWidth;
+    dst->height = DstHeight;
+    for (int i = 0; (i < 3) && Pools[i]; i++)
+    {
+        if (!(dst->buf[i] = av_buffer_pool_get(Pools[i])))
+        {
+            av_frame_free(&dst);
+            return nullptr;
+        }
+        dst->data[i] = dst->buf[i]->data;
+        dst->linesize[i] = Linesize[i];
+    }
+    av_frame_copy_props(dst, src);
+    //idle workers of a shared scaler wake up and go back to sleep, the busy ones add up to the cpus
+    int bands = Shared ? FFMIN(Threads, FFMAX(1, Cpus / FFMAX(1, (int)shared_scalers))) : Threads;
+
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        Src = src;
+        Dst = dst;
+        Bands = bands;
+        Pending = bands - 1;
+        Generation++;
+    }
+    Cond.notify_all();
+    ScaleBand(0);
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        while (Pending > 0)
+            DoneCond.wait(lock);
+    }
+    ScaleTime += av_gettime_relative() - start;
+    ScaleFrames++;
+    return dst;
+}
+
+void SliceScaler::WorkerProc(int band)
+{
+    uint64_t seen = 0;
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            while (Runing && (Generation == seen))
+                Cond.wait(lock);
+            if (!Runing)
+                return;
+            seen = Generation;
+            if (band >= Bands)
+                continue;
+        }
+        ScaleBand(band);
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            if (--Pending == 0)
+                DoneCond.notify_one();
+        }
+    }
+}
+
+void SliceScaler::ScaleBand(int band)
+{
+    //bands start on a multiple of 4 output rows so 1.5:1 chroma keeps its row pairs
+    int rows = (DstHeight / 4 + Bands - 1) / Bands * 4;
+    int y0 = FFMIN(DstHeight, band * rows);
+    int y1 = (band == Bands - 1) ? DstHeight : FFMIN(DstHeight, y0 + rows);
+    if (y0 >= y1)
+        return;
+    int16_t* tmp = &Tmp[band][0];
+    const AVFrame* src = Src;
+    AVFrame* dst = Dst;
+
+    ScalePlane(dst->data[0] + y0 * dst->linesize[0], dst->linesize[0]
+               , src->data[0] + (CropY + y0 * Ratio / 2) * src->linesize[0] + CropX, src->linesize[0]
+               , DstWidth, y1 - y0, 1, Ratio, tmp);
+    int cy0 = y0 / 2;
+    int cy1 = y1 / 2;
+    if (Format == AV_PIX_FMT_NV12)
+    {
+        ScalePlane(dst->data[1] + cy0 * dst->linesize[1], dst->linesize[1]
+                   , src->data[1] + (CropY / 2 + cy0 * Ratio / 2) * src->linesize[1] + CropX, src->linesize[1]
+                   , DstWidth / 2, cy1 - cy0, 2, Ratio, tmp);
+    }
+    else
+    {
+        for (int i = 1; i < 3; i++)
+            ScalePlane(dst->data[i] + cy0 * dst->linesize[i], dst->linesize[i]
+                       , src->data[i] + (CropY / 2 + cy0 * Ratio / 2) * src->linesize[i] + CropX / 2, src->linesize[i]
+                       , DstWidth / 2, cy1 - cy0, 1, Ratio, tmp);
+    }
+}
+
+void SliceScaler::Publish(const std::string& label)
+{
+    Metrics::Set("session_scale_us_per_frame", label, ScaleFrames ? (double)ScaleTime / ScaleFrames : 0);
+    Metrics::Set("session_scale_threads", label, Bands);
+    ScaleTime = 0;
+    ScaleFrames = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef SLICESCALER_H
+#define SLICESCALER_H
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+}
+
+//CPU downscale of NV12/YUV420P by 2:1, 1.5:1 or 3:1 with box filters, split into horizontal
+//bands that run in parallel; other formats and ratios stay with the scale filter (swscale)
+class SliceScaler
+{
+    public:
+        SliceScaler(int threads, bool shared);
+        virtual ~SliceScaler();
+
+        static bool Supported(int format, int srcw, int srch, int dstw, int dsth, int cropx, int cropy);
+        bool Configure(int format, int srcw, int srch, int dstw, int dsth, int cropx, int cropy);
+        AVFrame* Scale(const AVFrame* src);
+        int Width() { return DstWidth; }
+        int Height() { return DstHeight; }
+        void Publish(const std::string& label);
+
+        static void ScalePlane(uint8_t* dst, int dststride, const uint8_t* src, int srcstride
+                               , int dstw, int rows, int step, int ratio, int16_t* tmp);
+    protected:
+        void WorkerProc(int band);
+        void ScaleBand(int band);
+    private:
+        int                 Threads;
+        int                 Cpus;
+        bool                Shared;     //the cpus are split between all shared scalers of the process
+        int                 Bands;      //bands of the frame being scaled, up to Threads
+        bool                Runing;
+        int                 Format;
+        int                 SrcWidth;
+        int                 SrcHeight;
+        int                 DstWidth;
+        int                 DstHeight;
+        int                 CropX;
+        int                 CropY;
+        int                 Ratio;      //source pixels per 2 output pixels: 4, 3 or 6
+        AVBufferPool*       Pools[3];
+        int                 Linesize[3];
+
+        boost::mutex        Lock;
+        boost::condition_variable Cond;
+        boost::condition_variable DoneCond;
+        uint64_t            Generation;
+        int                 Pending;
+        const AVFrame*      Src;
+        AVFrame*            Dst;
+        std::vector<std::vector<int16_t> > Tmp;
+        std::vector<boost::thread*> Workers;
+
+        int64_t             ScaleTime;
+        int64_t             ScaleFrames;
+};
+
+#endif // SLICESCALER_H
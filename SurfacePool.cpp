@@ -0,0 +1,276 @@
+#include "SurfacePool.h"
+#include "Metrics.h"
+#include <string.h>
+extern "C"
+{
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#define SURFACE_QSV_ASYNC       4   //surfaces the QSV decoder keeps in its async queue
+#define SURFACE_DOWNSTREAM      4   //until the downstream depth was measured
+#define SURFACE_GROW_STEP       4
+#define SURFACE_STRIDE_ALIGN    64
+
+struct SurfaceRelease
+{
+    SurfacePool*    Pool;
+    int             Counter;
+    AVBufferRef*    Buffer;
+};
+
+SurfacePool::SurfacePool()
+    : Cap(32)
+    , Extra(0)
+    , Limit(0)
+    , DownstreamPeak(0)
+    , Grows(0)
+    , Failures(0)
+    , CpuFormat(AV_PIX_FMT_NONE)
+    , CpuWidth(0)
+    , CpuHeight(0)
+    , FrameBytes(0)
+{
+    memset(InFlight, 0, sizeof(InFlight));
+    memset(Peak, 0, sizeof(Peak));
+    memset(Pools, 0, sizeof(Pools));
+    memset(PlaneSize, 0, sizeof(PlaneSize));
+    memset(Linesize, 0, sizeof(Linesize));
+}
+
+SurfacePool::~SurfacePool()
+{
+    //pools are freed once the last outstanding buffer comes back
+    for (int i = 0; i < 4; i++)
+        av_buffer_pool_uninit(&Pools[i]);
+}
+
+void SurfacePool::Configure(const std::string& label, int cap)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    Label = label;
+    Cap = cap;
+}
+
+void SurfacePool::Attach(AVCodecContext* avctx)
+{
+    avctx->opaque = this;
+    if (!avctx->hw_device_ctx && (avctx->codec->capabilities & AV_CODEC_CAP_DR1))
+        avctx->get_buffer2 = GetBuffer;
+}
+
+int SurfacePool::ReferenceFrames(AVCodecContext* avctx)
+{
+    //native decoders copy the SPS value, the QSV ones leave the default of 1 and only the level is known
+    if (avctx->refs > 1)
+        return avctx->refs + avctx->has_b_frames;
+    int mbs = ((avctx->coded_width + 15) / 16) * ((avctx->coded_height + 15) / 16);
+    switch (avctx->codec_id)
+    {
+        case AV_CODEC_ID_H264:
+        {
+            static const struct { int Level; int MaxDpbMbs; } dpb[] =
+            {
+                {10, 396}, {11, 900}, {12, 2376}, {13, 2376}, {20, 2376}, {21, 4752}, {22, 8100}, {30, 8100}, {31, 18000},
+                {32, 20480}, {40, 32768}, {41, 32768}, {42, 34816}, {50, 110400}, {51, 184320}, {52, 184320}, {60, 696320},
+                {61, 696320}, {62, 696320}
+            };
+            for (size_t i = 0; (avctx->level > 0) && (mbs > 0) && (i < sizeof(dpb) / sizeof(dpb[0])); i++)
+            {
+                if (dpb[i].Level == avctx->level)
+                    return FFMAX(1, FFMIN(16, dpb[i].MaxDpbMbs / mbs));
+            }
+            return 16;
+        }
+        case AV_CODEC_ID_HEVC:
+        {
+            //A.4.2: 6 pictures at the level's maximum picture size, up to 16 for smaller ones
+            int64_t maxps = (avctx->level >= 180) ? 35651584 : (avctx->level >= 150) ? 8912896 : (avctx->level >= 120) ? 2228224 : 0;
+            int64_t ps = (int64_t)avctx->coded_width * avctx->coded_height;
+            if (!maxps || !ps)
+                return 16;
+            return (ps <= maxps / 4) ? 16 : (ps <= maxps / 2) ? 12 : (ps <= maxps * 3 / 4) ? 8 : 6;
+        }
+        case AV_CODEC_ID_MPEG2VIDEO:
+            return 2;
+        case AV_CODEC_ID_VP8:
+            return 3;
+        case AV_CODEC_ID_VP9:
+            return 8;
+        default:
+            return 16;
+    }
+}
+
+int SurfacePool::PoolSize(AVCodecContext* avctx)
+{
+    boost::mutex::scoped_lock lock(Lock);
+    return UpdateLimit(avctx);
+}
+
+int SurfacePool::UpdateLimit(AVCodecContext* avctx)
+{
+    //Lock is held by the caller
+    int pipeline = 1;
+    if (avctx->hw_device_ctx)
+        pipeline = SURFACE_QSV_ASYNC;
+    else if (avctx->active_thread_type & FF_THREAD_FRAME)
+        pipeline = FFMAX(1, avctx->thread_count);
+    int downstream = DownstreamPeak ? DownstreamPeak : SURFACE_DOWNSTREAM;
+    Limit = FFMIN(Cap, ReferenceFrames(avctx) + pipeline + downstream + 1 + Extra);
+    return Limit;
+}
+
+bool SurfacePool::Grow()
+{
+    boost::mutex::scoped_lock lock(Lock);
+    Failures++;
+    if (Limit >= Cap)
+        return false;
+    Extra += SURFACE_GROW_STEP;
+    Grows++;
+    return true;
+}
+
+void SurfacePool::ReleaseProc(void* opaque, uint8_t*)
+{
+    SurfaceRelease* release = (SurfaceRelease*)opaque;
+    {
+        boost::mutex::scoped_lock lock(release->Pool->Lock);
+        release->Pool->InFlight[release->Counter]--;
+    }
+    av_buffer_unref(&release->Buffer);
+    delete release;
+}
+
+int SurfacePool::Wrap(AVFrame* frame, int counter)
+{
+    //a buffer over buf[0] with the same data, released when the last reference to the frame is gone
+    SurfaceRelease* release = new SurfaceRelease;
+    release->Pool = this;
+    release->Counter = counter;
+    release->Buffer = frame->buf[0];
+    AVBufferRef* wrapper = av_buffer_create(frame->buf[0]->data, frame->buf[0]->size, ReleaseProc, release, 0);
+    if (!wrapper)
+    {
+        delete release;
+        return AVERROR(ENOMEM);
+    }
+    frame->buf[0] = wrapper;
+    boost::mutex::scoped_lock lock(Lock);
+    InFlight[counter]++;
+    Peak[counter] = FFMAX(Peak[counter], InFlight[counter]);
+    if (counter == SURFACE_DOWNSTREAM)
+        DownstreamPeak = FFMAX(DownstreamPeak, InFlight[counter]);
+    return 0;
+}
+
+void SurfacePool::Track(AVFrame* frame)
+{
+    if (frame->buf[0])
+        Wrap(frame, SURFACE_DOWNSTREAM);
+}
+
+bool SurfacePool::UpdateCpuPool(AVCodecContext* avctx, AVFrame* frame)
+{
+    if (Pools[0] && (CpuFormat == frame->format) && (CpuWidth == frame->width) && (CpuHeight == frame->height))
+        return true;
+    for (int i = 0; i < 4; i++)
+        av_buffer_pool_uninit(&Pools[i]);
+    CpuFormat = frame->format;
+    CpuWidth = frame->width;
+    CpuHeight = frame->height;
+    Peak[SURFACE_POOL] = InFlight[SURFACE_POOL];
+
+    //the layout avcodec_default_get_buffer2 uses, so every decoder can write edges and SIMD overreads
+    int w = frame->width;
+    int h = frame->height;
+    int align[AV_NUM_DATA_POINTERS];
+    int unaligned;
+    uint8_t* data[4];
+    avcodec_align_dimensions2(avctx, &w, &h, align);
+    do
+    {
+        if (av_image_fill_linesizes(Linesize, (AVPixelFormat)frame->format, w) < 0)
+            return false;
+        w += w & ~(w - 1);
+        unaligned = 0;
+        for (int i = 0; i < 4; i++)
+            unaligned |= Linesize[i] % align[i];
+    } while (unaligned);
+    int size = av_image_fill_pointers(data, (AVPixelFormat)frame->format, h, NULL, Linesize);
+    if (size < 0)
+        return false;
+    FrameBytes = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        PlaneSize[i] = 0;
+        if (!data[i])
+            continue;
+        PlaneSize[i] = ((i < 3) && data[i + 1]) ? (int)(data[i + 1] - data[i]) : size - (int)(data[i] - data[0]);
+        if (!(Pools[i] = av_buffer_pool_init(PlaneSize[i] + 16 + SURFACE_STRIDE_ALIGN - 1, av_buffer_allocz)))
+            return false;
+        FrameBytes += PlaneSize[i];
+    }
+    return true;
+}
+
+int SurfacePool::GetBuffer(AVCodecContext* avctx, AVFrame* frame, int flags)
+{
+    SurfacePool* pool = (SurfacePool*)avctx->opaque;
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+
+    {
+        boost::mutex::scoped_lock lock(pool->Lock);
+        if (!pool->Limit)
+            pool->UpdateLimit(avctx);
+        if (!pool->UpdateCpuPool(avctx, frame))
+            return AVERROR(ENOMEM);
+        if (pool->InFlight[SURFACE_POOL] >= pool->Limit)
+        {
+            if (pool->Limit >= pool->Cap)
+            {
+                pool->Failures++;
+                return AVERROR(ENOMEM);
+            }
+            pool->Limit = FFMIN(pool->Cap, pool->Limit + SURFACE_GROW_STEP);
+            pool->Extra += SURFACE_GROW_STEP;
+            pool->Grows++;
+        }
+        for (int i = 0; i < 4 && pool->Pools[i]; i++)
+        {
+            if (!(frame->buf[i] = av_buffer_pool_get(pool->Pools[i])))
+            {
+                av_frame_unref(frame);
+                return AVERROR(ENOMEM);
+            }
+            frame->data[i] = frame->buf[i]->data;
+            frame->linesize[i] = pool->Linesize[i];
+        }
+    }
+    frame->extended_data = frame->data;
+    return pool->Wrap(frame, SURFACE_POOL);
+}
+
+int64_t SurfacePool::PoolBytes(int* frames)
+{
+    //an AVBufferPool keeps every buffer it ever allocated until it is uninitialized
+    boost::mutex::scoped_lock lock(Lock);
+    *frames = Pools[0] ? Peak[SURFACE_POOL] : 0;
+    return (int64_t)*frames * FrameBytes;
+}
+
+void SurfacePool::Publish()
+{
+    boost::mutex::scoped_lock lock(Lock);
+    Metrics::Set("surface_pool_size", Label, Limit);
+    Metrics::Set("surface_pool_cap", Label, Cap);
+    Metrics::Set("surface_pool_in_use", Label, InFlight[SURFACE_POOL]);
+    Metrics::Set("surface_pool_peak", Label, Peak[SURFACE_POOL]);
+    Metrics::Set("surface_pool_downstream", Label, InFlight[SURFACE_DOWNSTREAM]);
+    Metrics::Set("surface_pool_downstream_peak", Label, DownstreamPeak);
+    Metrics::Set("surface_pool_grows", Label, Grows);
+    Metrics::Set("surface_pool_failures", Label, Failures);
+}
@@ -0,0 +1,65 @@
+#ifndef SURFACEPOOL_H
+#define SURFACEPOOL_H
+
+#include <stdint.h>
+#include <string>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+enum SurfaceCounter
+{
+    SURFACE_POOL = 0,       //buffers handed out by the CPU pool, decoder references included
+    SURFACE_DOWNSTREAM,     //decoded frames still held by the filter graph or the encoder
+    SURFACE_COUNTER_COUNT
+};
+
+//sizes a decoder's frame pool from the stream's reference needs plus the measured downstream depth.
+//QSV pools are fixed once created and are rebuilt larger after an allocation failure,
+//the CPU pool behind get_buffer2 grows while it is used; both stop at the cap
+class SurfacePool
+{
+    public:
+        SurfacePool();
+        virtual ~SurfacePool();
+
+        void Configure(const std::string& label, int cap);
+        void Attach(AVCodecContext* avctx);
+        int PoolSize(AVCodecContext* avctx);
+        bool Grow();
+        void Track(AVFrame* frame);
+        int64_t PoolBytes(int* frames);
+        void Publish();
+
+        static int ReferenceFrames(AVCodecContext* avctx);
+        static int GetBuffer(AVCodecContext* avctx, AVFrame* frame, int flags);
+    protected:
+        int UpdateLimit(AVCodecContext* avctx);
+        bool UpdateCpuPool(AVCodecContext* avctx, AVFrame* frame);
+        int Wrap(AVFrame* frame, int counter);
+        static void ReleaseProc(void* opaque, uint8_t* data);
+    private:
+        boost::mutex        Lock;
+        std::string         Label;
+        int                 Cap;
+        int                 Extra;      //added by failures, kept for the next pool
+        int                 Limit;      //current size of the pool
+        int                 InFlight[SURFACE_COUNTER_COUNT];
+        int                 Peak[SURFACE_COUNTER_COUNT];
+        int                 DownstreamPeak; //survives pool rebuilds, feeds the next size
+        uint64_t            Grows;
+        uint64_t            Failures;
+
+        AVBufferPool*       Pools[4];
+        int                 PlaneSize[4];
+        int                 Linesize[4];
+        int                 CpuFormat;
+        int                 CpuWidth;
+        int                 CpuHeight;
+        int                 FrameBytes;
+};
+
+#endif // SURFACEPOOL_H
@@ -0,0 +1,138 @@
+#include "ThreadPlacement.h"
+#include "QSVTranscode.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <boost/atomic.hpp>
+
+bool ThreadPlacement::ParseCpuList(const char* list, cpu_set_t* set)
+{
+    CPU_ZERO(set);
+    if (!list)
+        return false;
+    const char* p = list;
+    while (*p)
+    {
+        char* end = nullptr;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p)
+            break;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++)
+        {
+            if (cpu >= 0)
+                CPU_SET(cpu, set);
+        }
+        while ((*p == ',') || (*p == ' ') || (*p == '\n'))
+            p++;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+bool ThreadPlacement::NumaNodeCpus(int node, cpu_set_t* set)
+{
+    char path[128];
+    char list[1024] = {0};
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        CPU_ZERO(set);
+        return false;
+    }
+    bool ok = fgets(list, sizeof(list), file) != nullptr;
+    fclose(file);
+    return ok && ParseCpuList(list, set);
+}
+
+std::string ThreadPlacement::CpuListString(const cpu_set_t* set)
+{
+    std::string text;
+    char range[32];
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while ((last + 1 < CPU_SETSIZE) && CPU_ISSET(last + 1, set))
+            last++;
+        if (last == cpu)
+            snprintf(range, sizeof(range), "%s%d", text.empty() ? "" : ",", cpu);
+        else
+            snprintf(range, sizeof(range), "%s%d-%d", text.empty() ? "" : ",", cpu, last);
+        text += range;
+        cpu = last;
+    }
+    return text;
+}
+
+int ThreadPlacement::PickNode(const OutputInfo* out)
+{
+    //called once per session, every stage of the session then uses the same node
+    if ((out->Placement != PLACEMENT_SESSION) || out->SessionCpus || (out->NumaNode >= 0))
+        return out->NumaNode;
+    //no node given, spread sessions over the nodes round robin
+    static boost::atomic<int> nextnode(0);
+    int nodes = 0;
+    cpu_set_t probe;
+    while (NumaNodeCpus(nodes, &probe))
+        nodes++;
+    if (nodes == 0)
+        return -1;
+    return nextnode++ % nodes;
+}
+
+bool ThreadPlacement::Resolve(const OutputInfo* out, int node, int role, cpu_set_t* set)
+{
+    CPU_ZERO(set);
+    if (out->Placement == PLACEMENT_SESSION)
+    {
+        if (out->SessionCpus)
+            return ParseCpuList(out->SessionCpus, set);
+        return (node >= 0) && NumaNodeCpus(node, set);
+    }
+    if (out->Placement == PLACEMENT_SPLIT)
+    {
+        if (role == ROLE_IO)
+            return ParseCpuList(out->IoCpus, set);
+        if ((role == ROLE_ENCODE) && out->EncoderCpus)
+            return ParseCpuList(out->EncoderCpus, set);
+        return ParseCpuList(out->ComputeCpus, set);
+    }
+    return false;
+}
+
+bool ThreadPlacement::Apply(const OutputInfo* out, int node, int role, const std::string& session, const char* thread, cpu_set_t* previous)
+{
+    cpu_set_t set;
+    if (!Resolve(out, node, role, &set))
+        return false;
+    if (previous && pthread_getaffinity_np(pthread_self(), sizeof(*previous), previous))
+        return false;
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+    {
+        printf("Cannot pin %s thread to cpus %s. Error code: %d\n", thread ? thread : "codec", CpuListString(&set).c_str(), ret);
+        return false;
+    }
+    if (thread)
+    {
+        std::string label = session + "," + Metrics::Label("thread", thread);
+        Metrics::Remove(label);
+        Metrics::Set("session_thread_placement", label + "," + Metrics::Label("cpus", CpuListString(&set).c_str()), 1);
+    }
+    return true;
+}
+
+void ThreadPlacement::Restore(const cpu_set_t* previous)
+{
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(*previous), previous);
+    if (ret != 0)
+        printf("Cannot restore thread affinity to cpus %s. Error code: %d\n", CpuListString(previous).c_str(), ret);
+}
@@ -0,0 +1,36 @@
+#ifndef THREADPLACEMENT_H
+#define THREADPLACEMENT_H
+
+#include <sched.h>
+#include <string>
+
+struct OutputInfo;
+
+enum PlacementPolicy
+{
+    PLACEMENT_NONE = 0,
+    PLACEMENT_SESSION,  //every stage of a session on one core set or NUMA node
+    PLACEMENT_SPLIT     //readers on the I/O cores, decode on the compute cores, encoder workers on their own cores
+};
+
+enum PlacementRole
+{
+    ROLE_IO = 0,
+    ROLE_COMPUTE,
+    ROLE_ENCODE
+};
+
+class ThreadPlacement
+{
+    public:
+        static bool ParseCpuList(const char* list, cpu_set_t* set);
+        static bool NumaNodeCpus(int node, cpu_set_t* set);
+        static std::string CpuListString(const cpu_set_t* set);
+
+        static int PickNode(const OutputInfo* out);
+        static bool Resolve(const OutputInfo* out, int node, int role, cpu_set_t* set);
+        static bool Apply(const OutputInfo* out, int node, int role, const std::string& session, const char* thread, cpu_set_t* previous = nullptr);
+        static void Restore(const cpu_set_t* previous);
+};
+
+#endif // THREADPLACEMENT_H
@@ -0,0 +1,473 @@
+#include "Timeshift.h"
+#include "Metrics.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+extern "C"
+{
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+}
+
+#define TIMESHIFT_MAGIC         "TSHIFT1"
+#define TIMESHIFT_VERSION       1
+#define TIMESHIFT_MIN_ENTRIES   1024
+#define TIMESHIFT_SEGMENT_FLOOR 16384   //ring bytes per index entry, smaller segments age out of the index before the ring
+#define TIMESHIFT_QUEUE_SEGMENTS 8      //finished segments waiting for the writer before new ones are dropped
+
+TimeshiftIndex::TimeshiftIndex()
+    : Fd(-1)
+    , MapSize(0)
+    , Header(nullptr)
+    , Entries(nullptr)
+{
+}
+
+TimeshiftIndex::~TimeshiftIndex()
+{
+    Close();
+}
+
+bool TimeshiftIndex::Map(bool writable)
+{
+    void* map = mmap(nullptr, MapSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, Fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    Header = (TimeshiftHeader*)map;
+    Entries = (TimeshiftEntry*)(Header + 1);
+    return true;
+}
+
+bool TimeshiftIndex::Open(const std::string& path, uint32_t capacity, int64_t ringbytes)
+{
+    Close();
+    Fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (Fd < 0)
+    {
+        printf("Cannot open timeshift index '%s'. Error code: %d\n", path.c_str(), errno);
+        return false;
+    }
+    MapSize = sizeof(TimeshiftHeader) + (size_t)capacity * sizeof(TimeshiftEntry);
+    //an index left by an earlier run of the same ring keeps its window
+    TimeshiftHeader old;
+    struct stat st;
+    bool reuse = !fstat(Fd, &st) && (st.st_size == (off_t)MapSize) && (pread(Fd, &old, sizeof(old), 0) == sizeof(old))
+                 && !memcmp(old.Magic, TIMESHIFT_MAGIC, sizeof(old.Magic)) && (old.Version == TIMESHIFT_VERSION)
+                 && (old.Capacity == capacity) && (old.RingBytes == ringbytes);
+    if (!reuse && (ftruncate(Fd, 0) || ftruncate(Fd, MapSize)))
+        return false;
+    if (!Map(true))
+        return false;
+    if (!reuse)
+    {
+        memcpy(Header->Magic, TIMESHIFT_MAGIC, sizeof(Header->Magic));
+        Header->Version = TIMESHIFT_VERSION;
+        Header->Capacity = capacity;
+        Header->RingBytes = ringbytes;
+        Header->Head = 0;
+        Header->Tail = 0;
+        Header->WriteOffset = 0;
+    }
+    return true;
+}
+
+bool TimeshiftIndex::OpenRead(const std::string& path)
+{
+    Close();
+    Fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    TimeshiftHeader header;
+    if ((Fd < 0) || (pread(Fd, &header, sizeof(header), 0) != sizeof(header))
+        || memcmp(header.Magic, TIMESHIFT_MAGIC, sizeof(header.Magic)) || (header.Version != TIMESHIFT_VERSION))
+    {
+        printf("'%s' is not a timeshift index\n", path.c_str());
+        return false;
+    }
+    MapSize = sizeof(TimeshiftHeader) + (size_t)header.Capacity * sizeof(TimeshiftEntry);
+    return Map(false);
+}
+
+void TimeshiftIndex::Close()
+{
+    if (Header)
+        munmap(Header, MapSize);
+    Header = nullptr;
+    Entries = nullptr;
+    if (Fd >= 0)
+        close(Fd);
+    Fd = -1;
+}
+
+uint64_t TimeshiftIndex::Head() const
+{
+    return Header ? __atomic_load_n(&Header->Head, __ATOMIC_ACQUIRE) : 0;
+}
+
+uint64_t TimeshiftIndex::Tail() const
+{
+    return Header ? __atomic_load_n(&Header->Tail, __ATOMIC_ACQUIRE) : 0;
+}
+
+bool TimeshiftIndex::Valid(uint64_t seq) const
+{
+    return (seq >= Tail()) && (seq < Head());
+}
+
+bool TimeshiftIndex::Get(uint64_t seq, TimeshiftEntry* entry) const
+{
+    if (!Valid(seq))
+        return false;
+    *entry = Entries[seq % Header->Capacity];
+    //the writer may have reused the slot while it was copied
+    return (entry->Seq == seq) && Valid(seq);
+}
+
+bool TimeshiftIndex::Find(int64_t time, TimeshiftEntry* entry) const
+{
+    //last segment starting at or before time, the oldest one for times before the window
+    uint64_t lo = Tail();
+    uint64_t hi = Head();
+    if (lo >= hi)
+        return false;
+    while (hi - lo > 1)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (Entries[mid % Header->Capacity].Time <= time)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return Get(lo, entry) || Get(Tail(), entry);
+}
+
+int64_t TimeshiftIndex::Reserve(int64_t size)
+{
+    //segments are laid out in write order, so whatever the new one overwrites is at the tail
+    uint64_t head = Header->Head;
+    uint64_t tail = Header->Tail;
+    int64_t offset = Header->WriteOffset;
+    if (offset + size > Header->RingBytes)
+    {
+        while ((tail < head) && (Entries[tail % Header->Capacity].Offset >= offset))
+            tail++;
+        offset = 0;
+    }
+    while (tail < head)
+    {
+        const TimeshiftEntry& oldest = Entries[tail % Header->Capacity];
+        if ((oldest.Offset >= offset + size) || (oldest.Offset + oldest.Size <= offset))
+            break;
+        tail++;
+    }
+    if (head - tail >= Header->Capacity)
+        tail = head - Header->Capacity + 1;
+    //readers have to see the eviction before the bytes change under them
+    __atomic_store_n(&Header->Tail, tail, __ATOMIC_RELEASE);
+    return offset;
+}
+
+void TimeshiftIndex::Append(const TimeshiftEntry& entry)
+{
+    uint64_t head = Header->Head;
+    TimeshiftEntry& slot = Entries[head % Header->Capacity];
+    slot = entry;
+    slot.Seq = head;
+    Header->WriteOffset = entry.Offset + entry.Size;
+    __atomic_store_n(&Header->Head, head + 1, __ATOMIC_RELEASE);
+}
+
+TimeshiftRing::TimeshiftRing(const char* path, int64_t bytes, const std::string& label)
+    : Path(path)
+    , Bytes(bytes)
+    , Label(label)
+    , Fd(-1)
+    , TsCtx(nullptr)
+    , SegmentPts(AV_NOPTS_VALUE)
+    , SegmentTime(0)
+    , LastPts(AV_NOPTS_VALUE)
+    , Runing(true)
+    , WriterThread(nullptr)
+    , WrittenBytes(0)
+    , Dropped(0)
+    , QueueFull(0)
+{
+}
+
+TimeshiftRing::~TimeshiftRing()
+{
+    Close();
+    if (WriterThread)
+    {
+        //the writer empties the queue before it exits
+        {
+            boost::mutex::scoped_lock lock(QueueLock);
+            Runing = false;
+            QueueCond.notify_all();
+        }
+        WriterThread->join();
+        delete WriterThread;
+    }
+    if (Fd >= 0)
+        close(Fd);
+    Metrics::Remove(Label + "," + Metrics::Label("timeshift", Path.c_str()));
+}
+
+int TimeshiftRing::WriteProc(void* opaque, uint8_t* buf, int size)
+{
+    std::vector<uint8_t>* out = (std::vector<uint8_t>*)opaque;
+    out->insert(out->end(), buf, buf + size);
+    return size;
+}
+
+bool TimeshiftRing::OpenRing()
+{
+    if (Fd >= 0)
+        return true;
+    Fd = open(Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (Fd < 0)
+    {
+        printf("Cannot open timeshift ring '%s'. Error code: %d\n", Path.c_str(), errno);
+        return false;
+    }
+    //the whole ring is allocated up front, disk usage does not change while the channel runs
+    if (posix_fallocate(Fd, 0, Bytes) && ftruncate(Fd, Bytes))
+    {
+        printf("Cannot allocate %lld bytes for timeshift ring '%s'\n", (long long)Bytes, Path.c_str());
+        close(Fd);
+        Fd = -1;
+        return false;
+    }
+    uint32_t capacity = (uint32_t)FFMAX(TIMESHIFT_MIN_ENTRIES, Bytes / TIMESHIFT_SEGMENT_FLOOR);
+    if (!Index.Open(Path + ".idx", capacity, Bytes))
+    {
+        close(Fd);
+        Fd = -1;
+        return false;
+    }
+    WriterThread = new boost::thread(&TimeshiftRing::WriterProc, this);
+    return true;
+}
+
+bool TimeshiftRing::OpenMuxer(AVStream* video, AVStream* audio)
+{
+    AVStream* streams[2] = {video, audio};
+    unsigned char* buffer = nullptr;
+    int ret;
+
+    if (avformat_alloc_output_context2(&TsCtx, NULL, "mpegts", NULL) < 0)
+        return false;
+    for (int i = 0; i < 2; i++)
+    {
+        if (!streams[i])
+            continue;
+        AVStream* st = avformat_new_stream(TsCtx, NULL);
+        if (!st || (avcodec_parameters_copy(st->codecpar, streams[i]->codecpar) < 0))
+        {
+            CloseMuxer();
+            return false;
+        }
+        st->codecpar->codec_tag = 0;
+        st->time_base = streams[i]->time_base;
+    }
+    buffer = (unsigned char*)av_malloc(32768);
+    if (!buffer || !(TsCtx->pb = avio_alloc_context(buffer, 32768, 1, &TsOut, NULL, WriteProc, NULL)))
+    {
+        av_free(buffer);
+        CloseMuxer();
+        return false;
+    }
+    TsCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    if ((ret = avformat_write_header(TsCtx, NULL)) < 0)
+    {
+        printf("Timeshift cannot write mpegts header. Error code: %d\n", ret);
+        CloseMuxer();
+        return false;
+    }
+    avio_flush(TsCtx->pb);
+    TsOut.clear();
+    return true;
+}
+
+void TimeshiftRing::CloseMuxer()
+{
+    if (!TsCtx)
+        return;
+    if (TsCtx->pb)
+    {
+        av_freep(&TsCtx->pb->buffer);
+        avio_context_free(&TsCtx->pb);
+    }
+    avformat_free_context(TsCtx);
+    TsCtx = nullptr;
+}
+
+bool TimeshiftRing::Open(AVStream* video, AVStream* audio)
+{
+    Close();
+    if (!video || (Bytes <= 0) || !OpenRing())
+        return false;
+    return OpenMuxer(video, audio);
+}
+
+void TimeshiftRing::Close()
+{
+    if (TsCtx && (SegmentPts != AV_NOPTS_VALUE))
+        FinishSegment();
+    CloseMuxer();
+    TsOut.clear();
+    SegmentPts = AV_NOPTS_VALUE;
+    LastPts = AV_NOPTS_VALUE;
+}
+
+void TimeshiftRing::FinishSegment()
+{
+    avio_flush(TsCtx->pb);
+    int64_t size = TsOut.size();
+    boost::mutex::scoped_lock lock(QueueLock);
+    if ((size == 0) || (size > Bytes) || (Queue.size() >= TIMESHIFT_QUEUE_SEGMENTS))
+    {
+        //a slow disk costs recorded segments, never the live output
+        if (size && (size <= Bytes))
+            QueueFull++;
+        Dropped++;
+        TsOut.clear();
+        return;
+    }
+    Queue.push_back(TimeshiftSegment());
+    TimeshiftSegment& segment = Queue.back();
+    segment.Data.swap(TsOut);
+    segment.Time = SegmentTime;
+    segment.Pts = SegmentPts;
+    segment.Duration = (LastPts != AV_NOPTS_VALUE) ? (int32_t)((LastPts - SegmentPts) / 90) : 0;
+    QueueCond.notify_all();
+}
+
+void TimeshiftRing::WriteSegment(TimeshiftSegment* segment)
+{
+    int64_t size = segment->Data.size();
+    TimeshiftEntry entry;
+    entry.Offset = Index.Reserve(size);
+    entry.Size = (int32_t)size;
+    entry.Time = segment->Time;
+    entry.Pts = segment->Pts;
+    entry.Duration = segment->Duration;
+    const uint8_t* data = &segment->Data[0];
+    int64_t done = 0;
+    while (done < size)
+    {
+        ssize_t ret = pwrite(Fd, data + done, size - done, entry.Offset + done);
+        if (ret <= 0)
+        {
+            printf("Cannot write timeshift ring '%s'. Error code: %d\n", Path.c_str(), errno);
+            boost::mutex::scoped_lock lock(QueueLock);
+            Dropped++;
+            return;
+        }
+        done += ret;
+    }
+    Index.Append(entry);
+    boost::mutex::scoped_lock lock(QueueLock);
+    WrittenBytes += size;
+}
+
+void TimeshiftRing::WriterProc()
+{
+    //the only thread that writes the ring and the index once it is open
+    boost::mutex::scoped_lock lock(QueueLock);
+    while (true)
+    {
+        while (Runing && Queue.empty())
+            QueueCond.wait(lock);
+        if (Queue.empty())
+            break;
+        TimeshiftSegment segment = std::move(Queue.front());
+        Queue.pop_front();
+        lock.unlock();
+        WriteSegment(&segment);
+        lock.lock();
+    }
+}
+
+void TimeshiftRing::WritePacket(AVPacket* pkt, AVRational time_base, bool video)
+{
+    if (!TsCtx)
+        return;
+    if (video && (pkt->pts != AV_NOPTS_VALUE))
+    {
+        int64_t pts = av_rescale_q(pkt->pts, time_base, av_make_q(1, 90000));
+        if (pkt->flags & AV_PKT_FLAG_KEY)
+        {
+            //the encoder runs closed GOPs, every keyframe starts a segment a player can begin with
+            if (SegmentPts != AV_NOPTS_VALUE)
+            {
+                LastPts = pts;
+                FinishSegment();
+            }
+            SegmentPts = pts;
+            SegmentTime = av_gettime() / 1000;
+            av_opt_set(TsCtx->priv_data, "mpegts_flags", "+resend_headers", 0);
+        }
+        LastPts = pts;
+    }
+    if (SegmentPts == AV_NOPTS_VALUE)
+        return;
+
+    int index = video ? 0 : 1;
+    AVPacket copy;
+    if ((unsigned int)index >= TsCtx->nb_streams)
+        return;
+    if (av_packet_ref(&copy, pkt) < 0)
+        return;
+    copy.stream_index = index;
+    if (copy.dts == AV_NOPTS_VALUE)
+        copy.dts = copy.pts;
+    av_packet_rescale_ts(&copy, time_base, TsCtx->streams[index]->time_base);
+    copy.pos = -1;
+    av_write_frame(TsCtx, &copy);
+    av_packet_unref(&copy);
+}
+
+void TimeshiftRing::Publish()
+{
+    if (Fd < 0)
+        return;
+    std::string label = Label + "," + Metrics::Label("timeshift", Path.c_str());
+    uint64_t head = Index.Head();
+    uint64_t tail = Index.Tail();
+    TimeshiftEntry oldest, newest;
+    double window = 0;
+    if ((head > tail) && Index.Get(tail, &oldest) && Index.Get(head - 1, &newest))
+        window = (newest.Time + newest.Duration - oldest.Time) / 1000.0;
+    Metrics::Set("timeshift_window_seconds", label, window);
+    Metrics::Set("timeshift_segments", label, head - tail);
+    boost::mutex::scoped_lock lock(QueueLock);
+    Metrics::Set("timeshift_written_bytes_total", label, WrittenBytes);
+    Metrics::Set("timeshift_dropped_segments_total", label, Dropped);
+    Metrics::Set("timeshift_queue_segments", label, Queue.size());
+    Metrics::Set("timeshift_queue_full_total", label, QueueFull);
+}
+
+int64_t TimeshiftRing::MemoryBytes(int* segments)
+{
+    boost::mutex::scoped_lock lock(QueueLock);
+    int64_t bytes = 0;
+    for (size_t i = 0; i < Queue.size(); i++)
+        bytes += Queue[i].Data.capacity();
+    *segments = Queue.size();
+    return bytes;
+}
+
+bool TimeshiftRing::Read(int fd, const TimeshiftIndex& index, const TimeshiftEntry& entry, std::vector<uint8_t>* data)
+{
+    data->resize(entry.Size);
+    int64_t done = 0;
+    while (done < entry.Size)
+    {
+        ssize_t ret = pread(fd, &(*data)[done], entry.Size - done, entry.Offset + done);
+        if (ret <= 0)
+            return false;
+        done += ret;
+    }
+    //a segment evicted during the read may hold bytes of its successor
+    return index.Valid(entry.Seq);
+}
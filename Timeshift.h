@@ -0,0 +1,121 @@
+#ifndef TIMESHIFT_H
+#define TIMESHIFT_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+//<ring>.idx starts with this header, followed by Capacity entries used as a circular array
+struct TimeshiftHeader
+{
+    char        Magic[8];
+    uint32_t    Version;
+    uint32_t    Capacity;
+    int64_t     RingBytes;
+    uint64_t    Head;           //segments ever written, segment n is entry n % Capacity
+    uint64_t    Tail;           //oldest segment still in the ring
+    int64_t     WriteOffset;    //where the next segment goes in the ring file
+};
+
+struct TimeshiftEntry
+{
+    uint64_t    Seq;
+    int64_t     Time;           //wall clock ms at the segment's keyframe
+    int64_t     Pts;            //90 kHz
+    int64_t     Offset;         //in the ring file
+    int32_t     Size;
+    int32_t     Duration;       //ms
+};
+
+//keyframe index of the ring, mapped shared so a player process can look up a time while the writer runs
+class TimeshiftIndex
+{
+    public:
+        TimeshiftIndex();
+        virtual ~TimeshiftIndex();
+
+        bool Open(const std::string& path, uint32_t capacity, int64_t ringbytes);
+        bool OpenRead(const std::string& path);
+        void Close();
+
+        bool Find(int64_t time, TimeshiftEntry* entry) const;
+        bool Get(uint64_t seq, TimeshiftEntry* entry) const;
+        bool Valid(uint64_t seq) const;
+        uint64_t Head() const;
+        uint64_t Tail() const;
+        int64_t RingBytes() const { return Header ? Header->RingBytes : 0; }
+
+        int64_t Reserve(int64_t size);
+        void Append(const TimeshiftEntry& entry);
+    private:
+        bool Map(bool writable);
+
+        int                 Fd;
+        size_t              MapSize;
+        TimeshiftHeader*    Header;
+        TimeshiftEntry*     Entries;
+};
+
+//a finished segment waiting for the ring writer thread
+struct TimeshiftSegment
+{
+    std::vector<uint8_t> Data;
+    int64_t     Time;
+    int64_t     Pts;
+    int32_t     Duration;
+};
+
+//records the encoder output into a fixed size ring file, one closed GOP per mpegts segment.
+//segments are muxed on the caller's thread and written to the ring on a writer thread
+class TimeshiftRing
+{
+    public:
+        TimeshiftRing(const char* path, int64_t bytes, const std::string& label);
+        virtual ~TimeshiftRing();
+
+        bool Open(AVStream* video, AVStream* audio);
+        void Close();
+        void WritePacket(AVPacket* pkt, AVRational time_base, bool video);
+        void Publish();
+        int64_t MemoryBytes(int* segments);
+
+        static bool Read(int fd, const TimeshiftIndex& index, const TimeshiftEntry& entry, std::vector<uint8_t>* data);
+    protected:
+        bool OpenRing();
+        bool OpenMuxer(AVStream* video, AVStream* audio);
+        void CloseMuxer();
+        void FinishSegment();
+        void WriteSegment(TimeshiftSegment* segment);
+        void WriterProc();
+        static int WriteProc(void* opaque, uint8_t* buf, int size);
+    private:
+        std::string         Path;
+        int64_t             Bytes;
+        std::string         Label;
+        int                 Fd;
+        TimeshiftIndex      Index;
+
+        AVFormatContext*    TsCtx;
+        std::vector<uint8_t> TsOut;
+        int64_t             SegmentPts;
+        int64_t             SegmentTime;
+        int64_t             LastPts;
+
+        boost::mutex        QueueLock;
+        boost::condition_variable QueueCond;
+        std::deque<TimeshiftSegment> Queue;
+        bool                Runing;
+        boost::thread*      WriterThread;
+
+        uint64_t            WrittenBytes;
+        uint64_t            Dropped;
+        uint64_t            QueueFull;      //segments dropped because the writer fell behind
+};
+
+#endif // TIMESHIFT_H
@@ -0,0 +1,290 @@
+#include "UdpInput.h"
+#include "UdpUrl.h"
+#include "Metrics.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+extern "C"
+{
+    #include <libavutil/time.h>
+}
+
+#define UDP_SLOT_SIZE       1536
+#define UDP_RING_SLOTS      8192    //about 80 Mbit of 7x188 datagrams, seconds of a contribution feed
+#define UDP_BATCH           64
+#define UDP_READ_SIZE       65536
+#define UDP_STALL_TIMEOUT   5000000
+#define TS_PACKET_SIZE      188
+
+UdpInput::UdpInput(const char* url, int jitterms, const std::string& label)
+    : Url(url)
+    , Label(label)
+    , Jitter((int64_t)jitterms * 1000)
+    , Runing(false)
+    , Sock(-1)
+    , AvioCtx(nullptr)
+    , Head(0)
+    , Tail(0)
+    , ReadOffset(0)
+    , Datagrams(0)
+    , Overruns(0)
+    , CcErrors(0)
+    , SyncErrors(0)
+    , LastPublish(0)
+    , ReceiveThread(nullptr)
+{
+    Interrupt.callback = nullptr;
+    Interrupt.opaque = nullptr;
+    memset(LastCC, -1, sizeof(LastCC));
+}
+
+UdpInput::~UdpInput()
+{
+    {
+        boost::mutex::scoped_lock lock(Lock);
+        Runing = false;
+    }
+    Cond.notify_all();
+    if (ReceiveThread)
+    {
+        ReceiveThread->join();
+        delete ReceiveThread;
+    }
+    if (Sock >= 0)
+        close(Sock);
+    if (AvioCtx)
+    {
+        av_freep(&AvioCtx->buffer);
+        avio_context_free(&AvioCtx);
+    }
+    Metrics::Remove(Label + "," + Metrics::Label("input", "udp"));
+}
+
+bool UdpInput::OpenSocket()
+{
+    //udp://[@]host:port[?localaddr=ip&buffer_size=bytes]
+    std::string hostport = Url.substr(6, Url.find('?') == std::string::npos ? std::string::npos : Url.find('?') - 6);
+    if (!hostport.empty() && (hostport[0] == '@'))
+        hostport.erase(0, 1);
+    size_t colon = hostport.rfind(':');
+    if (colon == std::string::npos)
+    {
+        printf("Udp input '%s' has no port\n", Url.c_str());
+        return false;
+    }
+    std::string host = hostport.substr(0, colon);
+    int port = atoi(hostport.c_str() + colon + 1);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (!host.empty() && (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1))
+    {
+        printf("Udp input '%s' has an invalid address\n", Url.c_str());
+        return false;
+    }
+    bool multicast = IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+
+    Sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (Sock < 0)
+        return false;
+    int on = 1;
+    setsockopt(Sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    std::string buffersize = UdpUrl::Option(Url, "buffer_size");
+    int rcvbuf = buffersize.empty() ? 8 * 1024 * 1024 : atoi(buffersize.c_str());
+    setsockopt(Sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (bind(Sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        printf("Udp input cannot bind '%s'. Error code: %d\n", Url.c_str(), errno);
+        return false;
+    }
+    if (multicast)
+    {
+        struct ip_mreq mreq;
+        std::string localaddr = UdpUrl::Option(Url, "localaddr");
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (!localaddr.empty())
+            inet_pton(AF_INET, localaddr.c_str(), &mreq.imr_interface);
+        if (setsockopt(Sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        {
+            printf("Udp input cannot join '%s'. Error code: %d\n", Url.c_str(), errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UdpInput::Open(const AVIOInterruptCB* interrupt)
+{
+    if (interrupt)
+        Interrupt = *interrupt;
+    if (!OpenSocket())
+        return false;
+
+    Ring.resize((size_t)UDP_RING_SLOTS * UDP_SLOT_SIZE);
+    Slots.resize(UDP_RING_SLOTS);
+    unsigned char* buffer = (unsigned char*)av_malloc(UDP_READ_SIZE);
+    if (!buffer || !(AvioCtx = avio_alloc_context(buffer, UDP_READ_SIZE, 0, this, ReadProc, NULL, NULL)))
+    {
+        av_free(buffer);
+        return false;
+    }
+    AvioCtx->seekable = 0;
+
+    Runing = true;
+    ReceiveThread = new boost::thread(&UdpInput::ReceiveProc, this);
+    return true;
+}
+
+void UdpInput::ReceiveProc()
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    while (Runing)
+    {
+        struct pollfd pfd = {Sock, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            Publish();
+            continue;
+        }
+
+        uint64_t head;
+        {
+            //keep the newest data, the demuxer resyncs on its own after a gap
+            boost::mutex::scoped_lock lock(Lock);
+            uint64_t used = Head - Tail;
+            if (used + UDP_BATCH > UDP_RING_SLOTS)
+            {
+                uint64_t drop = used + UDP_BATCH - UDP_RING_SLOTS;
+                Tail += drop;
+                Overruns += drop;
+                ReadOffset = 0;
+            }
+            head = Head;
+        }
+
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++)
+        {
+            iovs[i].iov_base = &Ring[((head + i) % UDP_RING_SLOTS) * UDP_SLOT_SIZE];
+            iovs[i].iov_len = UDP_SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = recvmmsg(Sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (count <= 0)
+            continue;
+
+        int64_t now = av_gettime_relative();
+        for (int i = 0; i < count; i++)
+        {
+            UdpSlot& slot = Slots[(head + i) % UDP_RING_SLOTS];
+            slot.Size = msgs[i].msg_len;
+            slot.Arrival = now;
+            CheckContinuity((const uint8_t*)iovs[i].iov_base, slot.Size);
+        }
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            Head = head + count;
+            Datagrams += count;
+        }
+        Cond.notify_one();
+        Publish();
+    }
+}
+
+void UdpInput::CheckContinuity(const uint8_t* data, int size)
+{
+    if (size % TS_PACKET_SIZE)
+        SyncErrors++;
+    for (int pos = 0; pos + TS_PACKET_SIZE <= size; pos += TS_PACKET_SIZE)
+    {
+        const uint8_t* ts = data + pos;
+        if (ts[0] != 0x47)
+        {
+            SyncErrors++;
+            return;
+        }
+        int pid = ((ts[1] & 0x1f) << 8) | ts[2];
+        int afc = (ts[3] >> 4) & 3;
+        int cc = ts[3] & 0x0f;
+        if (pid == 0x1fff)
+            continue;
+        if ((afc & 2) && (ts[4] > 0) && (ts[5] & 0x80))
+            LastCC[pid] = -1; //discontinuity_indicator
+        if (!(afc & 1))
+            continue;
+        //one duplicate packet is allowed by the standard
+        if ((LastCC[pid] >= 0) && (cc != ((LastCC[pid] + 1) & 0x0f)) && (cc != LastCC[pid]))
+            CcErrors++;
+        LastCC[pid] = cc;
+    }
+}
+
+void UdpInput::Publish()
+{
+    int64_t now = av_gettime_relative();
+    if (now - LastPublish < 1000000)
+        return;
+    LastPublish = now;
+    std::string label = Label + "," + Metrics::Label("input", "udp");
+    boost::mutex::scoped_lock lock(Lock);
+    Metrics::Set("udp_ingest_datagrams_total", label, Datagrams);
+    Metrics::Set("udp_ingest_overruns_total", label, Overruns);
+    Metrics::Set("udp_ingest_cc_errors_total", label, CcErrors);
+    Metrics::Set("udp_ingest_sync_errors_total", label, SyncErrors);
+    Metrics::Set("udp_ingest_buffered_datagrams", label, Head - Tail);
+}
+
+int UdpInput::ReadProc(void* opaque, uint8_t* buf, int size)
+{
+    UdpInput* obj = (UdpInput*)opaque;
+    int64_t waitstart = av_gettime_relative();
+    int done = 0;
+    boost::mutex::scoped_lock lock(obj->Lock);
+    while (true)
+    {
+        if (obj->Interrupt.callback && obj->Interrupt.callback(obj->Interrupt.opaque))
+            return AVERROR_EXIT;
+        if (!obj->Runing)
+            return AVERROR_EOF;
+        int64_t now = av_gettime_relative();
+        if (obj->Tail < obj->Head)
+        {
+            int64_t release = obj->Slots[obj->Tail % UDP_RING_SLOTS].Arrival + obj->Jitter;
+            if (release <= now)
+                break;
+            obj->Cond.timed_wait(lock, boost::posix_time::microseconds(FFMIN(release - now, 100000)));
+        }
+        else
+        {
+            if (now - waitstart > UDP_STALL_TIMEOUT)
+                return AVERROR_EOF;
+            obj->Cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+        }
+    }
+
+    int64_t now = av_gettime_relative();
+    while ((done < size) && (obj->Tail < obj->Head))
+    {
+        UdpSlot& slot = obj->Slots[obj->Tail % UDP_RING_SLOTS];
+        if (slot.Arrival + obj->Jitter > now)
+            break;
+        int len = FFMIN(size - done, slot.Size - obj->ReadOffset);
+        memcpy(buf + done, &obj->Ring[(obj->Tail % UDP_RING_SLOTS) * UDP_SLOT_SIZE + obj->ReadOffset], len);
+        done += len;
+        obj->ReadOffset += len;
+        if (obj->ReadOffset >= slot.Size)
+        {
+            obj->Tail++;
+            obj->ReadOffset = 0;
+        }
+    }
+    return done;
+}
@@ -0,0 +1,63 @@
+#ifndef UDPINPUT_H
+#define UDPINPUT_H
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+struct UdpSlot
+{
+    int         Size;
+    int64_t     Arrival;
+};
+
+//receives udp:// MPEG-TS with recvmmsg into a preallocated ring on its own thread,
+//checks continuity counters and hands datagrams to the demuxer after a fixed jitter delay
+class UdpInput
+{
+    public:
+        UdpInput(const char* url, int jitterms, const std::string& label);
+        virtual ~UdpInput();
+
+        bool Open(const AVIOInterruptCB* interrupt);
+        AVIOContext* Context() { return AvioCtx; }
+        int64_t MemoryBytes() const { return Ring.size() + Slots.size() * sizeof(UdpSlot); }
+    protected:
+        bool OpenSocket();
+        void ReceiveProc();
+        void CheckContinuity(const uint8_t* data, int size);
+        void Publish();
+        static int ReadProc(void* opaque, uint8_t* buf, int size);
+    private:
+        std::string         Url;
+        std::string         Label;
+        int64_t             Jitter;
+        bool                Runing;
+        int                 Sock;
+        AVIOInterruptCB     Interrupt;
+        AVIOContext*        AvioCtx;
+
+        boost::mutex        Lock;
+        boost::condition_variable Cond;
+        std::vector<uint8_t> Ring;
+        std::vector<UdpSlot> Slots;
+        uint64_t            Head;   //next slot the receiver fills
+        uint64_t            Tail;   //next slot the demuxer reads
+        int                 ReadOffset;
+
+        int8_t              LastCC[8192];
+        uint64_t            Datagrams;
+        uint64_t            Overruns;
+        uint64_t            CcErrors;
+        uint64_t            SyncErrors;
+        int64_t             LastPublish;
+
+        boost::thread*      ReceiveThread;
+};
+
+#endif // UDPINPUT_H
@@ -0,0 +1,250 @@
+//captures a udp MPEG-TS stream and prints its pacing once a second:
+//rate, datagrams, inter-arrival jitter, the largest burst within 1ms and continuity errors.
+//--send plays the other side: a paced synthetic stream with optional gaps, so udp ingest
+//can be checked over loopback against the udp_ingest_* metrics
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MEASURE_BATCH   64
+#define MEASURE_SLOT    2048
+
+struct MeasureStats
+{
+    uint64_t    Datagrams;
+    uint64_t    Bytes;
+    uint64_t    CcErrors;
+    uint64_t    SizeErrors;
+    double      GapSum;
+    double      GapSquareSum;
+    int64_t     GapMax;
+    int         BurstMax;
+};
+
+static int64_t timespec_us(const struct timespec* ts)
+{
+    return (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void parse_address(const char* text, struct sockaddr_in* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_ANY);
+    const char* colon = strrchr(text, ':');
+    if (colon)
+    {
+        char group[64];
+        snprintf(group, sizeof(group), "%.*s", (int)(colon - text), text);
+        inet_pton(AF_INET, group, &addr->sin_addr);
+        addr->sin_port = htons(atoi(colon + 1));
+    }
+    else
+    {
+        addr->sin_port = htons(atoi(text));
+    }
+}
+
+static int send_main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s --send <host:port> <mbit/s> [seconds] [drop every Nth datagram]\n", argv[0]);
+        return 1;
+    }
+    struct sockaddr_in addr;
+    parse_address(argv[2], &addr);
+    double rate = atof(argv[3]) * 1000000;
+    int seconds = (argc > 4) ? atoi(argv[4]) : 10;
+    int dropevery = (argc > 5) ? atoi(argv[5]) : 0;
+    if ((rate <= 0) || (seconds <= 0))
+    {
+        fprintf(stderr, "Rate and duration must be positive\n");
+        return 1;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if ((sock < 0) || (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0))
+    {
+        fprintf(stderr, "Cannot send to %s\n", argv[2]);
+        return 1;
+    }
+    //7 packets of a single PID with a running continuity counter, a skipped datagram is one cc error downstream
+    uint8_t datagram[7 * 188];
+    int cc = 0;
+    int64_t interval = (int64_t)(sizeof(datagram) * 8 * 1000000000.0 / rate);
+    int64_t total = (int64_t)seconds * 1000000000 / interval;
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int64_t n = 0; n < total; n++)
+    {
+        for (int i = 0; i < 7; i++)
+        {
+            uint8_t* ts = datagram + i * 188;
+            ts[0] = 0x47;
+            ts[1] = 0x01;
+            ts[2] = 0x00;
+            ts[3] = 0x10 | cc;
+            memset(ts + 4, (uint8_t)n, 184);
+            cc = (cc + 1) & 0x0f;
+        }
+        if ((dropevery > 0) && (n % dropevery == dropevery - 1))
+            dropped++;
+        else if (send(sock, datagram, sizeof(datagram), 0) == (ssize_t)sizeof(datagram))
+            sent++;
+        next.tv_nsec += interval;
+        while (next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    close(sock);
+    printf("sent %llu datagrams, skipped %llu (expect as many cc errors)\n", (unsigned long long)sent, (unsigned long long)dropped);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc > 1) && !strcmp(argv[1], "--send"))
+        return send_main(argc, argv);
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <port | group:port> [seconds]\n"
+                        "       %s --send <host:port> <mbit/s> [seconds] [drop every Nth datagram]\n", argv[0], argv[0]);
+        return 1;
+    }
+    struct sockaddr_in addr;
+    parse_address(argv[1], &addr);
+    int seconds = (argc > 2) ? atoi(argv[2]) : 0;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int on = 1;
+    int rcvbuf = 8 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Cannot bind %s\n", argv[1]);
+        return 1;
+    }
+    if (IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+    {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+
+    static uint8_t data[MEASURE_BATCH][MEASURE_SLOT];
+    static char control[MEASURE_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    struct mmsghdr msgs[MEASURE_BATCH];
+    struct iovec iovs[MEASURE_BATCH];
+    int8_t lastcc[8192];
+    memset(lastcc, -1, sizeof(lastcc));
+
+    MeasureStats stats;
+    memset(&stats, 0, sizeof(stats));
+    int64_t burstwindow[MEASURE_BATCH * 4];
+    int burstcount = 0;
+    int64_t lastarrival = -1;
+    int64_t periodstart = -1;
+    int periods = 0;
+    while ((seconds == 0) || (periods < seconds))
+    {
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        for (int i = 0; i < MEASURE_BATCH; i++)
+        {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            iovs[i].iov_base = data[i];
+            iovs[i].iov_len = MEASURE_SLOT;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+        int count = recvmmsg(sock, msgs, MEASURE_BATCH, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < count; i++)
+        {
+            //kernel arrival time, batching in this tool must not hide the sender's bursts
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+            {
+                if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMPNS))
+                    memcpy(&now, CMSG_DATA(cmsg), sizeof(now));
+            }
+            int64_t arrival = timespec_us(&now);
+            if (periodstart < 0)
+                periodstart = arrival;
+
+            if (arrival - periodstart >= 1000000)
+            {
+                double gaps = stats.Datagrams > 1 ? stats.Datagrams - 1 : 1;
+                double mean = stats.GapSum / gaps;
+                double deviation = sqrt(fmax(stats.GapSquareSum / gaps - mean * mean, 0));
+                printf("%.3f Mbit/s  %llu datagrams  gap mean %.0fus dev %.0fus max %lldus  burst/ms %d  cc errors %llu  size errors %llu\n"
+                       , stats.Bytes * 8 / 1000000.0, (unsigned long long)stats.Datagrams, mean, deviation
+                       , (long long)stats.GapMax, stats.BurstMax, (unsigned long long)stats.CcErrors, (unsigned long long)stats.SizeErrors);
+                fflush(stdout);
+                memset(&stats, 0, sizeof(stats));
+                periodstart = arrival;
+                periods++;
+            }
+
+            stats.Datagrams++;
+            stats.Bytes += msgs[i].msg_len;
+            if (lastarrival >= 0)
+            {
+                int64_t gap = arrival - lastarrival;
+                stats.GapSum += gap;
+                stats.GapSquareSum += (double)gap * gap;
+                if (gap > stats.GapMax)
+                    stats.GapMax = gap;
+            }
+            lastarrival = arrival;
+
+            int keep = 0;
+            for (int j = 0; j < burstcount; j++)
+            {
+                if (arrival - burstwindow[j] < 1000)
+                    burstwindow[keep++] = burstwindow[j];
+            }
+            burstcount = keep;
+            if (burstcount < (int)(sizeof(burstwindow) / sizeof(burstwindow[0])))
+                burstwindow[burstcount++] = arrival;
+            if (burstcount > stats.BurstMax)
+                stats.BurstMax = burstcount;
+
+            if (msgs[i].msg_len % 188)
+                stats.SizeErrors++;
+            for (unsigned int pos = 0; pos + 188 <= msgs[i].msg_len; pos += 188)
+            {
+                const uint8_t* ts = data[i] + pos;
+                int pid = ((ts[1] & 0x1f) << 8) | ts[2];
+                int cc = ts[3] & 0x0f;
+                if ((ts[0] != 0x47) || (pid == 0x1fff) || !(ts[3] & 0x10))
+                    continue;
+                if ((lastcc[pid] >= 0) && (cc != ((lastcc[pid] + 1) & 0x0f)) && (cc != lastcc[pid]))
+                    stats.CcErrors++;
+                lastcc[pid] = cc;
+            }
+        }
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include "UdpOutput.h"
+#include "UdpUrl.h"
+#include "Metrics.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+extern "C"
+{
+    #include <libavutil/time.h>
+}
+
+#define TS_PACKET_SIZE      188
+#define UDP_DATAGRAM_SIZE   (TS_PACKET_SIZE * 7)
+#define UDP_RING_DATAGRAMS  4096
+#define UDP_SEND_BATCH      8       //token bucket depth, the largest burst a switch sees
+#define UDP_PRIME_DELAY     60000   //us of data queued before sending starts or resumes after an underrun
+#define UDP_TARGET_DELAY    200000  //queue above this many us of data is drained faster
+#define UDP_WRITE_TIMEOUT   1000000
+
+UdpOutput::UdpOutput(const char* url, int bitrate, const std::string& label)
+    : Url(url)
+    , Label(label)
+    , ByteRate(bitrate / 8.0)
+    , FixedRate(bitrate > 0)
+    , Runing(false)
+    , Sock(-1)
+    , AvioCtx(nullptr)
+    , Head(0)
+    , Tail(0)
+    , Fill(0)
+    , PcrPid(-1)
+    , LastPcr(-1)
+    , PcrBytes(0)
+    , QueuedBytes(0)
+    , Primed(false)
+    , Datagrams(0)
+    , Syscalls(0)
+    , Drops(0)
+    , LastPublish(0)
+    , SendThread(nullptr)
+{
+}
+
+UdpOutput::~UdpOutput()
+{
+    if (SendThread)
+    {
+        {
+            //complete the last datagram with null packets so the trailer goes out too
+            boost::mutex::scoped_lock lock(Lock);
+            if (Fill > 0)
+            {
+                uint8_t* datagram = &Ring[(Head % UDP_RING_DATAGRAMS) * UDP_DATAGRAM_SIZE];
+                for (int pos = Fill - Fill % TS_PACKET_SIZE; pos < UDP_DATAGRAM_SIZE; pos += TS_PACKET_SIZE)
+                {
+                    static const uint8_t nullhead[4] = {0x47, 0x1f, 0xff, 0x10};
+                    memcpy(datagram + pos, nullhead, sizeof(nullhead));
+                    memset(datagram + pos + sizeof(nullhead), 0xff, TS_PACKET_SIZE - sizeof(nullhead));
+                }
+                Head++;
+                Fill = 0;
+                QueuedBytes += UDP_DATAGRAM_SIZE;
+            }
+        }
+        Cond.notify_all();
+        //let the sender drain what the trailer wrote
+        int64_t start = av_gettime_relative();
+        while (true)
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            if ((Tail == Head) || (av_gettime_relative() - start > UDP_WRITE_TIMEOUT))
+                break;
+            Cond.timed_wait(lock, boost::posix_time::milliseconds(10));
+        }
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            Runing = false;
+        }
+        Cond.notify_all();
+        SendThread->join();
+        delete SendThread;
+    }
+    if (Sock >= 0)
+        close(Sock);
+    if (AvioCtx)
+    {
+        av_freep(&AvioCtx->buffer);
+        avio_context_free(&AvioCtx);
+    }
+    Metrics::Remove(Label + "," + Metrics::Label("output", "udp"));
+}
+
+bool UdpOutput::OpenSocket()
+{
+    //udp://host:port[?localaddr=ip&ttl=n]
+    std::string hostport = Url.substr(6, Url.find('?') == std::string::npos ? std::string::npos : Url.find('?') - 6);
+    size_t colon = hostport.rfind(':');
+    if (colon == std::string::npos)
+    {
+        printf("Udp output '%s' has no port\n", Url.c_str());
+        return false;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(hostport.c_str() + colon + 1));
+    if (inet_pton(AF_INET, hostport.substr(0, colon).c_str(), &addr.sin_addr) != 1)
+    {
+        printf("Udp output '%s' has an invalid address\n", Url.c_str());
+        return false;
+    }
+
+    Sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (Sock < 0)
+        return false;
+    int sndbuf = 4 * 1024 * 1024;
+    setsockopt(Sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    if (IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+    {
+        std::string ttl = UdpUrl::Option(Url, "ttl");
+        std::string localaddr = UdpUrl::Option(Url, "localaddr");
+        int hops = ttl.empty() ? 16 : atoi(ttl.c_str());
+        setsockopt(Sock, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+        if (!localaddr.empty())
+        {
+            struct in_addr iface;
+            if (inet_pton(AF_INET, localaddr.c_str(), &iface) == 1)
+                setsockopt(Sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface));
+        }
+    }
+    if (connect(Sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        printf("Udp output cannot connect '%s'. Error code: %d\n", Url.c_str(), errno);
+        return false;
+    }
+    return true;
+}
+
+bool UdpOutput::Open()
+{
+    if (!OpenSocket())
+        return false;
+
+    Ring.resize((size_t)UDP_RING_DATAGRAMS * UDP_DATAGRAM_SIZE);
+    unsigned char* buffer = (unsigned char*)av_malloc(UDP_DATAGRAM_SIZE * 8);
+    if (!buffer || !(AvioCtx = avio_alloc_context(buffer, UDP_DATAGRAM_SIZE * 8, 1, this, NULL, WriteProc, NULL)))
+    {
+        av_free(buffer);
+        return false;
+    }
+    AvioCtx->seekable = 0;
+
+    Runing = true;
+    SendThread = new boost::thread(&UdpOutput::SendProc, this);
+    return true;
+}
+
+void UdpOutput::TrackPcr(const uint8_t* ts, int size)
+{
+    //the mux rate between two PCRs of the same PID is what the receiver's clock expects
+    for (int pos = 0; pos + TS_PACKET_SIZE <= size; pos += TS_PACKET_SIZE, ts += TS_PACKET_SIZE)
+    {
+        PcrBytes += TS_PACKET_SIZE;
+        if ((ts[0] != 0x47) || !(ts[3] & 0x20) || (ts[4] < 7) || !(ts[5] & 0x10))
+            continue;
+        int pid = ((ts[1] & 0x1f) << 8) | ts[2];
+        if (PcrPid < 0)
+            PcrPid = pid;
+        if (pid != PcrPid)
+            continue;
+        int64_t pcr = (((int64_t)ts[6] << 25) | (ts[7] << 17) | (ts[8] << 9) | (ts[9] << 1) | (ts[10] >> 7)) * 300
+                      + (((ts[10] & 0x01) << 8) | ts[11]);
+        if (LastPcr >= 0)
+        {
+            int64_t delta = pcr - LastPcr;
+            if ((delta <= 0) || (delta > 27000000LL * 2))
+            {
+                //wrap or discontinuity, start measuring again
+                LastPcr = pcr;
+                PcrBytes = 0;
+                continue;
+            }
+            if (delta < 2700000) //measure over at least 100ms
+                continue;
+            double rate = (PcrBytes - TS_PACKET_SIZE) * 27000000.0 / delta;
+            if (!FixedRate)
+                ByteRate = (ByteRate > 0) ? ByteRate * 0.8 + rate * 0.2 : rate;
+        }
+        LastPcr = pcr;
+        PcrBytes = TS_PACKET_SIZE;
+    }
+}
+
+int UdpOutput::WriteProc(void* opaque, uint8_t* buf, int size)
+{
+    UdpOutput* obj = (UdpOutput*)opaque;
+    int done = 0;
+    boost::mutex::scoped_lock lock(obj->Lock);
+    while (done < size)
+    {
+        if (obj->Head - obj->Tail >= UDP_RING_DATAGRAMS - 1)
+        {
+            //the sender is behind the muxer, wait a little then give up on this write
+            if (!obj->Cond.timed_wait(lock, boost::posix_time::microseconds(UDP_WRITE_TIMEOUT))
+                && (obj->Head - obj->Tail >= UDP_RING_DATAGRAMS - 1))
+            {
+                obj->Drops += (size - done + UDP_DATAGRAM_SIZE - 1) / UDP_DATAGRAM_SIZE;
+                return size;
+            }
+            continue;
+        }
+        uint8_t* datagram = &obj->Ring[(obj->Head % UDP_RING_DATAGRAMS) * UDP_DATAGRAM_SIZE];
+        int len = FFMIN(size - done, UDP_DATAGRAM_SIZE - obj->Fill);
+        memcpy(datagram + obj->Fill, buf + done, len);
+        obj->Fill += len;
+        done += len;
+        if (obj->Fill == UDP_DATAGRAM_SIZE)
+        {
+            obj->TrackPcr(datagram, UDP_DATAGRAM_SIZE);
+            obj->Head++;
+            obj->Fill = 0;
+            obj->QueuedBytes += UDP_DATAGRAM_SIZE;
+            obj->Cond.notify_all();
+        }
+    }
+    return size;
+}
+
+void UdpOutput::SendProc()
+{
+    struct mmsghdr msgs[UDP_SEND_BATCH];
+    struct iovec iovs[UDP_SEND_BATCH];
+    double tokens = 0;
+    int64_t last = av_gettime_relative();
+    while (true)
+    {
+        uint64_t tail;
+        int count;
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            if (Tail == Head)
+                Primed = false;
+            while (Runing && (Tail == Head))
+                Cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+            if ((Tail == Head) || !Runing)
+                break;
+
+            int64_t now = av_gettime_relative();
+            double rate = ByteRate;
+            if ((rate > 0) && !Primed)
+            {
+                //the muxer writes a frame at a time, start with some lead so the pace does not run dry between frames
+                if (QueuedBytes < rate * UDP_PRIME_DELAY / 1000000.0)
+                {
+                    Cond.timed_wait(lock, boost::posix_time::milliseconds(10));
+                    continue;
+                }
+                Primed = true;
+                tokens = 0;
+                last = now;
+            }
+            if (rate > 0)
+            {
+                //a queue deeper than the target delay means the rate is underestimated, drain the surplus
+                double surplus = QueuedBytes - rate * UDP_TARGET_DELAY / 1000000.0;
+                if (surplus > 0)
+                    rate += surplus * 1000000.0 / UDP_TARGET_DELAY;
+                tokens = FFMIN(tokens + rate * (now - last) / 1000000.0, (double)UDP_SEND_BATCH * UDP_DATAGRAM_SIZE);
+            }
+            else
+            {
+                //no rate known yet, send as it comes until the first PCR interval is measured
+                tokens = (double)UDP_SEND_BATCH * UDP_DATAGRAM_SIZE;
+            }
+            last = now;
+            count = FFMIN((int)(tokens / UDP_DATAGRAM_SIZE), (int)FFMIN(Head - Tail, (uint64_t)UDP_SEND_BATCH));
+            if (count == 0)
+            {
+                int64_t wait = (int64_t)((UDP_DATAGRAM_SIZE - tokens) * 1000000.0 / rate);
+                lock.unlock();
+                av_usleep(FFMAX(wait, 100));
+                continue;
+            }
+            tail = Tail;
+        }
+
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < count; i++)
+        {
+            iovs[i].iov_base = &Ring[((tail + i) % UDP_RING_DATAGRAMS) * UDP_DATAGRAM_SIZE];
+            iovs[i].iov_len = UDP_DATAGRAM_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int sent = sendmmsg(Sock, msgs, count, 0);
+        if (sent < 0)
+        {
+            //ECONNREFUSED from an unicast receiver that went away, drop and keep the pace
+            sent = count;
+            Drops += count;
+        }
+        {
+            boost::mutex::scoped_lock lock(Lock);
+            Tail += sent;
+            QueuedBytes -= (uint64_t)sent * UDP_DATAGRAM_SIZE;
+            Datagrams += sent;
+            Syscalls++;
+        }
+        tokens -= sent * UDP_DATAGRAM_SIZE;
+        Cond.notify_all();
+        Publish();
+    }
+}
+
+void UdpOutput::Publish()
+{
+    int64_t now = av_gettime_relative();
+    if (now - LastPublish < 1000000)
+        return;
+    LastPublish = now;
+    std::string label = Label + "," + Metrics::Label("output", "udp");
+    boost::mutex::scoped_lock lock(Lock);
+    Metrics::Set("udp_output_datagrams_total", label, Datagrams);
+    Metrics::Set("udp_output_syscalls_total", label, Syscalls);
+    Metrics::Set("udp_output_drops_total", label, Drops);
+    Metrics::Set("udp_output_rate_bps", label, ByteRate * 8);
+    Metrics::Set("udp_output_queued_bytes", label, QueuedBytes);
+}
@@ -0,0 +1,60 @@
+#ifndef UDPOUTPUT_H
+#define UDPOUTPUT_H
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+//sends the muxed MPEG-TS as 7x188 byte datagrams, paced by a token bucket at the
+//configured mux rate (or the rate measured from the PCR) in sendmmsg batches
+class UdpOutput
+{
+    public:
+        UdpOutput(const char* url, int bitrate, const std::string& label);
+        virtual ~UdpOutput();
+
+        bool Open();
+        AVIOContext* Context() { return AvioCtx; }
+        int64_t MemoryBytes() const { return Ring.size(); }
+    protected:
+        bool OpenSocket();
+        void SendProc();
+        void TrackPcr(const uint8_t* data, int size);
+        void Publish();
+        static int WriteProc(void* opaque, uint8_t* buf, int size);
+    private:
+        std::string         Url;
+        std::string         Label;
+        double              ByteRate;   //bytes per second, 0 until configured or measured
+        bool                FixedRate;
+        bool                Runing;
+        int                 Sock;
+        AVIOContext*        AvioCtx;
+
+        boost::mutex        Lock;
+        boost::condition_variable Cond;
+        std::vector<uint8_t> Ring;
+        uint64_t            Head;       //next datagram the muxer fills
+        uint64_t            Tail;       //next datagram the sender sends
+        int                 Fill;       //bytes already in the datagram at Head
+
+        int                 PcrPid;
+        int64_t             LastPcr;
+        uint64_t            PcrBytes;
+        uint64_t            QueuedBytes;
+        bool                Primed;
+
+        uint64_t            Datagrams;
+        uint64_t            Syscalls;
+        uint64_t            Drops;
+        int64_t             LastPublish;
+
+        boost::thread*      SendThread;
+};
+
+#endif // UDPOUTPUT_H
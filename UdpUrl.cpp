@@ -0,0 +1,20 @@
+#include "UdpUrl.h"
+
+std::string UdpUrl::Option(const std::string& url, const char* key)
+{
+    size_t query = url.find('?');
+    if (query == std::string::npos)
+        return "";
+    std::string pattern = std::string(key) + "=";
+    size_t pos = query;
+    while ((pos = url.find(pattern, pos + 1)) != std::string::npos)
+    {
+        char prev = url[pos - 1];
+        if ((prev == '?') || (prev == '&'))
+        {
+            size_t end = url.find('&', pos);
+            return url.substr(pos + pattern.size(), end == std::string::npos ? std::string::npos : end - pos - pattern.size());
+        }
+    }
+    return "";
+}
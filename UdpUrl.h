@@ -0,0 +1,13 @@
+#ifndef UDPURL_H
+#define UDPURL_H
+
+#include <string>
+
+//query options of udp://host:port?key=value&... urls, shared by UdpInput and UdpOutput
+class UdpUrl
+{
+    public:
+        static std::string Option(const std::string& url, const char* key);
+};
+
+#endif // UDPURL_H
@@ -1,9 +1,322 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 #include "QSVTranscode.h"
+#include "MosaicTranscode.h"
+#include "MptsDemux.h"
+#include "EncoderTuner.h"
+#include "Timeshift.h"
+#include "CapacityModel.h"
+#include "Metrics.h"
 
+//sessions the hardware has no room for are moved to this encoder
+#define CPU_ENCODER "libx264"
+
+static volatile sig_atomic_t Stopping = 0;
+
+static void stop_handler(int)
+{
+    Stopping = 1;
+}
+
+static void wait_stop()
+{
+    //runs until ctrl+c or a kill, then the caller tears the sessions down and the outputs get their trailers
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    while (!Stopping)
+    {
+        av_usleep(100000);
+    }
+}
+
+static int mosaic_main(int argc, char **argv)
+{
+    MosaicInfo mosaicinfo;
+    if ((argc < 7) || (sscanf(argv[2], "%dx%d", &mosaicinfo.Columns, &mosaicinfo.Rows) != 2))
+    {
+        fprintf(stderr, "Usage: %s --mosaic <cols>x<rows> <encode codec> <output file> <output type> <input 1> [input 2 ...]\n", argv[0]);
+        return -1;
+    }
+    OutputInfo videoinfo;
+    videoinfo.VideoWidth = 1920;
+    videoinfo.VideoHeight = 1080;
+    videoinfo.VideoBitrate = 4000000;
+    videoinfo.VideoProfile = FF_PROFILE_H264_HIGH;
+    videoinfo.OutputUrl = argv[4];
+    videoinfo.OutputType = argv[5];
+    videoinfo.VideoEncoderName = argv[3];
+    //tiles are rounded down to even sizes and must keep at least 2x2 pixels
+    if ((mosaicinfo.Columns <= 0) || (mosaicinfo.Rows <= 0)
+        || (((videoinfo.VideoWidth / mosaicinfo.Columns) & ~1) < 2) || (((videoinfo.VideoHeight / mosaicinfo.Rows) & ~1) < 2))
+    {
+        fprintf(stderr, "Invalid mosaic grid '%s' for %dx%d output\n", argv[2], videoinfo.VideoWidth, videoinfo.VideoHeight);
+        return -1;
+    }
+
+    std::vector<char*> inputs(argv + 6, argv + argc);
+    MosaicTranscode* mosaic = new MosaicTranscode(inputs, &mosaicinfo, &videoinfo);
+    wait_stop();
+    delete mosaic;
+    return 0;
+}
+
+static int mpts_main(int argc, char **argv)
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "Usage: %s --mpts <input> <encode codec> <output type> <program>=<output file> [<program>=<output file> ...]\n", argv[0]);
+        return -1;
+    }
+    AudioEncodeInfo audioinfo;
+    audioinfo.ChannelLayOut = AV_CH_LAYOUT_STEREO;
+    audioinfo.SampleRate = 48000;
+    audioinfo.BitRate = 128000;
+    audioinfo.SampleFmt = AV_SAMPLE_FMT_S16;
+
+    MptsDemux* demux = new MptsDemux(argv[2], 50);
+    std::vector<OutputInfo> videoinfos(argc - 5);
+    for (int i = 5; i < argc; i++)
+    {
+        OutputInfo& videoinfo = videoinfos[i - 5];
+        char* output = strchr(argv[i], '=');
+        if (!output)
+        {
+            fprintf(stderr, "Expected <program>=<output file>, got '%s'\n", argv[i]);
+            return -1;
+        }
+        *output++ = 0;
+        videoinfo.VideoWidth = 1280;
+        videoinfo.VideoHeight = 720;
+        videoinfo.VideoBitrate = 2000000;
+        videoinfo.VideoProfile = FF_PROFILE_H264_HIGH;
+        videoinfo.OutputUrl = output;
+        videoinfo.OutputType = argv[4];
+        videoinfo.VideoEncoderName = argv[3];
+        videoinfo.CpuEncoderName = CPU_ENCODER;
+        videoinfo.Program = atoi(argv[i]);
+        demux->AddProgram(&videoinfo, &audioinfo);
+    }
+    wait_stop();
+    delete demux;
+    return 0;
+}
+
+static int batch_main(int argc, char **argv)
+{
+    if (argc != 5)
+    {
+        fprintf(stderr, "Usage: %s --batch <encode codec> <output type> <manifest>\n"
+                        "       manifest lines: <input file> <output file>\n", argv[0]);
+        return -1;
+    }
+    FILE* manifest = fopen(argv[4], "r");
+    if (!manifest)
+    {
+        fprintf(stderr, "Cannot open manifest '%s'\n", argv[4]);
+        return -1;
+    }
+    std::vector<BatchItem> batch;
+    char line[2048];
+    char input[1024];
+    char output[1024];
+    while (fgets(line, sizeof(line), manifest))
+    {
+        if ((line[0] == '#') || (sscanf(line, "%1023s %1023s", input, output) != 2))
+            continue;
+        BatchItem item;
+        item.InputUrl = input;
+        item.OutputUrl = output;
+        batch.push_back(item);
+    }
+    fclose(manifest);
+    if (batch.empty())
+    {
+        fprintf(stderr, "Manifest '%s' has no items\n", argv[4]);
+        return -1;
+    }
+
+    OutputInfo videoinfo;
+    videoinfo.VideoWidth = 1280;
+    videoinfo.VideoHeight = 720;
+    videoinfo.VideoBitrate = 2000000;
+    videoinfo.VideoProfile = FF_PROFILE_H264_HIGH;
+    videoinfo.OutputType = argv[3];
+    videoinfo.VideoEncoderName = argv[2];
+    videoinfo.CpuEncoderName = CPU_ENCODER;
+
+    AudioEncodeInfo audioinfo;
+    audioinfo.ChannelLayOut = AV_CH_LAYOUT_STEREO;
+    audioinfo.SampleRate = 48000;
+    audioinfo.BitRate = 128000;
+    audioinfo.SampleFmt = AV_SAMPLE_FMT_S16;
+
+    QSVTranscode* transcoder = new QSVTranscode(nullptr, &videoinfo, &audioinfo, nullptr, &batch);
+    while (!transcoder->BatchFinished())
+    {
+        av_usleep(100000);
+    }
+    delete transcoder;
+    return 0;
+}
+
+static int parse_profile(const char* encoder, const char* name)
+{
+    //a profile name from the codec descriptor, e.g. "High" or "Main 10", or the FF_PROFILE_* number
+    const AVCodec* codec = avcodec_find_encoder_by_name(encoder);
+    const AVCodecDescriptor* desc = codec ? avcodec_descriptor_get(codec->id) : nullptr;
+    if (desc && desc->profiles)
+    {
+        for (const AVProfile* profile = desc->profiles; profile->profile != FF_PROFILE_UNKNOWN; profile++)
+        {
+            if (!strcasecmp(profile->name, name))
+                return profile->profile;
+        }
+    }
+    char* end = nullptr;
+    long profile = strtol(name, &end, 10);
+    return ((end == name) || *end) ? FF_PROFILE_UNKNOWN : (int)profile;
+}
+
+static int tune_main(int argc, char **argv)
+{
+    //tune for the size, bitrate and profile the sessions run with, the best settings differ between them
+    OutputInfo videoinfo;
+    if ((argc < 8) || (argc > 10) || (sscanf(argv[5], "%dx%d", &videoinfo.VideoWidth, &videoinfo.VideoHeight) != 2))
+    {
+        fprintf(stderr, "Usage: %s --tune <input> <encode codec> <profile file> <width>x<height> <bitrate> <codec profile> [min fps] [max latency ms]\n", argv[0]);
+        return -1;
+    }
+    videoinfo.VideoBitrate = atoi(argv[6]);
+    videoinfo.VideoProfile = parse_profile(argv[3], argv[7]);
+    videoinfo.VideoEncoderName = argv[3];
+    if ((videoinfo.VideoWidth <= 0) || (videoinfo.VideoHeight <= 0) || (videoinfo.VideoBitrate <= 0))
+    {
+        fprintf(stderr, "Invalid size '%s' or bitrate '%s'\n", argv[5], argv[6]);
+        return -1;
+    }
+    if (videoinfo.VideoProfile == FF_PROFILE_UNKNOWN)
+    {
+        fprintf(stderr, "Unknown profile '%s' for encoder '%s'\n", argv[7], argv[3]);
+        return -1;
+    }
+
+    TuneBudget budget;
+    if (argc > 8)
+        budget.MinFps = atof(argv[8]);
+    if (argc > 9)
+        budget.MaxLatencyMs = atof(argv[9]);
+
+    EncoderProfileInfo best;
+    EncoderTuner tuner(argv[2], &videoinfo);
+    if (!tuner.Run(budget, &best))
+        return -1;
+    if (!EncoderProfile::Save(argv[4], best))
+    {
+        fprintf(stderr, "Cannot write profile '%s'\n", argv[4]);
+        return -1;
+    }
+    printf("Profile %s written to %s\n", EncoderProfile::Describe(best).c_str(), argv[4]);
+    return 0;
+}
+
+static int rewind_main(int argc, char **argv)
+{
+    //copies the recorded window from <seconds back> up to now into a playable mpegts file
+    if (argc != 5)
+    {
+        fprintf(stderr, "Usage: %s --rewind <timeshift ring> <seconds back> <output file>\n", argv[0]);
+        return -1;
+    }
+    TimeshiftIndex index;
+    if (!index.OpenRead(std::string(argv[2]) + ".idx"))
+        return -1;
+    int ring = open(argv[2], O_RDONLY | O_CLOEXEC);
+    if (ring < 0)
+    {
+        fprintf(stderr, "Cannot open timeshift ring '%s'\n", argv[2]);
+        return -1;
+    }
+    FILE* out = fopen(argv[4], "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Cannot create '%s'\n", argv[4]);
+        close(ring);
+        return -1;
+    }
+    TimeshiftEntry entry;
+    int64_t time = av_gettime() / 1000 - (int64_t)(atof(argv[3]) * 1000);
+    uint64_t end = index.Head();
+    int segments = 0;
+    bool found = index.Find(time, &entry);
+    std::vector<uint8_t> data;
+    for (uint64_t seq = found ? entry.Seq : end; seq < end; seq++)
+    {
+        //segments overwritten while copying are skipped, the writer does not wait for readers
+        if (!index.Get(seq, &entry) || !TimeshiftRing::Read(ring, index, entry, &data))
+            continue;
+        fwrite(&data[0], 1, data.size(), out);
+        segments++;
+    }
+    fclose(out);
+    close(ring);
+    printf("%d segments written to %s\n", segments, argv[4]);
+    return segments ? 0 : -1;
+}
+
+static bool parse_capacity(const char* value)
+{
+    //<qsv pixels/s>:<cpu pixels/s>:<reserve>:<queue|reject>, 0 keeps a default pixel rate
+    double qsvrate = 0, cpurate = 0, reserve = 0;
+    char full[16] = {0};
+    if ((sscanf(value, "%lf:%lf:%lf:%15s", &qsvrate, &cpurate, &reserve, full) != 4)
+        || (reserve < 0) || (reserve >= 1) || (strcmp(full, "queue") && strcmp(full, "reject")))
+        return false;
+    CapacityModel::Instance().Configure(qsvrate, cpurate, reserve, !strcmp(full, "queue"));
+    return true;
+}
 
 int main(int argc, char **argv)
 {
+    //process wide options come before the mode
+    while ((argc > 2) && (!strcmp(argv[1], "--metrics") || !strcmp(argv[1], "--capacity")))
+    {
+        if (!strcmp(argv[1], "--metrics"))
+        {
+            Metrics::WriteEvery(argv[2], 1000);
+        }
+        else if (!parse_capacity(argv[2]))
+        {
+            fprintf(stderr, "Usage: %s --capacity <qsv pixels/s>:<cpu pixels/s>:<reserve>:<queue|reject> ...\n", argv[0]);
+            return -1;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--mosaic"))
+    {
+        return mosaic_main(argc, argv);
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--mpts"))
+    {
+        return mpts_main(argc, argv);
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--batch"))
+    {
+        return batch_main(argc, argv);
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--tune"))
+    {
+        return tune_main(argc, argv);
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--rewind"))
+    {
+        return rewind_main(argc, argv);
+    }
     if ((argc != 4) && (argc != 5))
     {
         fprintf(stderr, "Usage: %s <input file> <encode codec> <output file> <output type>\n", argv[0]);
@@ -17,6 +330,7 @@ int main(int argc, char **argv)
     videoinfo.OutputUrl = argv[3];
     videoinfo.OutputType = argv[4];
     videoinfo.VideoEncoderName = argv[2];
+    videoinfo.CpuEncoderName = CPU_ENCODER;
 
     AudioEncodeInfo audioinfo;
     audioinfo.ChannelLayOut = AV_CH_LAYOUT_STEREO;
@@ -25,9 +339,10 @@ int main(int argc, char **argv)
     audioinfo.SampleFmt = AV_SAMPLE_FMT_S16;
 
     QSVTranscode* transcoder = new QSVTranscode(argv[1], &videoinfo, &audioinfo);
-    while(true)
+    while(!transcoder->BatchFinished())
     {
         av_usleep(1000000);
     }
+    delete transcoder;
     return 0;
 }